@@ -134,6 +134,7 @@ testScripts = [
     'sendheaders.py',
     'keypool.py',
     'prioritise_transaction.py',
+    'auxblocks.py',
     'invalidblockrequest.py',
     'invalidtxrequest.py',
     'abandonconflict.py',
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test the merge-mining RPCs getauxblock, createauxblocks and submitauxblocks
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.auxpow import solve_auxblock
+
+class AuxBlocksTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.setup_clean_chain = False
+        self.num_nodes = 2
+
+    def setup_network(self):
+        # A small template store, so that a few dozen payout addresses evict work
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, [["-auxblockstoresize=16"], []])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        node = self.nodes[0]
+        addresses = [node.getnewaddress() for i in range(3)]
+
+        print("Create work for several payout addresses...")
+        work = node.createauxblocks(addresses)
+        assert_equal(len(work), 3)
+        assert_equal([w['address'] for w in work], addresses)
+        assert_equal(len(set(w['hash'] for w in work)), 3)
+        for w in work:
+            assert_equal(w['chainid'], work[0]['chainid'])
+            assert_equal(w['target'], work[0]['target'])
+        # The same addresses get the same work until the tip changes
+        assert_equal([w['hash'] for w in node.createauxblocks(addresses)], [w['hash'] for w in work])
+
+        print("Submit several solutions at once...")
+        height = node.getblockcount()
+        result = node.submitauxblocks([
+            {"hash": work[0]['hash'], "auxpow": solve_auxblock(work[0])},
+            {"hash": work[1]['hash'], "auxpow": solve_auxblock(work[1])},
+            {"hash": work[2]['hash'], "auxpow": "00"},
+            {"hash": "00" * 32, "auxpow": solve_auxblock(work[2])},
+        ])
+        # The second block is a sibling of the first, which became the tip
+        assert_equal(result, [True, "inconclusive", "decode-failed", "stale-work"])
+        assert_equal(node.getblockcount(), height + 1)
+        assert_equal(node.getbestblockhash(), work[0]['hash'])
+        self.sync_all()
+        assert_equal(self.nodes[1].getbestblockhash(), work[0]['hash'])
+
+        # Resubmitting a block we already have
+        assert_equal(node.submitauxblocks([{"hash": work[0]['hash'], "auxpow": solve_auxblock(work[0])}]), ["duplicate"])
+
+        print("Work goes stale when the tip changes...")
+        work = node.createauxblocks(addresses[:1])
+        auxblock = node.getauxblock()
+        self.nodes[1].generate(1)
+        self.sync_all()
+        assert_equal(node.submitauxblocks([{"hash": work[0]['hash'], "auxpow": solve_auxblock(work[0])}]), ["stale-work"])
+        assert_equal(node.getauxblock(auxblock['hash'], solve_auxblock(auxblock)), "stale-work")
+
+        print("getauxblock still rejects a malformed auxpow with an error...")
+        auxblock = node.getauxblock()
+        assert_raises(JSONRPCException, node.getauxblock, auxblock['hash'], "00")
+        assert_equal(node.getauxblock(auxblock['hash'], solve_auxblock(auxblock)), True)
+        self.sync_all()
+
+        print("The oldest work is evicted once the store is full...")
+        addresses = [node.getnewaddress() for i in range(40)]
+        work = node.createauxblocks(addresses)
+        assert_equal(len(work), 40)
+        assert_equal(node.submitauxblocks([{"hash": work[0]['hash'], "auxpow": solve_auxblock(work[0])}]), ["stale-work"])
+        assert_equal(node.submitauxblocks([{"hash": work[-1]['hash'], "auxpow": solve_auxblock(work[-1])}]), [True])
+        self.sync_all()
+        assert_equal(self.nodes[1].getbestblockhash(), work[-1]['hash'])
+
+if __name__ == '__main__':
+    AuxBlocksTest().main()
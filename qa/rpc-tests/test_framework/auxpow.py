@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# auxpow.py - Solve merge-mining work with a minimal parent block
+#
+
+import struct
+
+from .mininode import CBlockHeader, hash256, ser_compact_size, ser_uint256, uint256_from_str
+from .util import bytes_to_hex_str, hex_str_to_bytes
+
+MERGED_MINING_HEADER = b'\xfa\xbe\x6d\x6d'
+
+def solve_auxblock(work):
+    """Return the hex auxpow solving work, an object from getauxblock or createauxblocks.
+
+    The parent coinbase commits to the block hash alone, with a chain merkle
+    tree of size 1, and the parent header is ground until its scrypt hash
+    meets the target."""
+    target = uint256_from_str(hex_str_to_bytes(work['target']))
+
+    # The chain merkle root goes into the script in display byte order.
+    data = MERGED_MINING_HEADER + hex_str_to_bytes(work['hash']) + struct.pack("<ii", 1, 0)
+    coinbase = struct.pack("<i", 1)
+    coinbase += ser_compact_size(1) + b'\x00' * 32 + struct.pack("<I", 0xffffffff)
+    coinbase += ser_compact_size(len(data)) + data + struct.pack("<I", 0xffffffff)
+    coinbase += ser_compact_size(0) + struct.pack("<I", 0)
+
+    parent = CBlockHeader()
+    parent.nVersion = 1
+    parent.hashMerkleRoot = uint256_from_str(hash256(coinbase))
+    parent.rehash()
+    while parent.scrypt256 > target:
+        assert parent.nNonce < 0xffffffff
+        parent.nNonce += 1
+        parent.rehash()
+
+    auxpow = coinbase
+    auxpow += ser_uint256(parent.sha256)
+    auxpow += ser_compact_size(0) + struct.pack("<i", 0) # parent merkle branch and index
+    auxpow += ser_compact_size(0) + struct.pack("<i", 0) # chain merkle branch and index
+    auxpow += parent.serialize()
+    return bytes_to_hex_str(auxpow)
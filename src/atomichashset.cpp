@@ -0,0 +1,162 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "atomichashset.h"
+
+#include "crypto/common.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <new>
+
+namespace {
+
+/** Header bits: a writer holds the bucket */
+const uint32_t LOCKED = 1;
+/** Header bits: way w holds an element */
+inline uint32_t Occupied(int w) { return 2u << w; }
+/** Header bits: way w holds an erased element */
+inline uint32_t Erased(int w) { return 16u << w; }
+/** The version counts writes in the bits above the flags */
+const int VERSION_SHIFT = 7;
+
+/** Map a uniform 32-bit word onto [0, n) without a division */
+inline uint32_t Reduce(uint32_t x, uint32_t n)
+{
+    return ((uint64_t)x * n) >> 32;
+}
+
+}
+
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "buckets assume 4-byte atomic words");
+
+CAtomicHashSet::CAtomicHashSet() : pAlloc(NULL), pBuckets(NULL), nBuckets(0)
+{
+    static_assert(sizeof(Bucket) == 64, "a bucket must fill one cache line");
+}
+
+CAtomicHashSet::~CAtomicHashSet()
+{
+    delete[] pAlloc;
+}
+
+void CAtomicHashSet::Resize(size_t nBytes)
+{
+    delete[] pAlloc;
+    pAlloc = NULL;
+    pBuckets = NULL;
+    nBuckets = std::min<size_t>(nBytes / sizeof(Bucket), 0xffffffff);
+    if (nBuckets == 0)
+        return;
+
+    // Align the buckets on cache lines, so a lookup touches one line each.
+    pAlloc = new unsigned char[(size_t)nBuckets * sizeof(Bucket) + sizeof(Bucket) - 1];
+    uintptr_t nAligned = ((uintptr_t)pAlloc + sizeof(Bucket) - 1) & ~(uintptr_t)(sizeof(Bucket) - 1);
+    pBuckets = reinterpret_cast<Bucket*>(nAligned);
+    for (uint32_t i = 0; i < nBuckets; i++) {
+        Bucket* bucket = new (&pBuckets[i]) Bucket;
+        bucket->header.store(0, std::memory_order_relaxed);
+        for (int w = 0; w < WAYS; w++)
+            for (int j = 0; j < KEY_WORDS; j++)
+                bucket->key[w][j].store(0, std::memory_order_relaxed);
+    }
+}
+
+CAtomicHashSet::Bucket& CAtomicHashSet::GetBucket(uint32_t nWord) const
+{
+    return pBuckets[Reduce(nWord, nBuckets)];
+}
+
+bool CAtomicHashSet::Find(Bucket& bucket, const uint32_t* key, bool fErase) const
+{
+    const uint32_t nHeader = bucket.header.load(std::memory_order_acquire);
+    if (nHeader & LOCKED)
+        return false;
+    int nFound = -1;
+    for (int w = 0; w < WAYS; w++) {
+        if (!(nHeader & Occupied(w)))
+            continue;
+        bool fMatch = true;
+        for (int j = 0; j < KEY_WORDS; j++)
+            fMatch &= bucket.key[w][j].load(std::memory_order_relaxed) == key[j];
+        if (fMatch)
+            nFound = w;
+    }
+    // The ways read above are only consistent if no writer came in meanwhile.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (nFound < 0 || bucket.header.load(std::memory_order_relaxed) != nHeader)
+        return false;
+    if (fErase) {
+        // Only flag the way if it still holds what was just read.
+        uint32_t nExpected = nHeader;
+        bucket.header.compare_exchange_strong(nExpected, nHeader | Erased(nFound), std::memory_order_relaxed);
+    }
+    return true;
+}
+
+bool CAtomicHashSet::Store(Bucket& bucket, const uint32_t* key)
+{
+    uint32_t nHeader = bucket.header.load(std::memory_order_relaxed);
+    if ((nHeader & LOCKED) || !bucket.header.compare_exchange_strong(nHeader, nHeader | LOCKED, std::memory_order_acquire))
+        return false;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Reuse an empty or erased way, otherwise evict the ways in turn.
+    int nWay = (nHeader >> VERSION_SHIFT) % WAYS;
+    for (int w = WAYS - 1; w >= 0; w--) {
+        if (!(nHeader & Occupied(w)) || (nHeader & Erased(w)))
+            nWay = w;
+    }
+    for (int j = 0; j < KEY_WORDS; j++)
+        bucket.key[nWay][j].store(key[j], std::memory_order_relaxed);
+
+    nHeader = ((nHeader & ~Erased(nWay)) | Occupied(nWay)) + (1u << VERSION_SHIFT);
+    bucket.header.store(nHeader, std::memory_order_release);
+    return true;
+}
+
+bool CAtomicHashSet::Contains(const uint256& hash, bool fErase) const
+{
+    if (nBuckets == 0)
+        return false;
+    const unsigned char* p = hash.begin();
+    uint32_t key[KEY_WORDS];
+    for (int j = 0; j < KEY_WORDS; j++)
+        key[j] = ReadLE32(p + 4 * j);
+    return Find(GetBucket(ReadLE32(p + 20)), key, fErase) ||
+           Find(GetBucket(ReadLE32(p + 24)), key, fErase);
+}
+
+void CAtomicHashSet::Insert(const uint256& hash)
+{
+    if (nBuckets == 0 || Contains(hash, false))
+        return;
+    const unsigned char* p = hash.begin();
+    uint32_t key[KEY_WORDS];
+    for (int j = 0; j < KEY_WORDS; j++)
+        key[j] = ReadLE32(p + 4 * j);
+
+    // Prefer a bucket with room; if both are full, let the hash pick which
+    // one evicts, so both see their ways recycled.
+    Bucket* buckets[2] = {&GetBucket(ReadLE32(p + 20)), &GetBucket(ReadLE32(p + 24))};
+    const uint32_t nFull = Occupied(0) | Occupied(1) | Occupied(2);
+    int nChoice = p[28] & 1;
+    for (int i = 1; i >= 0; i--) {
+        const uint32_t nHeader = buckets[i]->header.load(std::memory_order_relaxed);
+        if ((nHeader & nFull) != nFull || (nHeader & (Erased(0) | Erased(1) | Erased(2))))
+            nChoice = i;
+    }
+    Store(*buckets[nChoice], key);
+}
+
+size_t CAtomicHashSet::GetCount() const
+{
+    size_t nCount = 0;
+    for (uint32_t i = 0; i < nBuckets; i++) {
+        const uint32_t nHeader = pBuckets[i].header.load(std::memory_order_relaxed);
+        for (int w = 0; w < WAYS; w++)
+            nCount += (nHeader & Occupied(w)) && !(nHeader & Erased(w));
+    }
+    return nCount;
+}
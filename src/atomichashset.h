@@ -0,0 +1,84 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ATOMICHASHSET_H
+#define BITCOIN_ATOMICHASHSET_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+class uint256;
+
+/**
+ * Fixed-size set of 256-bit hashes that any number of threads can query and
+ * fill without taking a lock. Elements must already be uniformly distributed,
+ * like the salted hashes of the signature cache, as their bits are used
+ * directly to place them.
+ *
+ * The table is an array of cache-line sized buckets of three ways, and an
+ * element may sit in either of two buckets. A way keeps 160 bits of the
+ * element, so a lookup of an element that was never inserted matches with
+ * probability about 2^-157.
+ *
+ * Each bucket starts with a header word holding a writer bit and a version.
+ * A reader checks that the header did not change around its read and a
+ * writer claims the bucket by setting the bit. Neither ever waits: a reader
+ * racing a writer reports a miss and a writer finding its bucket busy drops
+ * the element, both of which only cost the caller a recomputation.
+ *
+ * Erasure is lazy: an erased element stays visible until its way is reused,
+ * which happens before any live element in the bucket is evicted.
+ */
+class CAtomicHashSet
+{
+private:
+    static const int WAYS = 3;
+    static const int KEY_WORDS = 5;
+
+    struct Bucket
+    {
+        std::atomic<uint32_t> header;
+        std::atomic<uint32_t> key[WAYS][KEY_WORDS];
+    };
+
+    unsigned char* pAlloc;
+    Bucket* pBuckets;
+    uint32_t nBuckets;
+
+    Bucket& GetBucket(uint32_t nWord) const;
+    bool Find(Bucket& bucket, const uint32_t* key, bool fErase) const;
+    bool Store(Bucket& bucket, const uint32_t* key);
+
+    CAtomicHashSet(const CAtomicHashSet&);
+    CAtomicHashSet& operator=(const CAtomicHashSet&);
+
+public:
+    CAtomicHashSet();
+    ~CAtomicHashSet();
+
+    /** Replace the table by an empty one of at most nBytes. Not thread safe. */
+    void Resize(size_t nBytes);
+
+    /** Whether hash is in the set, marking it for reuse if fErase is set. */
+    bool Contains(const uint256& hash, bool fErase) const;
+    void Insert(const uint256& hash);
+
+    //! Number of elements in the set, counted by a scan of the table
+    size_t GetCount() const;
+    size_t GetCapacity() const { return (size_t)nBuckets * WAYS; }
+    size_t DynamicMemoryUsage() const { return (size_t)nBuckets * sizeof(Bucket); }
+};
+
+/** Contents and lookup counters of a cache kept in a CAtomicHashSet */
+struct CHashCacheStats
+{
+    size_t nCount;
+    size_t nCapacity;
+    size_t nUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+};
+
+#endif // BITCOIN_ATOMICHASHSET_H
@@ -6,9 +6,11 @@
 #include "init.h"
 #include "primitives/block.h"
 #include "chainparams.h"
+#include "consensus/merkle.h"
 #include "util.h"
 #include "base58.h"
 #include "auxpow.h"
+#include "hash.h"
 
 using namespace std;
 using namespace boost;
@@ -30,67 +32,64 @@ void RemoveMergedMiningHeader(vector<unsigned char>& vchAux)
     vchAux.erase(vchAux.begin(), vchAux.begin() + sizeof(pchMergedMiningHeader));
 }
 
-uint256 CAuxPow::CheckMerkleBranch(const uint256& hash, const std::vector<uint256>& vMerkleBranch, int nIndex) const
+uint256 CAuxPow::CheckMerkleBranch(const uint256& hash, const std::vector<uint256>& vMerkleBranch, int nIndex)
 {
-  uint256 thash = hash;
   if (nIndex == -1)
     return uint256();
-  for (std::vector<uint256>::const_iterator it(vMerkleBranch.begin()); it != vMerkleBranch.end(); ++it)
-  {
-    if (nIndex & 1)
-      thash = Hash(BEGIN(*it), END(*it), BEGIN(thash), END(thash));
-    else
-      thash = Hash(BEGIN(thash), END(thash), BEGIN(*it), END(*it));
-    nIndex >>= 1;
-  }
-  return thash;
+  return ComputeMerkleRootFromBranch(hash, vMerkleBranch, nIndex);
 }
 
 bool CAuxPow::Check(const uint256& hashAuxBlock, int nChainID, const Consensus::Params& params) const
 {
     if (nIndex != 0)
         return error("AuxPow is not a generate");
-   LogPrintf("CAuxPow::Check(): nChainID = %02x\n", nChainID); // LED TMP
-   LogPrintf("%s\n", parentBlockHeader.ToString()); // LED TMP
+    if (LogAcceptCategory("auxpow"))
+        LogPrint("auxpow", "CAuxPow::Check(): nChainID = %02x, chain merkle branch size = %u, parent: %s\n",
+                 nChainID, vChainMerkleBranch.size(), parentBlockHeader.ToString());
     if (!params.fPowAllowMinDifficultyBlocks && parentBlockHeader.GetChainID() == nChainID)
         return error("Aux POW parent has our chain ID");
 
-   LogPrintf("vChainMerkleBranch.size() = %d\n", vChainMerkleBranch.size()); // LED TMP
     if (vChainMerkleBranch.size() > 30)
         return error("Aux POW chain merkle branch too long");
 
     // Check that the chain merkle root is in the coinbase
     const uint256 nRootHash = CheckMerkleBranch(hashAuxBlock, vChainMerkleBranch, nChainIndex);
-    vector<unsigned char> vchRootHash(nRootHash.begin(), nRootHash.end());
-    std::reverse(vchRootHash.begin(), vchRootHash.end()); // correct endian
+    unsigned char vchRootHash[32];
+    std::reverse_copy(nRootHash.begin(), nRootHash.end(), vchRootHash); // correct endian
 
     // Check that we are in the parent block merkle tree
     if (CheckMerkleBranch(GetHash(), vMerkleBranch, nIndex) != parentBlockHeader.hashMerkleRoot)
 
         return error("Aux POW merkle root incorrect");
 
-    const CScript script = vin[0].scriptSig;
+    if (vin.empty())
+        return error("Aux POW coinbase has no inputs");
+
+    // Work on the script in place rather than on a copy.
+    const CScript& script = vin[0].scriptSig;
+    const CScript::const_iterator pbegin = script.begin();
+    const CScript::const_iterator pend = script.end();
 
     // Check that the same work is not submitted twice to our chain.
     //
 
     CScript::const_iterator pcHead =
-        std::search(script.begin(), script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
+        std::search(pbegin, pend, UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader));
 
     CScript::const_iterator pc =
-        std::search(script.begin(), script.end(), vchRootHash.begin(), vchRootHash.end());
+        std::search(pbegin, pend, vchRootHash, vchRootHash + sizeof(vchRootHash));
 
-    if (pcHead == script.end())
+    if (pcHead == pend)
         return error("MergedMiningHeader missing from parent coinbase");
 
-    if (pc == script.end())
+    if (pc == pend)
         return error("Aux POW missing chain merkle root in parent coinbase");
 
-    if (pcHead != script.end())
+    if (pcHead != pend)
     {
         // Enforce only one chain merkle root by checking that a single instance of the merged
         // mining header exists just before.
-        if (script.end() != std::search(pcHead + 1, script.end(), UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader)))
+        if (pend != std::search(pcHead + 1, pend, UBEGIN(pchMergedMiningHeader), UEND(pchMergedMiningHeader)))
             return error("Multiple merged mining headers in coinbase");
         if (pcHead + sizeof(pchMergedMiningHeader) != pc)
             return error("Merged mining header is not just before chain merkle root");
@@ -100,15 +99,15 @@ bool CAuxPow::Check(const uint256& hashAuxBlock, int nChainID, const Consensus::
         // For backward compatibility.
         // Enforce only one chain merkle root by checking that it starts early in the coinbase.
         // 8-12 bytes are enough to encode extraNonce and nBits.
-        if (pc - script.begin() > 20)
+        if (pc - pbegin > 20)
             return error("Aux POW chain merkle root must start in the first 20 bytes of the parent coinbase");
     }
 
 
     // Ensure we are at a deterministic point in the merkle leaves by hashing
     // a nonce and our chain ID and comparing to the index.
-    pc += vchRootHash.size();
-    if (script.end() - pc < 8)
+    pc += sizeof(vchRootHash);
+    if (pend - pc < 8)
         return error("Aux POW missing chain merkle tree size and nonce in parent coinbase");
 
     int nSize;
@@ -136,6 +135,59 @@ bool CAuxPow::Check(const uint256& hashAuxBlock, int nChainID, const Consensus::
     return true;
 }
 
+/** The chain merkle root as it appears in the parent coinbase script */
+static std::vector<unsigned char> GetChainRootBytes(const uint256& hashAuxBlock, const std::vector<uint256>& vChainMerkleBranch, unsigned int nChainIndex)
+{
+    const uint256 hashRoot = CAuxPow::CheckMerkleBranch(hashAuxBlock, vChainMerkleBranch, nChainIndex);
+    std::vector<unsigned char> vchRoot(hashRoot.begin(), hashRoot.end());
+    std::reverse(vchRoot.begin(), vchRoot.end());
+    return vchRoot;
+}
+
+unsigned char CAuxPowCompressor::Compress(CMutableTransaction& tx, unsigned int& nRootPos) const
+{
+    const CAuxPow& pow = *auxpow;
+    if (pow.nIndex != 0 || pow.IsNull() || pow.vin.empty() || pow.parentBlockHeader.IsAuxPow())
+        return 0;
+    if (pow.hashBlock != pow.parentBlockHeader.GetHash())
+        return 0;
+    if (CAuxPow::CheckMerkleBranch(pow.GetHash(), pow.vMerkleBranch, 0) != pow.parentBlockHeader.hashMerkleRoot)
+        return 0;
+    unsigned char nFlags = COMPACT_PARENT;
+
+    tx = CMutableTransaction(pow);
+    CScript& script = tx.vin[0].scriptSig;
+    const std::vector<unsigned char> vchRoot = GetChainRootBytes(hashAuxBlock, pow.vChainMerkleBranch, pow.nChainIndex);
+    CScript::iterator pc = std::search(script.begin(), script.end(), vchRoot.begin(), vchRoot.end());
+    if (pc != script.end()) {
+        nRootPos = pc - script.begin();
+        script.erase(pc, pc + vchRoot.size());
+        nFlags |= COMPACT_CHAIN_ROOT;
+    }
+    return nFlags;
+}
+
+void CAuxPowCompressor::Decompress(unsigned char nFlags, CMutableTransaction& tx, unsigned int nRootPos, const std::vector<uint256>& vMerkleBranch,
+                                   const std::vector<uint256>& vChainMerkleBranch, unsigned int nChainIndex, CBlockHeader& parent)
+{
+    if (nFlags & COMPACT_CHAIN_ROOT) {
+        if (tx.vin.empty() || nRootPos > tx.vin[0].scriptSig.size())
+            throw std::ios_base::failure("CAuxPowCompressor::Decompress(): chain merkle root position out of range");
+        const std::vector<unsigned char> vchRoot = GetChainRootBytes(hashAuxBlock, vChainMerkleBranch, nChainIndex);
+        CScript& script = tx.vin[0].scriptSig;
+        script.insert(script.begin() + nRootPos, vchRoot.begin(), vchRoot.end());
+    }
+
+    auxpow.reset(new CAuxPow(CTransaction(tx)));
+    auxpow->vMerkleBranch = vMerkleBranch;
+    auxpow->nIndex = 0;
+    auxpow->vChainMerkleBranch = vChainMerkleBranch;
+    auxpow->nChainIndex = nChainIndex;
+    parent.hashMerkleRoot = CAuxPow::CheckMerkleBranch(auxpow->GetHash(), vMerkleBranch, 0);
+    auxpow->parentBlockHeader = parent;
+    auxpow->hashBlock = parent.GetHash();
+}
+
 void CBlockHeader::SetAuxPow(CAuxPow* pow)
 {
     if (pow != nullptr)
@@ -144,16 +196,3 @@ void CBlockHeader::SetAuxPow(CAuxPow* pow)
         nVersion &= ~AuxPow::BLOCK_VERSION_AUXPOW;
     auxpow.reset(pow);
 }
-
-CKeyID GetAuxpowMiningKey(void)
-{
-    CKeyID result;
-    CBitcoinAddress auxminingaddr(GetArg("-auxminingaddr", ""));
-    if (!auxminingaddr.GetKeyID(result)) {
-        CReserveKey reservekey(pwalletMain);
-        CPubKey pubkey;
-        reservekey.GetReservedKey(pubkey);
-        result = pubkey.GetID();
-    }
-    return result;
-}
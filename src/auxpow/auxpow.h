@@ -45,7 +45,7 @@ public:
         READWRITE(parentBlockHeader);
     }
 
-    uint256 CheckMerkleBranch(const uint256& hash, const std::vector<uint256>& vMerkleBranch, int nIndex) const;
+    static uint256 CheckMerkleBranch(const uint256& hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
     bool Check(const uint256& hashAuxBlock, int nChainID, const Consensus::Params& params) const;
 
     inline uint256 GetParentBlockHash()
@@ -55,6 +55,85 @@ public:
     }
 };
 
+/**
+ * Compact on-disk encoding of an auxpow, used by the block tree database.
+ * Data that can be recomputed from the rest of the auxpow and the hash of the
+ * merge-mined block is left out:
+ *  - the parent block hash (hashBlock) and nIndex, which is always 0,
+ *  - the parent block merkle root, which follows from the coinbase and its branch,
+ *  - the chain merkle root in the parent coinbase script.
+ * Auxpows that don't have this shape are stored in full behind a zero flag byte.
+ */
+class CAuxPowCompressor
+{
+private:
+    std::shared_ptr<CAuxPow>& auxpow;
+    const uint256 hashAuxBlock;
+
+protected:
+    enum {
+        COMPACT_PARENT     = (1 << 0),
+        COMPACT_CHAIN_ROOT = (1 << 1),
+    };
+
+    unsigned char Compress(CMutableTransaction& tx, unsigned int& nRootPos) const;
+    void Decompress(unsigned char nFlags, CMutableTransaction& tx, unsigned int nRootPos, const std::vector<uint256>& vMerkleBranch,
+                    const std::vector<uint256>& vChainMerkleBranch, unsigned int nChainIndex, CBlockHeader& parent);
+
+public:
+    CAuxPowCompressor(std::shared_ptr<CAuxPow>& auxpowIn, const uint256& hashAuxBlockIn) : auxpow(auxpowIn), hashAuxBlock(hashAuxBlockIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        CMutableTransaction tx;
+        unsigned int nRootPos = 0;
+        const unsigned char nFlags = Compress(tx, nRootPos);
+        s << nFlags;
+        if (!(nFlags & COMPACT_PARENT)) {
+            ::Serialize(s, *auxpow, nType, nVersion);
+            return;
+        }
+        ::Serialize(s, tx, nType, nVersion);
+        if (nFlags & COMPACT_CHAIN_ROOT)
+            s << VARINT(nRootPos);
+        s << auxpow->vMerkleBranch;
+        s << auxpow->vChainMerkleBranch;
+        s << VARINT(auxpow->nChainIndex);
+        const CBlockHeader& parent = auxpow->parentBlockHeader;
+        s << parent.nVersion << parent.hashPrevBlock << parent.nTime << parent.nBits << parent.nNonce;
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned char nFlags = 0;
+        s >> nFlags;
+        if (!(nFlags & COMPACT_PARENT)) {
+            auxpow.reset(new CAuxPow());
+            ::Unserialize(s, *auxpow, nType, nVersion);
+            return;
+        }
+        CMutableTransaction tx;
+        ::Unserialize(s, tx, nType, nVersion);
+        unsigned int nRootPos = 0;
+        if (nFlags & COMPACT_CHAIN_ROOT)
+            s >> VARINT(nRootPos);
+        std::vector<uint256> vMerkleBranch, vChainMerkleBranch;
+        unsigned int nChainIndex = 0;
+        s >> vMerkleBranch;
+        s >> vChainMerkleBranch;
+        s >> VARINT(nChainIndex);
+        CBlockHeader parent;
+        s >> parent.nVersion >> parent.hashPrevBlock >> parent.nTime >> parent.nBits >> parent.nNonce;
+        Decompress(nFlags, tx, nRootPos, vMerkleBranch, vChainMerkleBranch, nChainIndex, parent);
+    }
+};
+
 template<typename Stream> void SerReadWrite(Stream& s, std::shared_ptr<CAuxPow>& pobj, int nType, int nVersion, CSerActionSerialize ser_action)
 {
     if (nVersion & AuxPow::BLOCK_VERSION_AUXPOW){
@@ -74,6 +153,5 @@ template<typename Stream> void SerReadWrite(Stream& s, std::shared_ptr<CAuxPow>&
 
 extern void RemoveMergedMiningHeader(std::vector<unsigned char>& vchAux);
 extern int GetAuxPowStartBlock(const Consensus::Params& params);
-extern CKeyID GetAuxpowMiningKey(void);
 
 #endif
@@ -0,0 +1,78 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "auxpow/auxpow.h"
+#include "chainparams.h"
+#include "primitives/block.h"
+#include "script/script.h"
+
+#include <algorithm>
+#include <vector>
+
+static const unsigned char pchMergedMiningHeader[] = { 0xfa, 0xbe, 'm', 'm' };
+
+// Verify a merge-mined auxpow with a four level chain merkle tree and a
+// parent block of a few thousand transactions.
+static void AuxPowCheck(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+    const int nChainID = AuxPow::CHAIN_ID;
+
+    CBlockHeader block;
+    block.nVersion = 2 | AuxPow::BLOCK_VERSION_AUXPOW;
+    block.nTime = 1480000000;
+    block.nBits = 0x1e0ffff0;
+    const uint256 hashAuxBlock = block.GetHash();
+
+    // The slot is fixed by the tree size, the nonce and the chain ID.
+    const int nSize = 16;
+    const int nNonce = 7;
+    unsigned int rand = nNonce;
+    rand = rand * 1103515245 + 12345;
+    rand += nChainID;
+    rand = rand * 1103515245 + 12345;
+    const unsigned int nChainIndex = rand % nSize;
+
+    std::vector<uint256> vChainMerkleBranch(4);
+    for (unsigned int i = 0; i < vChainMerkleBranch.size(); i++)
+        *vChainMerkleBranch[i].begin() = i + 1;
+    const uint256 hashRoot = CAuxPow::CheckMerkleBranch(hashAuxBlock, vChainMerkleBranch, nChainIndex);
+    std::vector<unsigned char> vchRoot(hashRoot.begin(), hashRoot.end());
+    std::reverse(vchRoot.begin(), vchRoot.end());
+
+    CScript scriptSig = CScript() << 420000;
+    scriptSig.insert(scriptSig.end(), pchMergedMiningHeader, pchMergedMiningHeader + sizeof(pchMergedMiningHeader));
+    scriptSig.insert(scriptSig.end(), vchRoot.begin(), vchRoot.end());
+    scriptSig.insert(scriptSig.end(), (const unsigned char*)&nSize, (const unsigned char*)&nSize + 4);
+    scriptSig.insert(scriptSig.end(), (const unsigned char*)&nNonce, (const unsigned char*)&nNonce + 4);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = scriptSig;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 25 * COIN;
+
+    CAuxPow auxpow((CTransaction(coinbase)));
+    auxpow.vMerkleBranch.resize(12);
+    for (unsigned int i = 0; i < auxpow.vMerkleBranch.size(); i++)
+        *auxpow.vMerkleBranch[i].begin() = 0x80 + i;
+    auxpow.nIndex = 0;
+    auxpow.vChainMerkleBranch = vChainMerkleBranch;
+    auxpow.nChainIndex = nChainIndex;
+    auxpow.parentBlockHeader.nVersion = 2;
+    auxpow.parentBlockHeader.hashMerkleRoot = CAuxPow::CheckMerkleBranch(auxpow.GetHash(), auxpow.vMerkleBranch, 0);
+    auxpow.parentBlockHeader.nTime = 1480000123;
+    auxpow.parentBlockHeader.nBits = 0x1b0404cb;
+
+    assert(auxpow.Check(hashAuxBlock, nChainID, params));
+    while (state.KeepRunning()) {
+        auxpow.Check(hashAuxBlock, nChainID, params);
+    }
+}
+
+BENCHMARK(AuxPowCheck);
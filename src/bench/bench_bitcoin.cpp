@@ -4,14 +4,18 @@
 
 #include "bench.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
+#include "pubkey.h"
 #include "util.h"
 
 int
 main(int argc, char** argv)
 {
+    SHA256AutoDetect();
     ECC_Start();
+    ECCVerifyHandle verifyHandle;
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
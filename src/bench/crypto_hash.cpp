@@ -8,8 +8,10 @@
 #include "bloom.h"
 #include "hash.h"
 #include "uint256.h"
+#include "utilstrencodings.h"
 #include "utiltime.h"
 #include "crypto/ripemd160.h"
+#include "crypto/scrypt.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
@@ -51,6 +53,14 @@ static void SHA256_32b(benchmark::State& state)
     }
 }
 
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    while (state.KeepRunning()) {
+        SHA256D64(&in[0], &in[0], 1024);
+    }
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -69,10 +79,37 @@ static void SipHash_32b(benchmark::State& state)
     }
 }
 
+static void Scrypt(benchmark::State& state)
+{
+    std::vector<char> in(80 * 8, 0);
+    uint256 hashes[8];
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 8; i++)
+            scrypt_1024_1_1_256(&in[i * 80], BEGIN(hashes[i]));
+        in[0]++;
+    }
+}
+
+static void Scrypt_Batch(benchmark::State& state)
+{
+    std::vector<char> in(80 * 8, 0);
+    uint256 hashes[8];
+#if defined(USE_SSE2)
+    (void) scrypt_detect_sse2();
+#endif
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_multi(&in[0], BEGIN(hashes[0]), 8);
+        in[0]++;
+    }
+}
+
 BENCHMARK(RIPEMD160);
 BENCHMARK(SHA1);
 BENCHMARK(SHA256);
 BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(Scrypt);
+BENCHMARK(Scrypt_Batch);
 BENCHMARK(SipHash_32b);
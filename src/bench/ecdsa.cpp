@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <vector>
+
+// Verification speed depends on how libsecp256k1 was configured
+// (--enable-endomorphism, --with-ecmult-window); run these against each build.
+
+static void MakeChecks(std::vector<CPubKeySigCheck>& checks, bool fCompressed)
+{
+    for (size_t i = 0; i < checks.size(); i++) {
+        CKey key;
+        key.MakeNewKey(fCompressed);
+        checks[i].pubkey = key.GetPubKey();
+        checks[i].hash = GetRandHash();
+        key.Sign(checks[i].hash, checks[i].vchSig);
+    }
+}
+
+// A single signature, verified from its serialized key each time.
+static void ECDSAVerify(benchmark::State& state)
+{
+    std::vector<CPubKeySigCheck> checks(1);
+    MakeChecks(checks, true);
+    const CPubKeySigCheck& check = checks[0];
+    while (state.KeepRunning()) {
+        bool fValid = check.pubkey.Verify(check.hash, check.vchSig);
+        assert(fValid);
+    }
+}
+
+// The same with an uncompressed key, which skips the square root in parsing.
+static void ECDSAVerifyUncompressed(benchmark::State& state)
+{
+    std::vector<CPubKeySigCheck> checks(1);
+    MakeChecks(checks, false);
+    const CPubKeySigCheck& check = checks[0];
+    while (state.KeepRunning()) {
+        bool fValid = check.pubkey.Verify(check.hash, check.vchSig);
+        assert(fValid);
+    }
+}
+
+// 64 signatures under distinct keys, as the script checks of a block see them.
+static void ECDSAVerifyBatch(benchmark::State& state)
+{
+    std::vector<CPubKeySigCheck> checks(64);
+    MakeChecks(checks, true);
+    std::vector<CPubKeySigCheck*> vChecks;
+    for (size_t i = 0; i < checks.size(); i++)
+        vChecks.push_back(&checks[i]);
+    while (state.KeepRunning()) {
+        CPubKey::VerifyBatch(vChecks);
+        assert(checks.back().fValid);
+    }
+}
+
+BENCHMARK(ECDSAVerify);
+BENCHMARK(ECDSAVerifyUncompressed);
+BENCHMARK(ECDSAVerifyBatch);
@@ -0,0 +1,27 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "consensus/merkle.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+// Merkle root of a block with 9001 transactions, the odd count exercising
+// the duplicated last node on most levels.
+static void MerkleRoot(benchmark::State& state)
+{
+    std::vector<uint256> leaves(9001);
+    for (size_t i = 0; i < leaves.size(); i++)
+        leaves[i] = GetRandHash();
+    while (state.KeepRunning()) {
+        bool mutated = false;
+        uint256 hash = ComputeMerkleRoot(leaves, &mutated);
+        leaves[mutated] = hash;
+    }
+}
+
+BENCHMARK(MerkleRoot);
@@ -0,0 +1,108 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "keystore.h"
+#include "policy/policy.h"
+#include "primitives/transaction.h"
+#include "script/interpreter.h"
+#include "script/sign.h"
+#include "script/standard.h"
+
+#include <assert.h>
+#include <vector>
+
+enum SpendType
+{
+    SPEND_P2PKH,
+    SPEND_P2SH_MULTISIG,
+    SPEND_P2WPKH,
+};
+
+/** Accepts every signature, leaving the interpreter and the signature hash. */
+class NoECDSASignatureChecker : public TransactionSignatureChecker
+{
+protected:
+    bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+    {
+        return true;
+    }
+
+public:
+    NoECDSASignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, const PrecomputedTransactionData& txdataIn) : TransactionSignatureChecker(txToIn, nInIn, amountIn, txdataIn) {}
+};
+
+// Build an output of the given type and a signed transaction spending it.
+static void MakeSpend(SpendType type, CScript& scriptPubKey, CMutableTransaction& txSpend, CAmount& amount)
+{
+    CBasicKeyStore keystore;
+    std::vector<CPubKey> pubkeys;
+    for (int i = 0; i < 3; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        pubkeys.push_back(key.GetPubKey());
+    }
+
+    if (type == SPEND_P2PKH) {
+        scriptPubKey = GetScriptForDestination(pubkeys[0].GetID());
+    } else if (type == SPEND_P2SH_MULTISIG) {
+        CScript redeemScript = GetScriptForMultisig(2, pubkeys);
+        keystore.AddCScript(redeemScript);
+        scriptPubKey = GetScriptForDestination(CScriptID(redeemScript));
+    } else {
+        CScript witnessScript = GetScriptForWitness(GetScriptForDestination(pubkeys[0].GetID()));
+        keystore.AddCScript(witnessScript);
+        scriptPubKey = witnessScript;
+    }
+
+    amount = 1000000;
+    CMutableTransaction txCredit;
+    txCredit.vout.push_back(CTxOut(amount, scriptPubKey));
+
+    txSpend.vin.push_back(CTxIn(COutPoint(txCredit.GetHash(), 0)));
+    txSpend.vout.push_back(CTxOut(amount, CScript() << OP_TRUE));
+    bool fSigned = SignSignature(keystore, scriptPubKey, txSpend, 0, amount, SIGHASH_ALL);
+    assert(fSigned);
+}
+
+static void VerifyScriptSpend(benchmark::State& state, SpendType type, bool fECDSA)
+{
+    CScript scriptPubKey;
+    CMutableTransaction txSpend;
+    CAmount amount;
+    MakeSpend(type, scriptPubKey, txSpend, amount);
+
+    const CTransaction tx(txSpend);
+    const PrecomputedTransactionData txdata(tx);
+    const CScriptWitness* witness = tx.wit.vtxinwit.empty() ? NULL : &tx.wit.vtxinwit[0].scriptWitness;
+    TransactionSignatureChecker checker(&tx, 0, amount, txdata);
+    NoECDSASignatureChecker checkerNoECDSA(&tx, 0, amount, txdata);
+    const BaseSignatureChecker& checkerUsed = fECDSA ? (const BaseSignatureChecker&)checker : checkerNoECDSA;
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool fValid = VerifyScript(tx.vin[0].scriptSig, scriptPubKey, witness, STANDARD_SCRIPT_VERIFY_FLAGS, checkerUsed, &err);
+        assert(fValid && err == SCRIPT_ERR_OK);
+    }
+}
+
+// Full verification of the common spends, signatures included.
+static void VerifyScriptP2PKH(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2PKH, true); }
+static void VerifyScriptP2SHMultisig(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2SH_MULTISIG, true); }
+static void VerifyScriptP2WPKH(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2WPKH, true); }
+
+// The same without the ECDSA verification, which would hide the cost of the
+// interpreter itself: stack handling, hashing and the signature hash.
+static void VerifyScriptP2PKHNoECDSA(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2PKH, false); }
+static void VerifyScriptP2SHMultisigNoECDSA(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2SH_MULTISIG, false); }
+static void VerifyScriptP2WPKHNoECDSA(benchmark::State& state) { VerifyScriptSpend(state, SPEND_P2WPKH, false); }
+
+BENCHMARK(VerifyScriptP2PKH);
+BENCHMARK(VerifyScriptP2SHMultisig);
+BENCHMARK(VerifyScriptP2WPKH);
+BENCHMARK(VerifyScriptP2PKHNoECDSA);
+BENCHMARK(VerifyScriptP2SHMultisigNoECDSA);
+BENCHMARK(VerifyScriptP2WPKHNoECDSA);
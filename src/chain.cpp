@@ -44,12 +44,9 @@ CBlockHeader CBlockIndex::GetBlockHeader(const std::map<uint256, std::shared_ptr
             if (it != mapDirtyAuxPow.end()) {
                 block.auxpow = it->second;
             } else {
-                CDiskBlockIndex diskblockindex;
-                // auxpow is not in memory, load CDiskBlockHeader
-                // from database to get it
-
-                pblocktree->ReadDiskBlockIndex(*phashBlock, diskblockindex);
-                block.auxpow = diskblockindex.auxpow;
+                // auxpow is not dirty, get it from the auxpow cache
+                // or load it from the database
+                pblocktree->ReadAuxPow(*phashBlock, block.auxpow);
             }
     }
 
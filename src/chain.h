@@ -436,6 +436,46 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * Compact on-disk form of the immutable part of a CDiskBlockIndex, as
+ * written by the block tree database. The layout matches CDiskBlockIndex,
+ * except that the auxpow is stored through CAuxPowCompressor.
+ *
+ * With fHeaderOnly set, reading stops after the block header and the auxpow
+ * is left null. The prefix is shared with the legacy CDiskBlockIndex
+ * layout, so this can read records of either format.
+ */
+class CCompactDiskBlockIndex
+{
+private:
+    CDiskBlockIndex& index;
+    const bool fHeaderOnly;
+
+public:
+    CCompactDiskBlockIndex(CDiskBlockIndex& indexIn, bool fHeaderOnlyIn = false) : index(indexIn), fHeaderOnly(fHeaderOnlyIn) { }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nVersion));
+
+        READWRITE(VARINT(index.nHeight));
+        READWRITE(VARINT(index.nTx));
+
+        // block header
+        READWRITE(index.nVersion);
+        READWRITE(index.hashPrev);
+        READWRITE(index.hashMerkleRoot);
+        READWRITE(index.nTime);
+        READWRITE(index.nBits);
+        READWRITE(index.nNonce);
+        nVersion = index.nVersion;
+        if (index.IsAuxPow() && !(fHeaderOnly && ser_action.ForRead()))
+            READWRITE(REF(CAuxPowCompressor(index.auxpow, index.GetBlockHash())));
+    }
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -5,7 +5,14 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <assert.h>
+#include <deque>
+#include <memory>
+#include <stdint.h>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -16,6 +23,42 @@
 template <typename T>
 class CCheckQueueControl;
 
+/**
+ * How a worker runs the batch of checks it took from the queue. By default
+ * they are run one at a time, stopping at the first failure; check types
+ * that can share work across a batch specialize this.
+ */
+template <typename T>
+struct CCheckQueueBatch
+{
+    static bool Run(std::vector<T>& vChecks)
+    {
+        BOOST_FOREACH (T& check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+};
+
+/** How the work of one round (the checks between two Wait calls) was spread */
+struct CCheckQueueStats
+{
+    //! Checks run, and threads (including the master) that ran any of them
+    unsigned int nChecks;
+    unsigned int nThreads;
+    //! Fewest and most checks run by one of those threads
+    unsigned int nMinChecks;
+    unsigned int nMaxChecks;
+    //! Batches taken from another thread's queue
+    unsigned int nSteals;
+    //! Time the master spent in Wait, and the part of it after all queues
+    //! ran dry, waiting for the last batches of the other threads
+    int64_t nWaitMicros;
+    int64_t nTailMicros;
+
+    CCheckQueueStats() : nChecks(0), nThreads(0), nMinChecks(0), nMaxChecks(0), nSteals(0), nWaitMicros(0), nTailMicros(0) {}
+};
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -25,12 +68,42 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a queue of its own, which the master fills in turn.
+  * A thread takes its batches from the back of its own queue and, once that
+  * is empty, steals from the front of the others', so threads only contend
+  * for a lock when the work has become unbalanced. The shared mutex is only
+  * taken to go to sleep and to wake sleepers up.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /** The queue of one thread; slot 0 belongs to the master */
+    struct Slot
+    {
+        boost::mutex mutex;
+        std::deque<T> queue;
+        //! Counters of the current round, only written by the owner
+        std::atomic<unsigned int> nChecks;
+        std::atomic<unsigned int> nSteals;
+        //! Keep the next slot's lock off this cache line
+        char padding[64];
+
+        Slot() : nChecks(0), nSteals(0) {}
+    };
+
+    //! Per-thread queues, and how many of them are in use
+    std::unique_ptr<Slot[]> slots;
+    const unsigned int nMaxSlots;
+    std::atomic<unsigned int> nSlots;
+    //! Number of workers still running
+    std::atomic<unsigned int> nWorkers;
+
+    //! The slot the master fills next
+    unsigned int nNextSlot;
+
+    //! Mutex to sleep on, and to protect fQuit
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,25 +112,29 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Number of workers blocked on condWorker
+    std::atomic<int> nSleeping;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
-
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Counts a worker as sleeping for its scope, even if the wait is interrupted
+    struct SleepingGuard
+    {
+        std::atomic<int>& nSleeping;
+        SleepingGuard(std::atomic<int>& nSleepingIn) : nSleeping(nSleepingIn) { nSleeping++; }
+        ~SleepingGuard() { nSleeping--; }
+    };
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
+
+    //! Number of verifications sitting in the slots.
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
     //! Whether we're shutting down.
     bool fQuit;
@@ -65,96 +142,215 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Statistics of the last round, for the master
+    CCheckQueueStats stats;
+
+    /**
+     * Move a batch into vChecks: from the back of our own slot, or else from
+     * the front of another one. Take at most half of what is there, so the
+     * rest stays available to the others.
+     */
+    bool Take(unsigned int nSelf, std::vector<T>& vChecks)
+    {
+        const unsigned int nCount = nSlots.load();
+        for (unsigned int i = 0; i < nCount; i++) {
+            const unsigned int nVictim = (nSelf + i) % nCount;
+            Slot& slot = slots[nVictim];
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            if (slot.queue.empty())
+                continue;
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)slot.queue.size() / 2));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // Swap rather than copy, to keep the lock short.
+                if (i == 0) {
+                    vChecks[j].swap(slot.queue.back());
+                    slot.queue.pop_back();
+                } else {
+                    vChecks[j].swap(slot.queue.front());
+                    slot.queue.pop_front();
+                }
+            }
+            lock.unlock();
+            nQueued -= nNow;
+            if (i != 0)
+                slots[nSelf].nSteals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    /** Run a batch taken by the thread owning slot nSelf and account for it. */
+    void Run(unsigned int nSelf, std::vector<T>& vChecks, bool fMaster)
+    {
+        const unsigned int nNow = vChecks.size();
+        // Once something failed, the remaining checks are only drained.
+        if (fAllOk.load(std::memory_order_relaxed)) {
+            if (!CCheckQueueBatch<T>::Run(vChecks))
+                fAllOk = false;
+        }
+        vChecks.clear();
+        slots[nSelf].nChecks.fetch_add(nNow, std::memory_order_relaxed);
+        if ((nTodo -= nNow) == 0 && !fMaster) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(mutex);
+            condMaster.notify_one();
+        }
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    void Loop(unsigned int nSelf)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+        while (true) {
+            if (Take(nSelf, vChecks)) {
+                Run(nSelf, vChecks, false);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fQuit)
+                return;
+            // Announce ourselves before looking again, so Add either sees
+            // us sleeping or we see its checks.
+            SleepingGuard sleeping(nSleeping);
+            if (nQueued.load() == 0)
+                condWorker.wait(lock); // wait
+        }
+    }
+
+    /**
+     * Once the last worker is gone, whether it was interrupted or told to
+     * quit, its slots can be handed out again to a new set of workers. The
+     * master notices in Add.
+     */
+    void Leave()
+    {
+        if (--nWorkers == 0)
+            nSlots = 1;
+    }
+
+    /** Join the workers until all checks are done; the master's side of Loop. */
+    bool Finish()
+    {
+        const int64_t nTimeStart = GetTimeMicros();
+        int64_t nTimeDry = 0;
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        while (true) {
+            if (Take(0, vChecks)) {
+                Run(0, vChecks, true);
+                continue;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nTodo.load() == 0)
+                break;
+            if (nQueued.load() != 0)
+                continue;
+            if (nTimeDry == 0)
+                nTimeDry = GetTimeMicros();
+            condMaster.wait(lock); // wait
+        }
+        const int64_t nTimeEnd = GetTimeMicros();
+
+        // All workers are out of work now, so the counters are settled.
+        stats = CCheckQueueStats();
+        stats.nWaitMicros = nTimeEnd - nTimeStart;
+        stats.nTailMicros = nTimeDry ? nTimeEnd - nTimeDry : 0;
+        const unsigned int nCount = nSlots.load();
+        for (unsigned int i = 0; i < nCount; i++) {
+            const unsigned int nChecks = slots[i].nChecks.exchange(0, std::memory_order_relaxed);
+            stats.nSteals += slots[i].nSteals.exchange(0, std::memory_order_relaxed);
+            if (nChecks == 0)
+                continue;
+            stats.nMinChecks = stats.nThreads ? std::min(stats.nMinChecks, nChecks) : nChecks;
+            stats.nMaxChecks = std::max(stats.nMaxChecks, nChecks);
+            stats.nChecks += nChecks;
+            stats.nThreads++;
+        }
+        nNextSlot = 0;
+
+        bool fRet = fAllOk;
+        // reset the status for new work later
+        fAllOk = true;
+        return fRet;
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, to be served by at most nMaxThreadsIn workers
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxThreadsIn) :
+        slots(new Slot[nMaxThreadsIn + 1]), nMaxSlots(nMaxThreadsIn + 1), nSlots(1), nWorkers(0), nNextSlot(0),
+        nSleeping(0), fAllOk(true), nQueued(0), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+
+    //! Change the batch size; only before any worker is started
+    void SetBatchSize(unsigned int nBatchSizeIn)
+    {
+        assert(nSlots.load() == 1);
+        nBatchSize = std::max(1U, nBatchSizeIn);
+    }
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        nWorkers++;
+        const unsigned int nSelf = nSlots++;
+        assert(nSelf < nMaxSlots);
+        try {
+            Loop(nSelf);
+        } catch (...) {
+            Leave();
+            throw;
+        }
+        Leave();
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Finish();
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        // Count the checks before they can be taken, so that nQueued never
+        // drops below zero.
+        nQueued += vChecks.size();
+        // Hand out the checks round robin, a batch per slot, so the workers
+        // start from their own queue.
+        const unsigned int nCount = nSlots.load();
+        if (nNextSlot >= nCount)
+            nNextSlot = 0;
+        for (size_t nDone = 0; nDone < vChecks.size(); ) {
+            const size_t nNow = std::min<size_t>(nBatchSize, vChecks.size() - nDone);
+            // The master only serves its own slot once it waits.
+            if (nNextSlot == 0 && nCount > 1)
+                nNextSlot = 1;
+            Slot& slot = slots[nNextSlot];
+            nNextSlot = (nNextSlot + 1) % nCount;
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            for (size_t i = nDone; i < nDone + nNow; i++) {
+                slot.queue.push_back(T());
+                vChecks[i].swap(slot.queue.back());
+            }
+            nDone += nNow;
+        }
+        if (nSleeping.load() > 0) {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
+    }
+
+    //! Statistics of the round finished by the last Wait
+    const CCheckQueueStats& GetStats() const
+    {
+        return stats;
     }
 
     ~CCheckQueue()
@@ -163,8 +359,7 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo.load() == 0 && nQueued.load() == 0 && fAllOk.load() == true);
     }
 
 };
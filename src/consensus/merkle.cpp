@@ -4,8 +4,14 @@
 
 #include "merkle.h"
 #include "hash.h"
+#include "crypto/sha256.h"
 #include "utilstrencodings.h"
 
+#include <algorithm>
+#include <assert.h>
+#include <limits>
+#include <string.h>
+
 /*     WARNING! If you're reading this because you're learning about crypto
        and/or designing a new system that will use merkle trees, keep in mind
        that the following merkle tree algorithm has a serious flaw related to
@@ -42,119 +48,127 @@
        root.
 */
 
-/* This implements a constant-space merkle root/path calculator, limited to 2^32 leaves. */
-static void MerkleComputation(const std::vector<uint256>& leaves, uint256* proot, bool* pmutated, uint32_t branchpos, std::vector<uint256>* pbranch) {
-    if (pbranch) pbranch->clear();
-    if (leaves.size() == 0) {
-        if (pmutated) *pmutated = false;
-        if (proot) *proot = uint256();
-        return;
-    }
-    bool mutated = false;
-    // count is the number of leaves processed so far.
-    uint32_t count = 0;
-    // inner is an array of eagerly computed subtree hashes, indexed by tree
-    // level (0 being the leaves).
-    // For example, when count is 25 (11001 in binary), inner[4] is the hash of
-    // the first 16 leaves, inner[3] of the next 8 leaves, and inner[0] equal to
-    // the last leaf. The other inner entries are undefined.
-    uint256 inner[32];
-    // Which position in inner is a hash that depends on the matching leaf.
-    int matchlevel = -1;
-    // First process all leaves into 'inner' values.
-    while (count < leaves.size()) {
-        uint256 h = leaves[count];
-        bool matchh = count == branchpos;
-        count++;
-        int level;
-        // For each of the lower bits in count that are 0, do 1 step. Each
-        // corresponds to an inner value that existed before processing the
-        // current leaf, and each needs a hash to combine it.
-        for (level = 0; !(count & (((uint32_t)1) << level)); level++) {
-            if (pbranch) {
-                if (matchh) {
-                    pbranch->push_back(inner[level]);
-                } else if (matchlevel == level) {
-                    pbranch->push_back(h);
-                    matchh = true;
-                }
-            }
-            mutated |= (inner[level] == h);
-            CHash256().Write(inner[level].begin(), 32).Write(h.begin(), 32).Finalize(h.begin());
-        }
-        // Store the resulting hash at inner position level.
-        inner[level] = h;
-        if (matchh) {
-            matchlevel = level;
+/**
+ * Hash one level of the tree into the next. The full pairs are contiguous, so
+ * SHA256D64 does them several at a time; an odd last node is hashed with a
+ * copy of itself. 'out' may equal 'in', as every pair is read before its
+ * result lands at or below it.
+ */
+static void HashLevel(uint256* out, const uint256* in, size_t width, bool* mutated)
+{
+    if (mutated) {
+        for (size_t pos = 0; pos + 1 < width; pos += 2) {
+            if (in[pos] == in[pos + 1]) *mutated = true;
         }
     }
-    // Do a final 'sweep' over the rightmost branch of the tree to process
-    // odd levels, and reduce everything to a single top value.
-    // Level is the level (counted from the bottom) up to which we've sweeped.
-    int level = 0;
-    // As long as bit number level in count is zero, skip it. It means there
-    // is nothing left at this level.
-    while (!(count & (((uint32_t)1) << level))) {
-        level++;
+    SHA256D64(out[0].begin(), in[0].begin(), width / 2);
+    if (width & 1) {
+        const uint256& last = in[width - 1];
+        CHash256().Write(last.begin(), 32).Write(last.begin(), 32).Finalize(out[width / 2].begin());
     }
-    uint256 h = inner[level];
-    bool matchh = matchlevel == level;
-    while (count != (((uint32_t)1) << level)) {
-        // If we reach this point, h is an inner value that is not the top.
-        // We combine it with itself (Bitcoin's special rule for odd levels in
-        // the tree) to produce a higher level one.
-        if (pbranch && matchh) {
-            pbranch->push_back(h);
-        }
-        CHash256().Write(h.begin(), 32).Write(h.begin(), 32).Finalize(h.begin());
-        // Increment count to the value it would have if two entries at this
-        // level had existed.
-        count += (((uint32_t)1) << level);
-        level++;
-        // And propagate the result upwards accordingly.
-        while (!(count & (((uint32_t)1) << level))) {
-            if (pbranch) {
-                if (matchh) {
-                    pbranch->push_back(inner[level]);
-                } else if (matchlevel == level) {
-                    pbranch->push_back(h);
-                    matchh = true;
-                }
-            }
-            CHash256().Write(inner[level].begin(), 32).Write(h.begin(), 32).Finalize(h.begin());
-            level++;
-        }
-    }
-    // Return result.
-    if (pmutated) *pmutated = mutated;
-    if (proot) *proot = h;
 }
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated) {
-    uint256 hash;
-    MerkleComputation(leaves, &hash, mutated, -1, NULL);
-    return hash;
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated) {
+    // Reduce the tree a level at a time in the leaves' own buffer.
+    bool mutation = false;
+    size_t width = hashes.size();
+    while (width > 1) {
+        HashLevel(&hashes[0], &hashes[0], width, mutated ? &mutation : NULL);
+        width = (width + 1) / 2;
+    }
+    if (mutated) *mutated = mutation;
+    if (hashes.size() == 0) return uint256();
+    return hashes[0];
 }
 
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position) {
-    std::vector<uint256> ret;
-    MerkleComputation(leaves, NULL, NULL, position, &ret);
-    return ret;
+    return CMerkleTree(leaves).Branch(position);
 }
 
 uint256 ComputeMerkleRootFromBranch(const uint256& leaf, const std::vector<uint256>& vMerkleBranch, uint32_t nIndex) {
+    // Both halves of each node live in one stack buffer, so no step allocates.
+    unsigned char node[64];
     uint256 hash = leaf;
     for (std::vector<uint256>::const_iterator it = vMerkleBranch.begin(); it != vMerkleBranch.end(); ++it) {
         if (nIndex & 1) {
-            hash = Hash(BEGIN(*it), END(*it), BEGIN(hash), END(hash));
+            memcpy(node, it->begin(), 32);
+            memcpy(node + 32, hash.begin(), 32);
         } else {
-            hash = Hash(BEGIN(hash), END(hash), BEGIN(*it), END(*it));
+            memcpy(node, hash.begin(), 32);
+            memcpy(node + 32, it->begin(), 32);
         }
+        CHash256().Write(node, sizeof(node)).Finalize(hash.begin());
         nIndex >>= 1;
     }
     return hash;
 }
 
+CMerkleTree::CMerkleTree(const std::vector<uint256>& leaves)
+{
+    Init(leaves.size());
+    std::copy(leaves.begin(), leaves.end(), vNodes.begin());
+    Build();
+}
+
+CMerkleTree::CMerkleTree(const CBlock& block)
+{
+    Init(block.vtx.size());
+    for (size_t s = 0; s < block.vtx.size(); s++) {
+        vNodes[s] = block.vtx[s].GetHash();
+    }
+    Build();
+}
+
+void CMerkleTree::Init(size_t nLeaves)
+{
+    assert(nLeaves <= std::numeric_limits<uint32_t>::max());
+    nTransactions = nLeaves;
+    fMutated = false;
+
+    // Lay the levels out back to back, so one allocation holds the tree.
+    size_t nTotal = 0;
+    nHeight = 0;
+    nOffset[0] = 0;
+    for (uint32_t width = nTransactions; ; width = (width + 1) / 2) {
+        nTotal += width;
+        if (width <= 1)
+            break;
+        nOffset[++nHeight] = nTotal;
+    }
+    vNodes.resize(nTotal);
+}
+
+void CMerkleTree::Build()
+{
+    for (int h = 0; h < nHeight; h++) {
+        HashLevel(&vNodes[nOffset[h + 1]], &vNodes[nOffset[h]], Width(h), &fMutated);
+    }
+}
+
+uint256 CMerkleTree::Root() const
+{
+    if (vNodes.empty())
+        return uint256();
+    return vNodes.back();
+}
+
+std::vector<uint256> CMerkleTree::Branch(uint32_t position) const
+{
+    std::vector<uint256> ret;
+    if (position >= nTransactions)
+        return ret;
+    ret.reserve(nHeight);
+    for (int h = 0; h < nHeight; h++) {
+        // A node without a right sibling was hashed with itself.
+        uint32_t sibling = position ^ 1;
+        if (sibling >= Width(h))
+            sibling = position;
+        ret.push_back(Node(h, sibling));
+        position >>= 1;
+    }
+    return ret;
+}
+
 uint256 BlockMerkleRoot(const CBlock& block, bool* mutated)
 {
     std::vector<uint256> leaves;
@@ -162,7 +176,7 @@ uint256 BlockMerkleRoot(const CBlock& block, bool* mutated)
     for (size_t s = 0; s < block.vtx.size(); s++) {
         leaves[s] = block.vtx[s].GetHash();
     }
-    return ComputeMerkleRoot(leaves, mutated);
+    return ComputeMerkleRoot(std::move(leaves), mutated);
 }
 
 uint256 BlockWitnessMerkleRoot(const CBlock& block, bool* mutated)
@@ -173,15 +187,10 @@ uint256 BlockWitnessMerkleRoot(const CBlock& block, bool* mutated)
     for (size_t s = 1; s < block.vtx.size(); s++) {
         leaves[s] = block.vtx[s].GetWitnessHash();
     }
-    return ComputeMerkleRoot(leaves, mutated);
+    return ComputeMerkleRoot(std::move(leaves), mutated);
 }
 
 std::vector<uint256> BlockMerkleBranch(const CBlock& block, uint32_t position)
 {
-    std::vector<uint256> leaves;
-    leaves.resize(block.vtx.size());
-    for (size_t s = 0; s < block.vtx.size(); s++) {
-        leaves[s] = block.vtx[s].GetHash();
-    }
-    return ComputeMerkleBranch(leaves, position);
+    return CMerkleTree(block).Branch(position);
 }
@@ -12,10 +12,49 @@
 #include "primitives/block.h"
 #include "uint256.h"
 
-uint256 ComputeMerkleRoot(const std::vector<uint256>& leaves, bool* mutated = NULL);
+uint256 ComputeMerkleRoot(std::vector<uint256> hashes, bool* mutated = NULL);
 std::vector<uint256> ComputeMerkleBranch(const std::vector<uint256>& leaves, uint32_t position);
 uint256 ComputeMerkleRootFromBranch(const uint256& leaf, const std::vector<uint256>& branch, uint32_t position);
 
+/**
+ * A whole merkle tree, from which the root, the branch of any leaf and the
+ * inner nodes a partial tree needs are all read off a single build.
+ *
+ * The levels are stored back to back in one buffer, leaves first and the root
+ * last, and each level is hashed from the one below with SHA256D64.
+ */
+class CMerkleTree
+{
+private:
+    /** Every level of the tree, leaves first */
+    std::vector<uint256> vNodes;
+    /** Where each level starts in vNodes; a tree has at most 33 levels */
+    size_t nOffset[33];
+    uint32_t nTransactions;
+    int nHeight;
+    bool fMutated;
+
+    void Init(size_t nLeaves);
+    void Build();
+
+public:
+    explicit CMerkleTree(const std::vector<uint256>& leaves);
+    /** The tree over a block's transaction ids */
+    explicit CMerkleTree(const CBlock& block);
+
+    /** The number of levels above the leaves */
+    int Height() const { return nHeight; }
+    /** The number of nodes at a level, 0 being the leaves */
+    uint32_t Width(int height) const { return (nTransactions + (((uint64_t)1) << height) - 1) >> height; }
+    const uint256& Node(int height, uint32_t pos) const { return vNodes[nOffset[height] + pos]; }
+
+    uint256 Root() const;
+    /** Whether a duplicated subtree was found, see BlockMerkleRoot */
+    bool Mutated() const { return fMutated; }
+    /** The branch of a leaf, to be verified with ComputeMerkleRootFromBranch */
+    std::vector<uint256> Branch(uint32_t position) const;
+};
+
 /*
  * Compute the Merkle root of the transactions in a block.
  * *mutated is set to true if a duplicated subtree was found.
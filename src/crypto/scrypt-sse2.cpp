@@ -137,4 +137,96 @@ void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchp
 	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
 }
 
+#define ROTL_4WAY(a, b) _mm_or_si128(_mm_slli_epi32((a), (b)), _mm_srli_epi32((a), 32 - (b)))
+#define SALSA_STEP_4WAY(x, a, b, s) x = _mm_xor_si128(x, ROTL_4WAY(_mm_add_epi32((a), (b)), (s)))
+
+/*
+ * Salsa20/8 on four independent blocks at once. Word k of every block lives
+ * in B[k], one block per 32-bit lane, so the rounds are the scalar ones with
+ * each operation widened to a full register.
+ */
+static inline void xor_salsa8_4way(__m128i B[16], const __m128i Bx[16])
+{
+	__m128i x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = B[i] = _mm_xor_si128(B[i], Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		SALSA_STEP_4WAY(x[ 4], x[ 0], x[12],  7);  SALSA_STEP_4WAY(x[ 9], x[ 5], x[ 1],  7);
+		SALSA_STEP_4WAY(x[14], x[10], x[ 6],  7);  SALSA_STEP_4WAY(x[ 3], x[15], x[11],  7);
+
+		SALSA_STEP_4WAY(x[ 8], x[ 4], x[ 0],  9);  SALSA_STEP_4WAY(x[13], x[ 9], x[ 5],  9);
+		SALSA_STEP_4WAY(x[ 2], x[14], x[10],  9);  SALSA_STEP_4WAY(x[ 7], x[ 3], x[15],  9);
+
+		SALSA_STEP_4WAY(x[12], x[ 8], x[ 4], 13);  SALSA_STEP_4WAY(x[ 1], x[13], x[ 9], 13);
+		SALSA_STEP_4WAY(x[ 6], x[ 2], x[14], 13);  SALSA_STEP_4WAY(x[11], x[ 7], x[ 3], 13);
+
+		SALSA_STEP_4WAY(x[ 0], x[12], x[ 8], 18);  SALSA_STEP_4WAY(x[ 5], x[ 1], x[13], 18);
+		SALSA_STEP_4WAY(x[10], x[ 6], x[ 2], 18);  SALSA_STEP_4WAY(x[15], x[11], x[ 7], 18);
+
+		/* Operate on rows. */
+		SALSA_STEP_4WAY(x[ 1], x[ 0], x[ 3],  7);  SALSA_STEP_4WAY(x[ 6], x[ 5], x[ 4],  7);
+		SALSA_STEP_4WAY(x[11], x[10], x[ 9],  7);  SALSA_STEP_4WAY(x[12], x[15], x[14],  7);
+
+		SALSA_STEP_4WAY(x[ 2], x[ 1], x[ 0],  9);  SALSA_STEP_4WAY(x[ 7], x[ 6], x[ 5],  9);
+		SALSA_STEP_4WAY(x[ 8], x[11], x[10],  9);  SALSA_STEP_4WAY(x[13], x[12], x[15],  9);
+
+		SALSA_STEP_4WAY(x[ 3], x[ 2], x[ 1], 13);  SALSA_STEP_4WAY(x[ 4], x[ 7], x[ 6], 13);
+		SALSA_STEP_4WAY(x[ 9], x[ 8], x[11], 13);  SALSA_STEP_4WAY(x[14], x[13], x[12], 13);
+
+		SALSA_STEP_4WAY(x[ 0], x[ 3], x[ 2], 18);  SALSA_STEP_4WAY(x[ 5], x[ 4], x[ 7], 18);
+		SALSA_STEP_4WAY(x[10], x[ 9], x[ 8], 18);  SALSA_STEP_4WAY(x[15], x[14], x[13], 18);
+	}
+	for (i = 0; i < 16; i++)
+		B[i] = _mm_add_epi32(B[i], x[i]);
+}
+
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad)
+{
+	uint8_t B[4][128];
+	union {
+		__m128i i128[32];
+		uint32_t u32[32][4];
+	} X;
+	__m128i *V;
+	uint32_t *V32;
+	uint32_t i, j[4], k, l;
+
+	V = (__m128i *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	V32 = (uint32_t *)V;
+
+	for (l = 0; l < 4; l++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, (const uint8_t *)input + 80 * l, 80, 1, B[l], 128);
+
+	for (k = 0; k < 32; k++)
+		for (l = 0; l < 4; l++)
+			X.u32[k][l] = le32dec(&B[l][4 * k]);
+
+	for (i = 0; i < 1024; i++) {
+		for (k = 0; k < 32; k++)
+			V[i * 32 + k] = X.i128[k];
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		/* Every lane reads its own pseudo-random row of V. */
+		for (l = 0; l < 4; l++)
+			j[l] = 128 * (X.u32[16][l] & 1023) + l;
+		for (k = 0; k < 32; k++)
+			X.i128[k] = _mm_xor_si128(X.i128[k],
+				_mm_set_epi32(V32[j[3] + 4 * k], V32[j[2] + 4 * k], V32[j[1] + 4 * k], V32[j[0] + 4 * k]));
+		xor_salsa8_4way(&X.i128[0], &X.i128[16]);
+		xor_salsa8_4way(&X.i128[16], &X.i128[0]);
+	}
+
+	for (k = 0; k < 32; k++)
+		for (l = 0; l < 4; l++)
+			le32enc(&B[l][4 * k], X.u32[k][l]);
+
+	for (l = 0; l < 4; l++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, B[l], 128, 1, (uint8_t *)output + 32 * l, 32);
+}
+
 #endif // USE_SSE2
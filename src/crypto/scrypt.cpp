@@ -27,6 +27,10 @@
  * online backup system.
  */
 
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
 #include "crypto/scrypt.h"
 //#include "util.h"
 #include <stdlib.h>
@@ -34,7 +38,12 @@
 #include <string.h>
 #include <openssl/sha.h>
 
-#if defined(USE_SSE2) && !defined(USE_SSE2_ALWAYS)
+// The AVX2 kernel lives in its own library, which libbitcoinconsensus does not link
+#if defined(USE_SSE2) && defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+#define USE_SCRYPT_AVX2 1
+#endif
+
+#if defined(USE_SSE2) && (!defined(USE_SSE2_ALWAYS) || defined(USE_SCRYPT_AVX2))
 #ifdef _MSC_VER
 // MSVC 64bit is unable to use inline asm
 #include <intrin.h>
@@ -290,11 +299,51 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 // By default, set to generic scrypt function. This will prevent crash in case when scrypt_detect_sse2() wasn't called
 void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad) = &scrypt_1024_1_1_256_sp_generic;
 
+// Widest interleaved kernel usable by scrypt_1024_1_1_256_multi, set by scrypt_detect_sse2()
+#if defined(USE_SSE2_ALWAYS)
+static int nScryptMultiWays = 4;
+#else
+static int nScryptMultiWays = 1;
+#endif
+
+#if defined(USE_SCRYPT_AVX2)
+static bool scrypt_detect_avx2()
+{
+    unsigned int cpuid_ecx=0, cpuid_ebx=0;
+#if defined(_MSC_VER)
+    int x86cpuid[4];
+    __cpuid(x86cpuid, 1);
+    cpuid_ecx = (unsigned int)x86cpuid[2];
+    if (!(cpuid_ecx & 1<<27) || !(cpuid_ecx & 1<<28)) // OSXSAVE, AVX
+        return false;
+    if ((_xgetbv(0) & 6) != 6) // XMM and YMM state enabled by the OS
+        return false;
+    __cpuidex(x86cpuid, 7, 0);
+    cpuid_ebx = (unsigned int)x86cpuid[1];
+#else // _MSC_VER
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &cpuid_ecx, &edx))
+        return false;
+    if (!(cpuid_ecx & 1<<27) || !(cpuid_ecx & 1<<28)) // OSXSAVE, AVX
+        return false;
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) // XMM and YMM state enabled by the OS
+        return false;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, cpuid_ebx, cpuid_ecx, edx);
+#endif // _MSC_VER
+    return (cpuid_ebx & 1<<5) != 0;
+}
+#endif // USE_SCRYPT_AVX2
+
 std::string scrypt_detect_sse2()
 {
     std::string ret;
 #if defined(USE_SSE2_ALWAYS)
     ret = "scrypt: using scrypt-sse2 as built.";
+    nScryptMultiWays = 4;
 #else // USE_SSE2_ALWAYS
     // 32bit x86 Linux or Windows, detect cpuid features
     unsigned int cpuid_edx=0;
@@ -302,7 +351,7 @@ std::string scrypt_detect_sse2()
     // MSVC
     int x86cpuid[4];
     __cpuid(x86cpuid, 1);
-    cpuid_edx = (unsigned int)buffer[3];
+    cpuid_edx = (unsigned int)x86cpuid[3];
 #else // _MSC_VER
     // Linux or i686-w64-mingw32 (gcc-4.6.3)
     unsigned int eax, ebx, ecx;
@@ -312,16 +361,36 @@ std::string scrypt_detect_sse2()
     if (cpuid_edx & 1<<26)
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_sse2;
-        ret = "scrypt: using scrypt-sse2 as detected");
+        nScryptMultiWays = 4;
+        ret = "scrypt: using scrypt-sse2 as detected.";
     }
     else
     {
         scrypt_1024_1_1_256_sp_detected = &scrypt_1024_1_1_256_sp_generic;
-        ret = "scrypt: using scrypt-generic, SSE2 unavailable";
+        nScryptMultiWays = 1;
+        ret = "scrypt: using scrypt-generic, SSE2 unavailable.";
     }
 #endif // USE_SSE2_ALWAYS
+#if defined(USE_SCRYPT_AVX2)
+    if (nScryptMultiWays == 4 && scrypt_detect_avx2())
+        nScryptMultiWays = 8;
+#endif
+    if (nScryptMultiWays == 8)
+        ret += " Batch hashing: avx2 8-way.";
+    else if (nScryptMultiWays == 4)
+        ret += " Batch hashing: sse2 4-way.";
    return ret;
 }
+
+int scrypt_multi_ways()
+{
+    return nScryptMultiWays;
+}
+#else
+int scrypt_multi_ways()
+{
+    return 1;
+}
 #endif
 
 void scrypt_1024_1_1_256(const char *input, char *output)
@@ -329,3 +398,48 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
     scrypt_1024_1_1_256_sp(input, output, scratchpad);
 }
+
+/** Scratchpad of scrypt_1024_1_1_256_multi, kept per thread between calls. */
+class CScryptScratchpad
+{
+	char *p;
+	size_t nSize;
+
+public:
+	CScryptScratchpad() : p(NULL), nSize(0) {}
+	~CScryptScratchpad() { free(p); }
+
+	char *Get(size_t nNeeded)
+	{
+		if (nSize < nNeeded) {
+			free(p);
+			p = (char *)malloc(nNeeded);
+			if (p == NULL)
+				abort();
+			nSize = nNeeded;
+		}
+		return p;
+	}
+};
+
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t nCount)
+{
+	static thread_local CScryptScratchpad scratchpadCache;
+	int nWays = scrypt_multi_ways();
+	char *scratchpad = scratchpadCache.Get(SCRYPT_MULTI_SCRATCHPAD_SIZE(nWays));
+
+	// Use the widest kernel for as long as it fills up, then narrower ones.
+	size_t i = 0;
+#if defined(USE_SSE2)
+#if defined(USE_SCRYPT_AVX2)
+	if (nWays == 8)
+		for (; i + 8 <= nCount; i += 8)
+			scrypt_1024_1_1_256_sp_avx2_8way(input + 80 * i, output + 32 * i, scratchpad);
+#endif
+	if (nWays >= 4)
+		for (; i + 4 <= nCount; i += 4)
+			scrypt_1024_1_1_256_sp_sse2_4way(input + 80 * i, output + 32 * i, scratchpad);
+#endif
+	for (; i < nCount; i++)
+		scrypt_1024_1_1_256_sp(input + 80 * i, output + 32 * i, scratchpad);
+}
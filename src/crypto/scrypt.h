@@ -5,9 +5,23 @@
 
 static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
+/** Scratchpad needed by an interleaved kernel hashing nWays inputs at once. */
+#define SCRYPT_MULTI_SCRATCHPAD_SIZE(nWays) (131072 * (nWays) + 63)
+
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/**
+ * Hash nCount consecutive 80-byte inputs into nCount consecutive 32-byte
+ * outputs. Full groups are run through the widest interleaved Salsa20/8
+ * kernel selected by scrypt_detect_sse2(), what is left through the
+ * narrower ones, and the remainder one at a time.
+ */
+void scrypt_1024_1_1_256_multi(const char *input, char *output, size_t nCount);
+
+/** Number of inputs hashed per kernel call by scrypt_1024_1_1_256_multi. */
+int scrypt_multi_ways();
+
 #if defined(USE_SSE2)
 #include <string>
 #if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
@@ -20,6 +34,11 @@ void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scrat
 std::string scrypt_detect_sse2();
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
 extern void (*scrypt_1024_1_1_256_sp_detected)(const char *input, char *output, char *scratchpad);
+
+/** Hash 4 consecutive inputs, one per 32-bit lane of the SSE2 registers. */
+void scrypt_1024_1_1_256_sp_sse2_4way(const char *input, char *output, char *scratchpad);
+/** Hash 8 consecutive inputs, one per 32-bit lane of the AVX2 registers. Only built with ENABLE_AVX2. */
+void scrypt_1024_1_1_256_sp_avx2_8way(const char *input, char *output, char *scratchpad);
 #else
 #define scrypt_1024_1_1_256_sp(input, output, scratchpad) scrypt_1024_1_1_256_sp_generic((input), (output), (scratchpad))
 #endif
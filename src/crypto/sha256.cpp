@@ -8,6 +8,32 @@
 
 #include <string.h>
 
+// The accelerated transforms live in their own libraries, which libbitcoinconsensus does not link
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && !defined(BUILD_BITCOIN_INTERNAL)
+#include <cpuid.h>
+#if defined(ENABLE_SHANI)
+#define USE_SHA256_SHANI 1
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+#if defined(ENABLE_SSE41)
+#define USE_SHA256D64_SSE41 1
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#if defined(ENABLE_AVX2)
+#define USE_SHA256D64_AVX2 1
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -127,9 +153,136 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Perform a number of SHA-256 transformations, processing consecutive 64-byte chunks. */
+void TransformBlocks(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        Transform(s, chunk);
+        chunk += 64;
+    }
+}
+
 } // namespace sha256
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+/** The transform used by CSHA256, chosen by SHA256AutoDetect(). */
+TransformType Transform = sha256::TransformBlocks;
+
+/** Multi-lane double SHA-256 of 64-byte inputs, if the CPU has them. */
+TransformD64Type TransformD64_4way = NULL;
+TransformD64Type TransformD64_8way = NULL;
+
+/** Double SHA-256 of a single 64-byte input, using the selected transform. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // Padding for a 64-byte message, and for the 32-byte digest of the second round.
+    static const unsigned char padding1[64] = {
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0
+    };
+    unsigned char buffer2[64] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0
+    };
+    uint32_t s[8];
+
+    sha256::Initialize(s);
+    Transform(s, in, 1);
+    Transform(s, padding1, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buffer2 + 4 * i, s[i]);
+
+    sha256::Initialize(s);
+    Transform(s, buffer2, 1);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+/** Check a transform against the portable one, over inputs of a few blocks. */
+bool SelfTest(TransformType tr)
+{
+    unsigned char data[64 * 4];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + 11);
+
+    for (size_t blocks = 1; blocks <= 4; blocks++) {
+        uint32_t s1[8], s2[8];
+        sha256::Initialize(s1);
+        for (unsigned int i = 0; i < 8; i++)
+            s1[i] ^= (uint32_t)(blocks * 0x9e3779b9ul * (i + 1));
+        memcpy(s2, s1, sizeof(s1));
+        sha256::TransformBlocks(s1, data, blocks);
+        tr(s2, data, blocks);
+        if (memcmp(s1, s2, sizeof(s1)))
+            return false;
+    }
+    return true;
+}
+
+/** Check a multi-lane double SHA-256 kernel against TransformD64, lane by lane. */
+bool SelfTestD64(TransformD64Type tr, size_t lanes)
+{
+    unsigned char data[64 * 8], out1[32 * 8], out2[32 * 8];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 13 + 5);
+
+    for (size_t i = 0; i < lanes; i++)
+        TransformD64(out1 + 32 * i, data + 64 * i);
+    tr(out2, data);
+    return memcmp(out1, out2, 32 * lanes) == 0;
+}
+
 } // namespace
 
+std::string SHA256AutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_SHA256_SHANI) || defined(USE_SHA256D64_SSE41) || defined(USE_SHA256D64_AVX2)
+    bool have_sse41 = false, have_avx2 = false, have_shani = false;
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        have_sse41 = (ecx >> 19) & 1;
+        // AVX2 also needs the OS to save the YMM registers.
+        bool have_xsave = ((ecx >> 27) & 1) && ((ecx >> 28) & 1);
+        if (__get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            have_shani = have_sse41 && ((ebx >> 29) & 1);
+            if (have_xsave && ((ebx >> 5) & 1)) {
+                uint32_t xcr0_lo, xcr0_hi;
+                __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+                have_avx2 = (xcr0_lo & 6) == 6;
+            }
+        }
+    }
+
+#if defined(USE_SHA256_SHANI)
+    if (have_shani && SelfTest(sha256_shani::Transform)) {
+        // With SHA-NI a single lane already beats the SIMD kernels.
+        Transform = sha256_shani::Transform;
+        return "shani";
+    }
+#endif
+#if defined(USE_SHA256D64_SSE41)
+    if (have_sse41 && SelfTestD64(sha256d64_sse41::Transform_4way, 4)) {
+        TransformD64_4way = sha256d64_sse41::Transform_4way;
+        ret += ",sse41(4way)";
+    }
+#endif
+#if defined(USE_SHA256D64_AVX2)
+    if (have_avx2 && SelfTestD64(sha256d64_avx2::Transform_8way, 8)) {
+        TransformD64_8way = sha256d64_avx2::Transform_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+#endif
+    return ret;
+}
 
 ////// SHA-256
 
@@ -147,14 +300,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        Transform(s, data, blocks);
+        data += 64 * blocks;
+        bytes += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +341,29 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (TransformD64_8way) {
+        while (blocks >= 8) {
+            TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (blocks >= 4) {
+            TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
@@ -6,8 +6,18 @@
 
 #include "util.h"
 #include "random.h"
+#include "sync.h"
 
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -15,12 +25,80 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static std::map<std::string, CDBProfile> mapDBProfiles;
+
+/** The open databases, for GetAllDBStats. */
+static CCriticalSection cs_dbs;
+static std::set<const CDBWrapper*> setDBs;
+
+bool SetDBProfiles(const std::vector<std::string>& vArgs, const std::vector<std::string>& vNames, std::string& strError)
 {
+    // Sizes are given in MiB, and must fit a size_t in bytes.
+    const int64_t nMaxSize = std::min<int64_t>(MAX_DB_PROFILE_SIZE, std::numeric_limits<size_t>::max() >> 20);
+    std::map<std::string, CDBProfile> mapProfiles;
+    BOOST_FOREACH(const std::string& strArg, vArgs) {
+        size_t nColon = strArg.find(':');
+        if (nColon == 0 || nColon == std::string::npos) {
+            strError = strprintf("no database name in '%s'", strArg);
+            return false;
+        }
+        const std::string strName = strArg.substr(0, nColon);
+        if (std::find(vNames.begin(), vNames.end(), strName) == vNames.end()) {
+            strError = strprintf("unknown database '%s' in '%s'", strName, strArg);
+            return false;
+        }
+        CDBProfile& profile = mapProfiles[strName];
+        std::string strSettings = strArg.substr(nColon + 1);
+        std::vector<std::string> vSettings;
+        boost::split(vSettings, strSettings, boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strSetting, vSettings) {
+            size_t nEquals = strSetting.find('=');
+            int64_t n;
+            if (nEquals == std::string::npos || !ParseInt64(strSetting.substr(nEquals + 1), &n) || n < 0) {
+                strError = strprintf("invalid setting '%s' in '%s'", strSetting, strArg);
+                return false;
+            }
+            std::string strKey = strSetting.substr(0, nEquals);
+            if (strKey == "blockcache" || strKey == "writebuffer") {
+                if (n > nMaxSize) {
+                    strError = strprintf("%s is more than %d MiB in '%s'", strKey, nMaxSize, strArg);
+                    return false;
+                }
+                if (strKey == "blockcache")
+                    profile.nBlockCache = (size_t)n << 20;
+                else
+                    profile.nWriteBuffer = (size_t)n << 20;
+            } else if (strKey == "bloombits") {
+                if (n > MAX_DB_PROFILE_BLOOM_BITS) {
+                    strError = strprintf("bloombits is more than %d in '%s'", MAX_DB_PROFILE_BLOOM_BITS, strArg);
+                    return false;
+                }
+                profile.nBloomBits = n;
+            } else {
+                strError = strprintf("unknown setting '%s' in '%s'", strKey, strArg);
+                return false;
+            }
+        }
+    }
+    mapDBProfiles.swap(mapProfiles);
+    return true;
+}
+
+CDBProfile GetDBProfile(const std::string& strName)
+{
+    std::map<std::string, CDBProfile>::const_iterator it = mapDBProfiles.find(strName);
+    return it == mapDBProfiles.end() ? CDBProfile() : it->second;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const std::string& strName)
+{
+    const CDBProfile profile = GetDBProfile(strName);
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.block_cache = leveldb::NewLRUCache(profile.nBlockCache ? profile.nBlockCache : nCacheSize / 2);
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = profile.nWriteBuffer ? profile.nWriteBuffer : nCacheSize / 4;
+    if (profile.nBloomBits)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(profile.nBloomBits);
     options.compression = leveldb::kNoCompression;
     options.max_open_files = 64;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
@@ -31,14 +109,15 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const std::string& name)
 {
     penv = NULL;
+    strName = name.empty() ? path.filename().string() : name;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, strName);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -74,10 +153,17 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+
+    LOCK(cs_dbs);
+    setDBs.insert(this);
 }
 
 CDBWrapper::~CDBWrapper()
 {
+    {
+        LOCK(cs_dbs);
+        setDBs.erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -122,6 +208,39 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+CDBStats CDBWrapper::GetStats() const
+{
+    CDBStats stats;
+    stats.strName = strName;
+    pdb->GetProperty("leveldb.stats", &stats.strStats);
+
+    // The table files are listed per level, as " <number>:<size>[<keys>]".
+    std::string strTables;
+    pdb->GetProperty("leveldb.sstables", &strTables);
+    std::istringstream ss(strTables);
+    std::string strLine;
+    while (std::getline(ss, strLine)) {
+        int nLevel;
+        unsigned long long nNumber, nSize;
+        if (sscanf(strLine.c_str(), "--- level %d ---", &nLevel) == 1)
+            stats.vLevels.push_back(std::make_pair(0, 0));
+        else if (!stats.vLevels.empty() && sscanf(strLine.c_str(), " %llu:%llu[", &nNumber, &nSize) == 2) {
+            stats.vLevels.back().first++;
+            stats.vLevels.back().second += nSize;
+        }
+    }
+    return stats;
+}
+
+std::vector<CDBStats> GetAllDBStats()
+{
+    std::vector<CDBStats> vStats;
+    LOCK(cs_dbs);
+    BOOST_FOREACH(const CDBWrapper* pdbw, setDBs)
+        vStats.push_back(pdbw->GetStats());
+    return vStats;
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
@@ -25,6 +25,49 @@ public:
 
 class CDBWrapper;
 
+/**
+ * LevelDB settings for one database, which can be changed per database with
+ * -dbprofile. Zero sizes are derived from the cache size of the database.
+ */
+struct CDBProfile
+{
+    size_t nBlockCache;
+    size_t nWriteBuffer;
+    //! Bits per key of the bloom filter, or 0 for none
+    int nBloomBits;
+
+    CDBProfile() : nBlockCache(0), nWriteBuffer(0), nBloomBits(10) {}
+};
+
+//! Largest block cache and write buffer a profile can set (MiB)
+static const int64_t MAX_DB_PROFILE_SIZE = 16384;
+//! Most bloom filter bits per key a profile can set
+static const int MAX_DB_PROFILE_BLOOM_BITS = 64;
+
+/**
+ * Parse the -dbprofile arguments, which take the form
+ * <db>:<setting>=<n>[,<setting>=<n>...] for one of the databases in vNames,
+ * and use them for the databases opened from then on. Returns false and sets
+ * strError on a malformed one, or one that this LevelDB cannot apply.
+ */
+bool SetDBProfiles(const std::vector<std::string>& vArgs, const std::vector<std::string>& vNames, std::string& strError);
+
+//! The settings used for the database of the given name
+CDBProfile GetDBProfile(const std::string& strName);
+
+/** What LevelDB reports on the state of one database. */
+struct CDBStats
+{
+    std::string strName;
+    //! Output of the leveldb.stats property
+    std::string strStats;
+    //! Number of table files and their total size in bytes, per level
+    std::vector<std::pair<int, uint64_t> > vLevels;
+};
+
+//! Get the statistics of all open databases
+std::vector<CDBStats> GetAllDBStats();
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -50,11 +93,20 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
+    //! Approximate size of the serialized batch
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] parent    CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &parent) : parent(parent) { };
+    CDBBatch(const CDBWrapper &parent) : parent(parent), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -71,6 +123,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
     }
 
     template <typename K>
@@ -82,7 +142,15 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -173,6 +241,9 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! the name under which the database is tuned and reported
+    std::string strName;
+
     //! a key used for optional XOR-obfuscation of the database
     std::vector<unsigned char> obfuscate_key;
 
@@ -192,8 +263,10 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] name        Name used for the -dbprofile settings and statistics. Defaults
+     *                        to the name of the directory.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const std::string& name = "");
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -280,6 +353,10 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    const std::string& GetName() const { return strName; }
+
+    CDBStats GetStats() const;
 };
 
 #endif // BITCOIN_DBWRAPPER_H
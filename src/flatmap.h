@@ -0,0 +1,337 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Allocator of equally sized nodes, carved out of chunks that double in size
+ * up to nMaxChunkNodes. A freed node goes on a free list to be handed out
+ * again; the chunks themselves are only given back all at once, by Clear.
+ * This keeps the many small allocations of a large map off the heap, where
+ * they would fragment it.
+ */
+template<typename T>
+class CChunkedArena
+{
+private:
+    //! Big enough for a T, or for the free list link that replaces it
+    typedef typename std::aligned_storage<
+        (sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*)),
+        (std::alignment_of<T>::value > std::alignment_of<void*>::value ? std::alignment_of<T>::value : std::alignment_of<void*>::value)
+    >::type Slot;
+
+    static const size_t nMinChunkNodes = 16;
+    static const size_t nMaxChunkNodes = 4096;
+
+    //! The chunks, with their number of slots
+    std::vector<std::pair<Slot*, size_t> > vChunks;
+    //! Slots of the last chunk not handed out yet
+    size_t nUnused;
+    //! Head of the free list
+    void* pFree;
+    //! Memory used by the chunks themselves
+    size_t nChunkUsage;
+
+    CChunkedArena(const CChunkedArena&);
+    CChunkedArena& operator=(const CChunkedArena&);
+
+public:
+    CChunkedArena() : nUnused(0), pFree(NULL), nChunkUsage(0) {}
+    ~CChunkedArena() { Clear(); }
+
+    //! Uninitialized memory for one T
+    void* Allocate()
+    {
+        if (pFree) {
+            void* p = pFree;
+            pFree = *static_cast<void**>(p);
+            return p;
+        }
+        if (nUnused == 0) {
+            size_t nNodes = vChunks.empty() ? nMinChunkNodes : std::min(vChunks.back().second * 2, nMaxChunkNodes);
+            vChunks.push_back(std::make_pair(new Slot[nNodes], nNodes));
+            nChunkUsage += memusage::MallocUsage(nNodes * sizeof(Slot));
+            nUnused = nNodes;
+        }
+        return &vChunks.back().first[vChunks.back().second - nUnused--];
+    }
+
+    //! Take back a node allocated here, whose T was destroyed already
+    void Deallocate(void* p)
+    {
+        *static_cast<void**>(p) = pFree;
+        pFree = p;
+    }
+
+    //! Release all chunks. Every node must have been destroyed.
+    void Clear()
+    {
+        for (size_t i = 0; i < vChunks.size(); i++)
+            delete[] vChunks[i].first;
+        std::vector<std::pair<Slot*, size_t> >().swap(vChunks);
+        nUnused = 0;
+        pFree = NULL;
+        nChunkUsage = 0;
+    }
+
+    void swap(CChunkedArena& other)
+    {
+        vChunks.swap(other.vChunks);
+        std::swap(nUnused, other.nUnused);
+        std::swap(pFree, other.pFree);
+        std::swap(nChunkUsage, other.nChunkUsage);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return nChunkUsage + memusage::DynamicUsage(vChunks);
+    }
+};
+
+/**
+ * Hash map with open addressing and linear probing. The table only holds a
+ * pointer to each element and its hash; the elements themselves live in a
+ * CChunkedArena. Elements therefore never move: pointers and references to
+ * them stay valid until they are erased, even when the table grows.
+ * Iterators are invalidated by insertion, as with std::unordered_map.
+ *
+ * Erasing leaves a marker in the table, so iterating while erasing works and
+ * the same kind of loop as for the standard containers can be used. The
+ * markers are dropped when the table is rebuilt, or by clear, which also
+ * returns the memory of the table and of all elements to the system at once.
+ */
+template<typename K, typename V, typename Hash>
+class CFlatHashMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+
+private:
+    struct Bucket
+    {
+        //! The element, or NULL
+        value_type* p;
+        //! Hash of the element; for an empty bucket, whether it was erased
+        size_t nHash;
+    };
+
+    static const size_t nMinBuckets = 16;
+
+    std::vector<Bucket> vBuckets;
+    //! Number of elements
+    size_t nSize;
+    //! Number of buckets marked erased
+    size_t nErased;
+    Hash hasher;
+    CChunkedArena<value_type> arena;
+
+    CFlatHashMap(const CFlatHashMap&);
+    CFlatHashMap& operator=(const CFlatHashMap&);
+
+    size_t Find(const K& key, size_t nHash) const
+    {
+        if (vBuckets.empty())
+            return vBuckets.size();
+        const size_t nMask = vBuckets.size() - 1;
+        for (size_t i = nHash & nMask; ; i = (i + 1) & nMask) {
+            const Bucket& bucket = vBuckets[i];
+            if (bucket.p == NULL) {
+                if (!bucket.nHash)
+                    return vBuckets.size();
+            } else if (bucket.nHash == nHash && bucket.p->first == key) {
+                return i;
+            }
+        }
+    }
+
+    /** Rebuild the table so that it is at most half full after one more insertion. */
+    void Rehash()
+    {
+        size_t nBuckets = nMinBuckets;
+        while (nBuckets < (nSize + 1) * 2)
+            nBuckets *= 2;
+        std::vector<Bucket> vOld(nBuckets, Bucket());
+        vOld.swap(vBuckets);
+        nErased = 0;
+        const size_t nMask = nBuckets - 1;
+        for (size_t j = 0; j < vOld.size(); j++) {
+            if (vOld[j].p == NULL)
+                continue;
+            size_t i = vOld[j].nHash & nMask;
+            while (vBuckets[i].p != NULL)
+                i = (i + 1) & nMask;
+            vBuckets[i] = vOld[j];
+        }
+    }
+
+    template<typename P>
+    size_t Insert(P&& value, bool& fInserted)
+    {
+        const size_t nHash = hasher(value.first);
+        size_t i = Find(value.first, nHash);
+        fInserted = (i == vBuckets.size());
+        if (!fInserted)
+            return i;
+        // Erased buckets count as used, as they make probes longer too.
+        if ((nSize + nErased + 1) * 4 > vBuckets.size() * 3)
+            Rehash();
+        const size_t nMask = vBuckets.size() - 1;
+        for (i = nHash & nMask; vBuckets[i].p != NULL; i = (i + 1) & nMask) {}
+        if (vBuckets[i].nHash)
+            nErased--;
+        vBuckets[i].p = new (arena.Allocate()) value_type(std::forward<P>(value));
+        vBuckets[i].nHash = nHash;
+        nSize++;
+        return i;
+    }
+
+    template<typename B, typename R>
+    class Iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename std::remove_const<R>::type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef R* pointer;
+        typedef R& reference;
+
+    private:
+        B* pos;
+        B* last;
+
+        void Skip() { while (pos != last && pos->p == NULL) pos++; }
+
+    public:
+        Iterator() : pos(NULL), last(NULL) {}
+        Iterator(B* posIn, B* lastIn) : pos(posIn), last(lastIn) { Skip(); }
+        template<typename B2, typename R2>
+        Iterator(const Iterator<B2, R2>& it) : pos(it.pos), last(it.last) {}
+
+        R& operator*() const { return *pos->p; }
+        R* operator->() const { return pos->p; }
+        Iterator& operator++() { pos++; Skip(); return *this; }
+        Iterator operator++(int) { Iterator copy(*this); ++(*this); return copy; }
+        bool operator==(const Iterator& it) const { return pos == it.pos; }
+        bool operator!=(const Iterator& it) const { return pos != it.pos; }
+
+        template<typename B2, typename R2> friend class Iterator;
+        friend class CFlatHashMap;
+    };
+
+public:
+    typedef Iterator<Bucket, value_type> iterator;
+    typedef Iterator<const Bucket, const value_type> const_iterator;
+
+    CFlatHashMap() : nSize(0), nErased(0) {}
+    ~CFlatHashMap() { clear(); }
+
+    iterator begin() { return iterator(vBuckets.data(), vBuckets.data() + vBuckets.size()); }
+    iterator end() { return iterator(vBuckets.data() + vBuckets.size(), vBuckets.data() + vBuckets.size()); }
+    const_iterator begin() const { return const_iterator(vBuckets.data(), vBuckets.data() + vBuckets.size()); }
+    const_iterator end() const { return const_iterator(vBuckets.data() + vBuckets.size(), vBuckets.data() + vBuckets.size()); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const K& key)
+    {
+        return iterator(vBuckets.data() + Find(key, hasher(key)), vBuckets.data() + vBuckets.size());
+    }
+
+    const_iterator find(const K& key) const
+    {
+        return const_iterator(vBuckets.data() + Find(key, hasher(key)), vBuckets.data() + vBuckets.size());
+    }
+
+    size_t count(const K& key) const { return Find(key, hasher(key)) != vBuckets.size(); }
+
+    template<typename P>
+    std::pair<iterator, bool> insert(P&& value)
+    {
+        bool fInserted;
+        size_t i = Insert(std::forward<P>(value), fInserted);
+        return std::make_pair(iterator(vBuckets.data() + i, vBuckets.data() + vBuckets.size()), fInserted);
+    }
+
+    V& operator[](const K& key)
+    {
+        bool fInserted;
+        return vBuckets[Insert(std::make_pair(key, V()), fInserted)].p->second;
+    }
+
+    iterator erase(iterator it)
+    {
+        Bucket& bucket = *it.pos;
+        bucket.p->~value_type();
+        arena.Deallocate(bucket.p);
+        bucket.p = NULL;
+        bucket.nHash = 1;
+        nSize--;
+        nErased++;
+        return ++it;
+    }
+
+    size_t erase(const K& key)
+    {
+        iterator it = find(key);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Remove all elements and release their memory, including the table. */
+    void clear()
+    {
+        for (size_t i = 0; i < vBuckets.size(); i++) {
+            if (vBuckets[i].p != NULL)
+                vBuckets[i].p->~value_type();
+        }
+        std::vector<Bucket>().swap(vBuckets);
+        arena.Clear();
+        nSize = 0;
+        nErased = 0;
+    }
+
+    /** Exchange the contents of two maps, without moving any element. */
+    void swap(CFlatHashMap& other)
+    {
+        vBuckets.swap(other.vBuckets);
+        std::swap(nSize, other.nSize);
+        std::swap(nErased, other.nErased);
+        std::swap(hasher, other.hasher);
+        arena.swap(other.arena);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(vBuckets) + arena.DynamicMemoryUsage();
+    }
+};
+
+namespace memusage
+{
+
+template<typename K, typename V, typename H>
+static inline size_t DynamicUsage(const CFlatHashMap<K, V, H>& m)
+{
+    return m.DynamicMemoryUsage();
+}
+
+}
+
+#endif // BITCOIN_FLATMAP_H
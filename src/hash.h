@@ -205,4 +205,10 @@ public:
  */
 uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
 
+/** Optimized SipHash-2-4 implementation for a uint256 followed by a 32-bit
+ *  value, as used to hash outpoints. It is identical to hashing the 36 bytes
+ *  of val and the little-endian extra with CSipHasher.
+ */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+
 #endif // BITCOIN_HASH_H
@@ -16,6 +16,7 @@
 #include "checkpoints.h"
 #include "compat/sanity.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "httpserver.h"
 #include "httprpc.h"
 #include "key.h"
@@ -145,19 +146,38 @@ bool ShutdownRequested()
 */
 class CCoinsViewErrorCatcher : public CCoinsViewBacked
 {
+private:
+    [[noreturn]] static void OnReadError(const std::runtime_error& e) {
+        uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+        LogPrintf("Error reading from database: %s\n", e.what());
+        // Starting the shutdown sequence and returning false to the caller would be
+        // interpreted as 'entry not found' (as opposed to unable to read data), and
+        // could lead to invalid interpretation. Just exit immediately, as we can't
+        // continue anyway, and all writes should be atomic.
+        abort();
+    }
+
 public:
     CCoinsViewErrorCatcher(CCoinsView* view) : CCoinsViewBacked(view) {}
-    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const {
         try {
-            return CCoinsViewBacked::GetCoins(txid, coins);
+            return CCoinsViewBacked::GetCoin(outpoint, coin);
         } catch(const std::runtime_error& e) {
-            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
-            LogPrintf("Error reading from database: %s\n", e.what());
-            // Starting the shutdown sequence and returning false to the caller would be
-            // interpreted as 'entry not found' (as opposed to unable to read data), and
-            // could lead to invalid interpretation. Just exit immediately, as we can't
-            // continue anyway, and all writes should be atomic.
-            abort();
+            OnReadError(e);
+        }
+    }
+    bool HaveCoin(const COutPoint &outpoint) const {
+        try {
+            return CCoinsViewBacked::HaveCoin(outpoint);
+        } catch(const std::runtime_error& e) {
+            OnReadError(e);
+        }
+    }
+    uint256 GetBestBlock() const {
+        try {
+            return CCoinsViewBacked::GetBestBlock();
+        } catch(const std::runtime_error& e) {
+            OnReadError(e);
         }
     }
     // Writes do not need similar protection, as failure to write is handled by the caller.
@@ -224,6 +244,8 @@ void Shutdown()
         pcoinsTip = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsWriter;
+        pcoinsWriter = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
@@ -309,6 +331,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-backgroundflush", strprintf(_("Write the chainstate to disk in the background, which can take up to twice -dbcache in memory (default: %u)"), DEFAULT_BACKGROUND_FLUSH));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
@@ -322,7 +345,13 @@ std::string HelpMessage(HelpMessageMode mode)
 #endif
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-dbbatchsize=<n>", strprintf("Maximum database write batch size in bytes (1 to %d, default: %u)", nMaxDbCache << 20, nDefaultDbBatchSize));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-dbprofile=<db>:<setting>=<n>,...", "Tune the LevelDB settings of the chainstate or blockindex (which includes the txindex) database: "
+            "blockcache and writebuffer in megabytes, and bloombits per key (0 to disable). "
+            "The sizes default to shares of -dbcache, and count in addition to it when set (default: bloombits=10)");
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
@@ -331,6 +360,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    if (showDebug) {
+        strUsage += HelpMessageOpt("-parbatch=<n>", strprintf("Most script checks a verification thread takes at once (default: %u)", DEFAULT_SCRIPTCHECK_BATCH));
+        strUsage += HelpMessageOpt("-parpin", strprintf("Pin each verification thread to a core of its own, leaving the first core to the node (default: %u)", DEFAULT_SCRIPTCHECK_PIN));
+        strUsage += HelpMessageOpt("-prefetchinputs", strprintf("Look up the coins spent by a block in parallel before connecting it (default: %u)", DEFAULT_PREFETCH_INPUTS));
+    }
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
@@ -417,7 +451,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-limitdescendantsize=<n>", strprintf("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u).", DEFAULT_DESCENDANT_SIZE_LIMIT));
         strUsage += HelpMessageOpt("-bip9params=deployment:start:end", "Use given start/end times for specified bip9 deployment (regtest-only)");
     }
-    string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, http, libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, selectcoins, tor, zmq"; // Don't translate these and qt below
+    string debugCategories = "addrman, alert, auxpow, bench, cmpctblock, coindb, db, http, libevent, lock, mempool, mempoolrej, net, proxy, prune, rand, reindex, rpc, selectcoins, tor, zmq"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         debugCategories += ", qt";
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
@@ -433,7 +467,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature and script execution caches to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying, mining and transaction creation (default: %s)"),
@@ -480,6 +514,8 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-rpcservertimeout=<n>", strprintf("Timeout during HTTP requests (default: %d)", DEFAULT_HTTP_SERVER_TIMEOUT));
     }
     strUsage += HelpMessageOpt("-auxminingaddr=<addr>", _("Address for getauxblock coinbase"));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-auxblockstoresize=<n>", strprintf("Keep at most <n> kilobytes of merge-mining work, oldest evicted first (default: %u)", DEFAULT_AUXBLOCK_STORE_SIZE));
 
     return strUsage;
 }
@@ -925,6 +961,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    int64_t nScriptCheckBatch = GetArg("-parbatch", DEFAULT_SCRIPTCHECK_BATCH);
+    if (nScriptCheckBatch < 1 || nScriptCheckBatch > 65536)
+        return InitError(strprintf(_("Invalid value for -parbatch: %d"), nScriptCheckBatch));
+    SetScriptCheckBatchSize(nScriptCheckBatch);
+    fPrefetchInputs = GetBoolArg("-prefetchinputs", DEFAULT_PREFETCH_INPUTS);
+    std::vector<std::string> vDBNames;
+    vDBNames.push_back(CHAINSTATE_DB_NAME);
+    vDBNames.push_back(BLOCKINDEX_DB_NAME);
+    std::string strDBProfileError;
+    if (!SetDBProfiles(mapMultiArgs["-dbprofile"], vDBNames, strDBProfileError))
+        return InitError(strprintf(_("Invalid -dbprofile: %s"), strDBProfileError));
+    int64_t nDbBatchSize = GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    if (nDbBatchSize < 1 || nDbBatchSize > (nMaxDbCache << 20))
+        return InitError(strprintf(_("Invalid value for -dbbatchsize: %d"), nDbBatchSize));
 
     fServer = GetBoolArg("-server", false);
 
@@ -1082,10 +1132,19 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
-    LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+    LogPrintf("Using %u threads for script and header verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
-        for (int i=0; i<nScriptCheckThreads-1; i++)
-            threadGroup.create_thread(&ThreadScriptCheck);
+        // Pinned workers take cores 1 and up, the header workers after the
+        // script workers; the threads adding the checks keep core 0 to
+        // themselves. With a single core there is nothing to pin to.
+        const int nCores = GetNumCores();
+        bool fPin = GetBoolArg("-parpin", DEFAULT_SCRIPTCHECK_PIN) && nCores > 1;
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
+            int nScriptCore = fPin ? 1 + i % (nCores - 1) : -1;
+            int nHeaderCore = fPin ? 1 + (nScriptCheckThreads - 1 + i) % (nCores - 1) : -1;
+            threadGroup.create_thread(boost::bind(&ThreadScriptCheck, nScriptCore));
+            threadGroup.create_thread(boost::bind(&ThreadHeaderCheck, nHeaderCore));
+        }
     }
 
     // Start the lightweight task scheduler thread
@@ -1110,6 +1169,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     std::string sse2detect = scrypt_detect_sse2();
     LogPrintf("%s\n", sse2detect);
 #endif
+    LogPrintf("Using the '%s' SHA256 implementation\n", SHA256AutoDetect());
 
     // ********************************************************* Step 5: verify wallet database integrity
 #ifdef ENABLE_WALLET
@@ -1290,17 +1350,28 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     int64_t nBlockTreeDBCache = nTotalCache / 8;
     nBlockTreeDBCache = std::min(nBlockTreeDBCache, (GetBoolArg("-txindex", DEFAULT_TXINDEX) ? nMaxBlockDBAndTxIndexCache : nMaxBlockDBCache) << 20);
     nTotalCache -= nBlockTreeDBCache;
+    int64_t nAuxPowCache = std::min(nTotalCache / 16, nMaxAuxPowCache << 20);
+    nTotalCache -= nAuxPowCache;
     int64_t nCoinDBCache = std::min(nTotalCache / 2, (nTotalCache / 4) + (1 << 23)); // use 25%-50% of the remainder for disk cache
     nCoinDBCache = std::min(nCoinDBCache, nMaxCoinsDBCache << 20); // cap total coins db cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheUsage = nTotalCache; // the rest goes to in-memory cache
     LogPrintf("Cache configuration:\n");
     LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for in-memory auxpow cache\n", nAuxPowCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
     LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
 
+    InitSignatureCache();
+    InitScriptExecutionCache();
+    CHashCacheStats sigcachestats, scriptcachestats;
+    GetSignatureCacheStats(sigcachestats);
+    GetScriptExecutionCacheStats(scriptcachestats);
+    LogPrintf("* Using %.1fMiB for signature cache, able to store %u entries\n", sigcachestats.nUsage * (1.0 / 1024 / 1024), sigcachestats.nCapacity);
+    LogPrintf("* Using %.1fMiB for script execution cache, able to store %u entries\n", scriptcachestats.nUsage * (1.0 / 1024 / 1024), scriptcachestats.nCapacity);
+
     bool fLoaded = false;
-    while (!fLoaded) {
+    while (!fLoaded && !fRequestShutdown) {
         bool fReset = fReindex;
         std::string strLoadError;
 
@@ -1315,7 +1386,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pcoinscatcher;
                 delete pblocktree;
 
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, nAuxPowCache);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
@@ -1327,6 +1398,19 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                         CleanupBlockRevFiles();
                 }
 
+                // If necessary, upgrade from the full auxpow block index format.
+                if (!pblocktree->Upgrade()) {
+                    strLoadError = _("Error upgrading block index database");
+                    break;
+                }
+
+                // If necessary, upgrade from the per-transaction UTXO format.
+                // This is a no-op if the chainstate was wiped by -reindex(-chainstate).
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
                 bool fAuxPow = false;
                 fAuxPow = pblocktree->ReadFlag("auxpow", fAuxPow) && fAuxPow;
                 if (fAuxPow && !LoadBlockIndex()) {
@@ -1407,7 +1491,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             fLoaded = true;
         } while(false);
 
-        if (!fLoaded) {
+        if (!fLoaded && !fRequestShutdown) {
             // first suggest a reindex
             if (!fReset) {
                 bool fRet = uiInterface.ThreadSafeQuestion(
@@ -1437,6 +1521,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    // VerifyDB reads the chainstate from disk, so loading wrote to it
+    // directly. Only from here on is it written in the background.
+    if (GetBoolArg("-backgroundflush", DEFAULT_BACKGROUND_FLUSH)) {
+        LOCK(cs_main);
+        pcoinsWriter = new CCoinsViewWriteBehind(pcoinsdbview);
+        pcoinscatcher->SetBackend(*pcoinsWriter);
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
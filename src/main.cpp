@@ -14,6 +14,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/scrypt.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -67,6 +68,7 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+bool fPrefetchInputs = DEFAULT_PREFETCH_INPUTS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
@@ -111,6 +113,8 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  * in the last Consensus::Params::nMajorityWindow blocks, starting at pstart and going backwards.
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
+/** Script verification flags for a block of version nVersion and time nTime on top of pindexPrev */
+static unsigned int GetBlockScriptFlags(int32_t nVersion, int64_t nTime, const CBlockIndex* pindexPrev, const Consensus::Params& consensusparams);
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
 
 /** Constant stuff for coinbase transactions we create: */
@@ -697,6 +701,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsViewWriteBehind *pcoinsWriter = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -979,15 +984,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -1043,7 +1048,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     unsigned int nSigOps = 0;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         if (prevout.scriptPubKey.IsPayToScriptHash())
             nSigOps += prevout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
     }
@@ -1063,7 +1068,7 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
-        const CTxOut &prevout = inputs.GetOutputFor(tx.vin[i]);
+        const CTxOut &prevout = inputs.AccessCoin(tx.vin[i].prevout).out;
         nSigOps += CountWitnessSigOps(tx.vin[i].scriptSig, prevout.scriptPubKey, i < tx.wit.vtxinwit.size() ? &tx.wit.vtxinwit[i].scriptWitness : NULL, flags);
     }
     return nSigOps;
@@ -1126,9 +1131,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -1143,7 +1148,7 @@ std::string FormatStateMessage(const CValidationState &state)
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              std::vector<COutPoint>& coins_to_uncache)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
@@ -1243,31 +1248,25 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
-        }
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                coins_to_uncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out))) {
+                        return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+                    }
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(false, REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -1309,8 +1308,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1526,30 +1525,36 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
-            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (tx.wit.IsNull() && CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
             return false;
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
+        // Check again against just the consensus-critical script verification
+        // flags of the next block, in case of bugs in the standard flags that
+        // cause transactions to pass as valid when they're actually invalid.
+        // For instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        //
+        // Passing under those flags goes into the script execution cache, so
+        // ConnectBlock can skip the scripts when the transaction is mined. The
+        // flags must be exactly those ConnectBlock uses; a block with other
+        // flags, e.g. right after a soft fork, just misses.
+        unsigned int blockScriptVerifyFlags = GetBlockScriptFlags(ComputeBlockVersion(chainActive.Tip(), Params().GetConsensus()), GetAdjustedTime(), chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, blockScriptVerifyFlags, true, true, txdata))
         {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
         }
 
@@ -1583,11 +1588,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> coins_to_uncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, coins_to_uncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, coins_to_uncache)
+            pcoinsTip->Uncache(outpoint);
     }
     return res;
 }
@@ -1629,15 +1634,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
-        {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
-        }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+        if (!coin.IsSpent())
+            pindexSlow = chainActive[coin.nHeight];
     }
 
     if (pindexSlow) {
@@ -1940,24 +1939,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1975,6 +1964,41 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CScriptCheck::Evaluate(CSignatureBatch& batch) {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    const CScriptWitness *witness = (nIn < ptxTo->wit.vtxinwit.size()) ? &ptxTo->wit.vtxinwit[nIn].scriptWitness : NULL;
+    return VerifyScript(scriptSig, scriptPubKey, witness, nFlags, DeferringTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata, batch), &error);
+}
+
+bool CCheckQueueBatch<CScriptCheck>::Run(std::vector<CScriptCheck>& vChecks)
+{
+    // The interpreter is told every deferred signature is valid. Where that
+    // holds, evaluation went exactly as it would have; a check that met an
+    // invalid signature, or failed while assuming they were all valid, is run
+    // again with its signatures checked as they come.
+    CSignatureBatch batch;
+    std::vector<size_t> vBegin(vChecks.size() + 1);
+    std::vector<bool> vRerun(vChecks.size(), false);
+    for (size_t i = 0; i < vChecks.size(); i++) {
+        vBegin[i] = batch.Size();
+        if (!vChecks[i].Evaluate(batch)) {
+            batch.Truncate(vBegin[i]);
+            vRerun[i] = true;
+        }
+    }
+    vBegin[vChecks.size()] = batch.Size();
+
+    batch.Verify();
+
+    for (size_t i = 0; i < vChecks.size(); i++) {
+        if (vRerun[i] || !batch.AllValid(vBegin[i], vBegin[i + 1])) {
+            if (!vChecks[i]())
+                return false;
+        }
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1997,20 +2021,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < nMaturity)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - coin.nHeight < nMaturity)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -2030,7 +2054,53 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+namespace {
+
+/**
+ * Transactions whose scripts all passed, as SHA256(nonce || wtxid || flags).
+ * The wtxid commits to the outpoints spent and so to the scripts and amounts
+ * they lock, which makes an entry as good as running the scripts again with
+ * those flags. Other flags, as after a soft fork activates, simply miss.
+ * The counters are guarded by cs_main, which all callers of CheckInputs hold.
+ */
+CAtomicHashSet scriptExecutionCache;
+uint256 scriptExecutionCacheNonce;
+uint64_t nScriptExecutionCacheHits = 0;
+uint64_t nScriptExecutionCacheMisses = 0;
+
+}
+
+void InitScriptExecutionCache()
+{
+    // The signature cache gets the other half of -maxsigcachesize.
+    GetRandBytes(scriptExecutionCacheNonce.begin(), 32);
+    int64_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE));
+    scriptExecutionCache.Resize((size_t)nMaxCacheSize << 19);
+}
+
+void GetScriptExecutionCacheStats(CHashCacheStats& stats)
+{
+    stats.nCount = scriptExecutionCache.GetCount();
+    stats.nCapacity = scriptExecutionCache.GetCapacity();
+    stats.nUsage = scriptExecutionCache.DynamicMemoryUsage();
+    stats.nHits = nScriptExecutionCacheHits;
+    stats.nMisses = nScriptExecutionCacheMisses;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(DEFAULT_SCRIPTCHECK_BATCH, MAX_SCRIPTCHECK_THREADS);
+
+void SetScriptCheckBatchSize(unsigned int nBatchSize) {
+    scriptcheckqueue.SetBatchSize(nBatchSize);
+}
+
+void ThreadScriptCheck(int nCore) {
+    RenameThread("canadaecoin-scriptch");
+    if (nCore >= 0 && !SetThreadAffinity(nCore))
+        LogPrintf("%s: could not pin thread to core %d\n", __func__, nCore);
+    scriptcheckqueue.Thread();
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -2051,13 +2121,55 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // the checkpoint is for a chain that's invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            // Skip the scripts of a transaction that already passed them with
+            // these flags, dropping the entry if it won't be needed again.
+            uint256 hashCacheEntry;
+            unsigned char vchFlags[4];
+            WriteLE32(vchFlags, flags);
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetWitnessHash().begin(), 32).Write(vchFlags, sizeof(vchFlags)).Finalize(hashCacheEntry.begin());
+            if (scriptExecutionCache.Contains(hashCacheEntry, !cacheFullScriptStore)) {
+                nScriptExecutionCacheHits++;
+                return true;
+            }
+            nScriptExecutionCacheMisses++;
+
+            // Spread the scripts of a large transaction over the verification
+            // threads. Should any fail, the loop below runs them again one by
+            // one to find out why.
+            if (!pvChecks && nScriptCheckThreads && tx.vin.size() >= MIN_PARALLEL_SCRIPT_CHECK_INPUTS) {
+                std::vector<CScriptCheck> vChecks;
+                vChecks.reserve(tx.vin.size());
+                for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                    const Coin& coin = inputs.AccessCoin(tx.vin[i].prevout);
+                    assert(!coin.IsSpent());
+                    CScriptCheck check(coin.out.scriptPubKey, coin.out.nValue, tx, i, flags, cacheSigStore, &txdata);
+                    vChecks.push_back(CScriptCheck());
+                    check.swap(vChecks.back());
+                }
+                CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+                control.Add(vChecks);
+                if (control.Wait()) {
+                    if (cacheFullScriptStore)
+                        scriptExecutionCache.Insert(hashCacheEntry);
+                    return true;
+                }
+            }
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
+
+                // We very carefully only pass in things to CScriptCheck which
+                // are clearly committed to by tx' witness hash. This provides
+                // a sanity check that our caching is not introducing consensus
+                // failures through additional data in, eg, the coins being
+                // spent being checked as a part of CScriptCheck.
+                const CScript& scriptPubKey = coin.out.scriptPubKey;
+                const CAmount amount = coin.out.nValue;
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(scriptPubKey, amount, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2069,8 +2181,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                        CScriptCheck check2(scriptPubKey, amount, tx, i,
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2084,6 +2196,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Only checks run here are known to have passed; those handed
+            // out through pvChecks are still pending.
+            if (cacheFullScriptStore && !pvChecks)
+                scriptExecutionCache.Insert(hashCacheEntry);
         }
     }
 
@@ -2166,37 +2283,41 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 
 } // anon namespace
 
+enum DisconnectResult
+{
+    DISCONNECT_OK,      // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED   // Something else went wrong.
+};
+
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @return A DisconnectResult as an int
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
+    if (view.HaveCoin(out)) fClean = error("%s: undo data overwriting existing output", __func__);
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            return DISCONNECT_FAILED; // adding output for transaction without known metadata
+        }
     }
-    if (coins->IsAvailable(out.n))
-        fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    view.AddCoin(out, std::move(undo), !fClean);
 
-    return fClean;
+    return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
 }
 
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
@@ -2225,33 +2346,28 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != coin.nHeight || tx.IsCoinBase() != coin.IsCoinBase()) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                int res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                if (res == DISCONNECT_FAILED)
+                    return error("DisconnectBlock(): undo data for %s lacks coin metadata", out.ToString());
+                fClean = fClean && res != DISCONNECT_UNCLEAN;
             }
         }
     }
@@ -2267,6 +2383,94 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     return fClean;
 }
 
+/** Apply the effects of a block on the UTXO set, for blocks that may have been applied partially already. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& inputs, const CChainParams& params)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus()))
+        return error("%s: ReadBlockFromDisk failed at %d, hash=%s", __func__, pindex->nHeight, pindex->GetBlockHash().ToString());
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                inputs.SpendCoin(txin.prevout);
+        }
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(inputs, tx, pindex->nHeight, true);
+    }
+    return true;
+}
+
+/**
+ * Bring the chainstate back to a consistent state after a crash in the middle
+ * of writing it, which left it between the two blocks recorded as its head
+ * blocks. Both deleting and writing a coin can safely be done twice, so the
+ * blocks of the old branch are disconnected and those of the new one connected
+ * again on top of whatever made it to disk.
+ */
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view)
+{
+    LOCK(cs_main);
+
+    CCoinsViewCache cache(view);
+
+    std::vector<uint256> vhashHeads = view->GetHeadBlocks();
+    if (vhashHeads.empty())
+        return true; // We're already in a consistent state.
+    if (vhashHeads.size() != 2)
+        return error("%s: unknown inconsistent state", __func__);
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    const CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted write.
+    const CBlockIndex* pindexNew;         // New tip during the interrupted write.
+    const CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(vhashHeads[0]) == 0)
+        return error("%s: reorganization to unknown block requested", __func__);
+    pindexNew = mapBlockIndex[vhashHeads[0]];
+
+    if (!vhashHeads[1].IsNull()) { // The old tip is null if this was the first write.
+        if (mapBlockIndex.count(vhashHeads[1]) == 0)
+            return error("%s: reorganization from unknown block requested", __func__);
+        pindexOld = mapBlockIndex[vhashHeads[1]];
+        pindexFork = LastCommonAncestor(mapBlockIndex[vhashHeads[1]], mapBlockIndex[vhashHeads[0]]);
+        cache.SetBestBlock(pindexOld->GetBlockHash());
+    }
+
+    // Roll back along the old branch.
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus()))
+                return error("%s: ReadBlockFromDisk failed at %d, hash=%s", __func__, pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            // An unclean disconnect only means that the block had not been
+            // written completely, which is exactly what is expected here.
+            CValidationState state;
+            bool fClean;
+            if (!DisconnectBlock(block, state, pindexOld, cache, &fClean))
+                return error("%s: DisconnectBlock failed at %d, hash=%s", __func__, pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache, params))
+            return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    bool fOk = cache.Flush();
+    uiInterface.ShowProgress("", 100);
+    return fOk;
+}
+
 void static FlushBlockFile(bool fFinalize = false)
 {
     LOCK(cs_LastBlockFile);
@@ -2292,11 +2496,74 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CHeaderPoWCheck> headercheckqueue(8, MAX_SCRIPTCHECK_THREADS);
 
-void ThreadScriptCheck() {
-    RenameThread("canadaecoin-scriptch");
-    scriptcheckqueue.Thread();
+void ThreadHeaderCheck(int nCore) {
+    RenameThread("canadaecoin-headerch");
+    if (nCore >= 0 && !SetThreadAffinity(nCore))
+        LogPrintf("%s: could not pin thread to core %d\n", __func__, nCore);
+    headercheckqueue.Thread();
+}
+
+bool CHeaderPoWCheck::operator()() {
+    std::vector<CBlockHeader> vPlain;
+    std::vector<unsigned int> vPlainPos;
+    for (unsigned int i = 0; i < nCount; i++) {
+        const CBlockHeader& header = pheaders[i];
+        if (header.auxpow) {
+            pfValid[i] = CheckBlockProofOfWork(&header, *pparams);
+            if (!pfValid[i])
+                return false;
+        } else {
+            uint256 powhash;
+            if (powhashcache.Get(header.GetHash(), powhash)) {
+                pfValid[i] = CheckProofOfWork(powhash, header.nBits, *pparams);
+                if (!pfValid[i])
+                    return false;
+                continue;
+            }
+            vPlain.push_back(header);
+            vPlainPos.push_back(i);
+        }
+    }
+    if (vPlain.empty())
+        return true;
+
+    std::vector<uint256> vHashes = GetPoWHashes(vPlain);
+    for (unsigned int i = 0; i < vPlain.size(); i++) {
+        powhashcache.Insert(vPlain[i].GetHash(), vHashes[i]);
+        pfValid[vPlainPos[i]] = CheckProofOfWork(vHashes[i], vPlain[i].nBits, *pparams);
+        if (!pfValid[vPlainPos[i]])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Check the proof of work of headers[nBegin..nEnd) on the header check
+ * threads, without holding cs_main. vValid receives one flag per header;
+ * headers that were not checked, or failed, are left false. Once one check
+ * fails, the remaining ones are skipped.
+ */
+static void CheckHeadersProofOfWork(const std::vector<CBlockHeader>& headers, unsigned int nBegin, unsigned int nEnd, std::vector<unsigned char>& vValid, const Consensus::Params& consensusParams)
+{
+    vValid.assign(headers.size(), false);
+    // Give every check exactly as many headers as the widest scrypt kernel takes.
+    const unsigned int nChunk = scrypt_multi_ways();
+
+    CCheckQueueControl<CHeaderPoWCheck> control(nScriptCheckThreads ? &headercheckqueue : NULL);
+    std::vector<CHeaderPoWCheck> vChecks;
+    for (unsigned int n = nBegin; n < nEnd; n += nChunk) {
+        CHeaderPoWCheck check(&headers[n], &vValid[n], std::min(nChunk, nEnd - n), consensusParams);
+        if (nScriptCheckThreads) {
+            vChecks.push_back(CHeaderPoWCheck());
+            check.swap(vChecks.back());
+        } else if (!check()) {
+            return;
+        }
+    }
+    control.Add(vChecks);
+    control.Wait();
 }
 
 // Protected by cs_main
@@ -2353,6 +2620,51 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+static unsigned int GetBlockScriptFlags(int32_t nVersion, int64_t nTime, const CBlockIndex* pindexPrev, const Consensus::Params& consensusparams)
+{
+    AssertLockHeld(cs_main);
+    const int nHeight = pindexPrev->nHeight + 1;
+
+    // BIP16 didn't become active until Oct 1 2012
+    int64_t nBIP16SwitchTime = 1349049600;
+    bool fStrictPayToScriptHash = (nTime >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // NOP2 is redefined as CHECKLOCKTIMEVERIFY in blocks with nVersion >= 3
+    //
+    // Introduce CHECKLOCKTIMEVERIFY at the same time as AuxPow.
+    if ((nVersion & 0xFF) < VERSIONBITS_TOP_BITS
+        && (nVersion & 0xFF) >= 3
+        && nHeight >= consensusparams.nCLTVStartBlock)
+    {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=4 blocks, when 75% of the network has upgraded:
+    if ((nVersion & 0xFF) < VERSIONBITS_TOP_BITS
+        && (nVersion & 0xff) >= 4
+        && IsSuperMajority(4, pindexPrev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)
+        && nHeight >= consensusparams.nBIP66MinStartBlock)
+    {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindexPrev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE ||
+        nHeight >= consensusparams.nWitnessStartHeight) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindexPrev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
 {
@@ -2417,52 +2729,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
-    // BIP16 didn't become active until Oct 1 2012
-    int64_t nBIP16SwitchTime = 1349049600;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // NOP2 is redefined as CHECKLOCKTIMEVERIFY in blocks with nVersion >= 3
-    //
-    // Introduce CHECKLOCKTIMEVERIFY at the same time as AuxPow.
-    if ((block.nVersion & 0xFF) < VERSIONBITS_TOP_BITS
-        && (block.nVersion & 0xFF) >= 3
-        && pindex->nHeight >= chainparams.GetConsensus().nCLTVStartBlock)
-    {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
-
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=4 blocks, when 75% of the network has upgraded:
-    if ((block.nVersion & 0xFF) < VERSIONBITS_TOP_BITS
-        && (block.nVersion & 0xff) >= 4
-        && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())
-        && pindex->nHeight >= chainparams.GetConsensus().nBIP66MinStartBlock)
-    {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
+    unsigned int flags = GetBlockScriptFlags(block.nVersion, pindex->GetBlockTime(), pindex->pprev, chainparams.GetConsensus());
 
     // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
     int nLockTimeFlags = 0;
     if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE ||
         pindex->nHeight >= chainparams.GetConsensus().nWitnessStartHeight) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
-
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
 
@@ -2498,7 +2782,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             // Which orphan pool entries must we evict?
@@ -2534,7 +2818,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2562,6 +2846,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    if (fScriptChecks && nScriptCheckThreads && LogAcceptCategory("bench")) {
+        const CCheckQueueStats& stats = scriptcheckqueue.GetStats();
+        LogPrintf("        - Script checks: %u on %u threads (%u to %u each), %u steals, wait %.2fms, tail %.2fms\n",
+            stats.nChecks, stats.nThreads, stats.nMinChecks, stats.nMaxChecks, stats.nSteals, 0.001 * stats.nWaitMicros, 0.001 * stats.nTailMicros);
+    }
 
     if (fJustCheck)
         return true;
@@ -2698,23 +2987,28 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 mapDirtyAuxPow.erase((*it)->GetBlockHash());
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // With -backgroundflush, the chainstate is only handed over to be
+        // written. Wait for it when asked to, and before removing block files
+        // that replaying an interrupted write could need.
+        if (pcoinsWriter && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsWriter->Sync())
+            return AbortNode(state, "Failed to write to coin database");
+        // Finally remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -3747,7 +4041,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3766,7 +4060,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3875,6 +4169,72 @@ static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned
 }
 
 
+/**
+ * Look up the coins spent by a block that is about to be connected, on as many
+ * threads as script verification uses, and add them to pcoinsTip. ConnectBlock
+ * then finds them in memory, instead of reading them from disk one at a time
+ * while holding cs_main.
+ *
+ * The lookups go to the view behind pcoinsTip without holding cs_main. That
+ * view only changes when pcoinsTip is flushed, so the results are dropped if
+ * that happened in the meantime.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    std::vector<COutPoint> vOutPoints;
+    CCoinsView* pbase;
+    uint64_t nFlushes;
+    {
+        LOCK(cs_main);
+        // Only a block on top of the tip is connected right away.
+        if (chainActive.Tip() == NULL || block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+            return;
+        // Outputs created by the block itself are not there yet.
+        std::set<uint256> setBlockTxids;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            setBlockTxids.insert(tx.GetHash());
+        for (size_t i = 1; i < block.vtx.size(); i++) {
+            BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin) {
+                if (!setBlockTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vOutPoints.push_back(txin.prevout);
+            }
+        }
+        pbase = pcoinsTip->GetBackend();
+        nFlushes = pcoinsTip->GetFlushCount();
+    }
+    if (vOutPoints.empty())
+        return;
+
+    std::vector<Coin> vCoins(vOutPoints.size());
+    const int nThreads = std::max(1, std::min(nScriptCheckThreads, (int)(vOutPoints.size() / MIN_PREFETCH_INPUTS_PER_THREAD)));
+    auto lookup = [pbase, nThreads, &vOutPoints, &vCoins](int nThread) {
+        for (size_t i = nThread; i < vOutPoints.size(); i += nThreads) {
+            if (!pbase->GetCoin(vOutPoints[i], vCoins[i]))
+                vCoins[i].Clear();
+        }
+    };
+    boost::thread_group threads;
+    for (int i = 1; i < nThreads; i++)
+        threads.create_thread([&lookup, i]() { lookup(i); });
+    lookup(0);
+    threads.join_all();
+
+    LOCK(cs_main);
+    if (pcoinsTip->GetFlushCount() != nFlushes) {
+        LogPrint("bench", "    - Prefetch: dropped, as the coins cache was flushed\n");
+        return;
+    }
+    unsigned int nFound = 0;
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        if (!vCoins[i].IsSpent()) {
+            pcoinsTip->AddPrefetchedCoin(vOutPoints[i], std::move(vCoins[i]));
+            nFound++;
+        }
+    }
+    LogPrint("bench", "    - Prefetch: %.2fms (%u of %u coins found, %d threads)\n", 0.001 * (GetTimeMicros() - nTimeStart), nFound, (unsigned int)vOutPoints.size(), nThreads);
+}
+
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp, bool fMayBanPeerIfInvalid)
 {
     {
@@ -3897,6 +4257,9 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, C
 
     NotifyHeaderTip();
 
+    if (fPrefetchInputs)
+        PrefetchBlockInputs(*pblock);
+
     if (!ActivateBestChain(state, chainparams, pblock))
         return error("%s: ActivateBestChain failed", __func__);
 
@@ -4104,7 +4467,7 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, std::max(nScriptCheckThreads, 1)))
         return false;
 
     boost::this_thread::interruption_point();
@@ -4195,6 +4558,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Finish writing the chainstate, if that was interrupted
+    if (!ReplayBlocks(chainparams, pcoinsTip) || !pcoinsTip->Flush())
+        return error("%s: unable to replay blocks", __func__);
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -4857,12 +5224,13 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
                 recentRejects->reset();
             }
 
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
+            // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
             // requesting or processing some txs which have already been included in a block
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -6037,6 +6405,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Proof of work is context-free, so verify it for the headers we do
+        // not know yet before taking cs_main for the contextual checks. Only
+        // a continuous run of headers that connects to a known block is worth
+        // hashing: the loop below rejects everything else before it gets to
+        // the proof of work.
+        std::vector<unsigned char> vPoWChecked(nCount, false);
+        // Headers from nEnd on are dropped.
+        unsigned int nEnd = nCount;
+        if (nCount > 0) {
+            unsigned int nFirstUnknown = 0;
+            unsigned int nContinuous = 0;
+            {
+                LOCK(cs_main);
+                if (mapBlockIndex.count(headers[0].hashPrevBlock)) {
+                    while (nFirstUnknown < nCount && mapBlockIndex.count(headers[nFirstUnknown].GetHash()))
+                        nFirstUnknown++;
+                    nContinuous = 1;
+                    while (nContinuous < nCount && headers[nContinuous].hashPrevBlock == headers[nContinuous - 1].GetHash())
+                        nContinuous++;
+                }
+            }
+            if (nFirstUnknown < nContinuous) {
+                CheckHeadersProofOfWork(headers, nFirstUnknown, nContinuous, vPoWChecked, chainparams.GetConsensus());
+                // Stop at the first header that failed, or was skipped after
+                // another one failed. Only that one is checked again below.
+                for (unsigned int n = nFirstUnknown; n < nContinuous; n++) {
+                    if (!vPoWChecked[n]) {
+                        nEnd = n + 1;
+                        break;
+                    }
+                }
+            }
+        }
+
         {
         LOCK(cs_main);
 
@@ -6073,15 +6475,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
             return true;
         }
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+            // Too many headers for an announcement, so they should have
+            // connected. Refuse them without checking their proof of work.
+            Misbehaving(pfrom->GetId(), 10);
+            return error("headers received do not connect to a known block");
+        }
 
         CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
+        for (unsigned int n = 0; n < nEnd; n++) {
+            const CBlockHeader& header = headers[n];
             CValidationState state;
             if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
+            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, !vPoWChecked[n])) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
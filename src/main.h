@@ -33,12 +33,15 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewWriteBehind;
 class CInv;
 class CScriptCheck;
+class CSignatureBatch;
 class CTxMemPool;
 class CValidationInterface;
 class CValidationState;
 
+struct CHashCacheStats;
 struct PrecomputedTransactionData;
 struct CNodeStateStats;
 struct LockPoints;
@@ -84,6 +87,16 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -parbatch default (most script checks a verification thread takes at once) */
+static const unsigned int DEFAULT_SCRIPTCHECK_BATCH = 128;
+/** -parpin default (pin verification threads to cores) */
+static const bool DEFAULT_SCRIPTCHECK_PIN = false;
+/** Transactions with at least this many inputs have their scripts checked in parallel outside of blocks too */
+static const unsigned int MIN_PARALLEL_SCRIPT_CHECK_INPUTS = 16;
+/** -prefetchinputs default (look up the coins a block spends in parallel before connecting it) */
+static const bool DEFAULT_PREFETCH_INPUTS = true;
+/** Fewest coins worth a prefetch thread of their own */
+static const unsigned int MIN_PREFETCH_INPUTS_PER_THREAD = 16;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16 * 32;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -169,6 +182,7 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern bool fPrefetchInputs;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
@@ -254,8 +268,12 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   pto             The node which we are sending messages to.
  */
 bool SendMessages(CNode* pto);
-/** Run an instance of the script checking thread */
-void ThreadScriptCheck();
+/** Set how many script checks a verification thread takes at once; before starting them */
+void SetScriptCheckBatchSize(unsigned int nBatchSize);
+/** Run an instance of the script checking thread, pinned to nCore unless it is negative */
+void ThreadScriptCheck(int nCore);
+/** Run an instance of the header proof of work checking thread, pinned to nCore unless it is negative */
+void ThreadHeaderCheck(int nCore);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -353,9 +371,18 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
  * instead of being performed inline.
+ *
+ * Transactions whose scripts already passed with the same flags are found in
+ * the script execution cache and not checked again. cacheSigStore keeps the
+ * verified signatures cached; cacheFullScriptStore records a transaction
+ * whose scripts all passed inline, and keeps its entry when it is found.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+
+/** Allocate the script execution cache as sized by -maxsigcachesize. */
+void InitScriptExecutionCache();
+void GetScriptExecutionCacheStats(CHashCacheStats& stats);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -420,12 +447,18 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CScript& scriptPubKeyIn, const CAmount amountIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(scriptPubKeyIn), amount(amountIn),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
 
+    /**
+     * Evaluate the script with its signature checks left to 'batch'. A true
+     * result only stands once the batch has verified what was recorded.
+     */
+    bool Evaluate(CSignatureBatch& batch);
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
@@ -440,6 +473,50 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+template <typename T>
+struct CCheckQueueBatch;
+
+/**
+ * Script checks run by the check queue evaluate all their scripts first and
+ * then verify the signatures met along the way together, see CSignatureBatch.
+ */
+template <>
+struct CCheckQueueBatch<CScriptCheck>
+{
+    static bool Run(std::vector<CScriptCheck>& vChecks);
+};
+
+/**
+ * Closure representing the proof of work check of a run of consecutive
+ * headers. Plain scrypt headers in the run are hashed together through the
+ * multi-lane scrypt kernel. The outcome for each header is written to the
+ * caller-owned flag array, so that a failing header can be re-checked (and
+ * the peer punished) in order by AcceptBlockHeader.
+ * Note that this stores references to the headers and the flags.
+ */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader *pheaders;
+    unsigned char *pfValid;
+    unsigned int nCount;
+    const Consensus::Params *pparams;
+
+public:
+    CHeaderPoWCheck(): pheaders(NULL), pfValid(NULL), nCount(0), pparams(NULL) {}
+    CHeaderPoWCheck(const CBlockHeader *pheadersIn, unsigned char *pfValidIn, unsigned int nCountIn, const Consensus::Params& paramsIn) :
+        pheaders(pheadersIn), pfValid(pfValidIn), nCount(nCountIn), pparams(&paramsIn) { }
+
+    bool operator()();
+
+    void swap(CHeaderPoWCheck &check) {
+        std::swap(pheaders, check.pheaders);
+        std::swap(pfValid, check.pfValid);
+        std::swap(nCount, check.nCount);
+        std::swap(pparams, check.pparams);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
@@ -471,6 +548,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
  *  of problems. Note that in any case, coins may be modified. */
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
+/** Finish an interrupted write of the chainstate in view, as recorded by its head blocks. */
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view);
+
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
@@ -512,6 +592,9 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Background writer of the chainstate, if -backgroundflush is set (protected by cs_main) */
+extern CCoinsViewWriteBehind *pcoinsWriter;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -6,9 +6,11 @@
 #define BITCOIN_MEMUSAGE_H
 
 #include "indirectmap.h"
+#include "prevector.h"
 
 #include <stdlib.h>
 
+#include <list>
 #include <map>
 #include <set>
 #include <vector>
@@ -72,6 +74,15 @@ private:
     X x;
 };
 
+template<typename X>
+struct stl_list_node
+{
+private:
+    void* next;
+    void* prev;
+    X x;
+};
+
 struct stl_shared_counter
 {
     /* Various platforms use different sized counters here.
@@ -105,6 +116,18 @@ static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
     return MallocUsage(sizeof(stl_tree_node<X>));
 }
 
+template<typename X>
+static inline size_t DynamicUsage(const std::list<X>& l)
+{
+    return MallocUsage(sizeof(stl_list_node<X>)) * l.size();
+}
+
+template<typename X>
+static inline size_t IncrementalDynamicUsage(const std::list<X>& l)
+{
+    return MallocUsage(sizeof(stl_list_node<X>));
+}
+
 template<typename X, typename Y, typename Z>
 static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
 {
@@ -596,7 +596,7 @@ void BlockAssembler::addPriorityTxs()
     fNeedSizeAccounting = fSizeAccounting;
 }
 
-void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+static void SetExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
     static uint256 hashPrevBlock;
@@ -612,5 +612,16 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
     pblock->vtx[0] = txCoinbase;
+}
+
+void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+{
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, const std::vector<uint256>& vCoinbaseBranch)
+{
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
+    pblock->hashMerkleRoot = ComputeMerkleRootFromBranch(pblock->vtx[0].GetHash(), vCoinbaseBranch, 0);
+}
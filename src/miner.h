@@ -23,6 +23,8 @@ class CWallet;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -auxblockstoresize, the memory kept for merge-mining work in KiB */
+static const unsigned int DEFAULT_AUXBLOCK_STORE_SIZE = 65536;
 
 struct CBlockTemplate
 {
@@ -207,6 +209,8 @@ private:
 
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** As above, taking the merkle root from the coinbase's branch when only the coinbase changed */
+void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce, const std::vector<uint256>& vCoinbaseBranch);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
 #endif // BITCOIN_MINER_H
@@ -7,11 +7,91 @@
 
 #include "chain.h"
 #include "chainparams.h"
+#include "hash.h"
+#include "memusage.h"
 #include "primitives/block.h"
 #include "auxpow/auxpow.h"
+#include "random.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <limits>
+
+CPoWHashCache powhashcache;
+
+CPoWHashCache::CPoWHashCache(unsigned int nEntries) :
+    vEntries(nEntries), k0(0), k1(0), fSalted(false), nCount(0), nHits(0), nMisses(0)
+{
+}
+
+size_t CPoWHashCache::Slot(const uint256& hash)
+{
+    AssertLockHeld(cs);
+    if (!fSalted) {
+        k0 = GetRand(std::numeric_limits<uint64_t>::max());
+        k1 = GetRand(std::numeric_limits<uint64_t>::max());
+        fSalted = true;
+    }
+    return SipHashUint256(k0, k1, hash) % vEntries.size();
+}
+
+bool CPoWHashCache::Get(const uint256& hash, uint256& powhash)
+{
+    LOCK(cs);
+    const std::pair<uint256, uint256>& entry = vEntries[Slot(hash)];
+    if (entry.first != hash) {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    powhash = entry.second;
+    return true;
+}
+
+void CPoWHashCache::Insert(const uint256& hash, const uint256& powhash)
+{
+    LOCK(cs);
+    std::pair<uint256, uint256>& entry = vEntries[Slot(hash)];
+    if (entry.first.IsNull())
+        nCount++;
+    entry = std::make_pair(hash, powhash);
+}
+
+uint256 CPoWHashCache::GetPoWHash(const CBlockHeader& block)
+{
+    const uint256 hash = block.GetHash();
+    uint256 powhash;
+    if (!Get(hash, powhash)) {
+        powhash = block.GetPoWHash();
+        Insert(hash, powhash);
+    }
+    return powhash;
+}
+
+size_t CPoWHashCache::GetCount() const
+{
+    LOCK(cs);
+    return nCount;
+}
+
+size_t CPoWHashCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(vEntries);
+}
+
+uint64_t CPoWHashCache::GetHits() const
+{
+    LOCK(cs);
+    return nHits;
+}
+
+uint64_t CPoWHashCache::GetMisses() const
+{
+    LOCK(cs);
+    return nMisses;
+}
+
 unsigned int static CalculateNextWorkRequired_V1(const CBlockIndex* pindexLast, int64_t nFirstBlockTime, const Consensus::Params& params)
 {
     if (params.fPowNoRetargeting)
@@ -89,9 +169,7 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
         blockstogoback = params.DifficultyAdjustmentInterval();
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < blockstogoback; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - blockstogoback);
 
     assert(pindexFirst);
 
@@ -99,52 +177,37 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
 }
 
 // AntiGravityWave by reorder, derived from code by Evan Duffield - evan@darkcoin.io
-unsigned int static AntiGravityWave(int64_t version, const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
+unsigned int AntiGravityWave(int64_t version, const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params& params)
 {
-    const CBlockIndex *BlockLastSolved = pindexLast;
-    const CBlockIndex *BlockReading = pindexLast;
-    int64_t nActualTimespan = 0;
-    int64_t LastBlockTime = 0;
-    int64_t PastBlocksMin = 24;
-    int64_t PastBlocksMax = 24;
+    int64_t PastBlocks = 24;
     unsigned int nProofOfWorkLimit = UintToArith256(params.powLimit).GetCompact();
 
-    if (version == 1) {
-        PastBlocksMin = 24;
-        PastBlocksMax = 24;
-    } else if (version == 2) {
-        PastBlocksMin = 72;
-        PastBlocksMax = 72;
-    }
-
-    int64_t CountBlocks = 0;
-    arith_uint256 PastDifficultyAverage;
-    arith_uint256 PastDifficultyAveragePrev;
+    if (version == 1)
+        PastBlocks = 24;
+    else if (version == 2)
+        PastBlocks = 72;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || BlockLastSolved->nHeight < PastBlocksMin) {
+    if (pindexLast == NULL || pindexLast->nHeight == 0 || pindexLast->nHeight < PastBlocks) {
             return nProofOfWorkLimit;
     }
 
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
-        CountBlocks++;
+    // The window is the PastBlocks blocks ending at pindexLast, all of them
+    // past genesis. The block time differences summed over the window
+    // telescope to the difference between its endpoints.
+    const CBlockIndex *pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - PastBlocks + 1);
+    int64_t nActualTimespan = pindexLast->GetBlockTime() - pindexFirst->GetBlockTime();
 
-        if (CountBlocks <= PastBlocksMin) {
-            if (CountBlocks == 1)
-                PastDifficultyAverage.SetCompact(BlockReading->nBits);
-            else { PastDifficultyAverage = ((PastDifficultyAveragePrev * CountBlocks)+(arith_uint256().SetCompact(BlockReading->nBits))) / (CountBlocks+1); }
-                PastDifficultyAveragePrev = PastDifficultyAverage;
-        }
-
-        if (LastBlockTime > 0) {
-            int64_t Diff = (LastBlockTime - BlockReading->GetBlockTime());
-            nActualTimespan += Diff;
-        }
-        LastBlockTime = BlockReading->GetBlockTime();
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
+    // The average is a rounded recurrence over the targets, newest first, so
+    // it has to be recomputed for every window to stay bit-identical.
+    int64_t CountBlocks = 1;
+    const CBlockIndex *BlockReading = pindexLast;
+    arith_uint256 PastDifficultyAverage;
+    PastDifficultyAverage.SetCompact(BlockReading->nBits);
+    for (CountBlocks = 2; CountBlocks <= PastBlocks; CountBlocks++) {
         BlockReading = BlockReading->pprev;
+        PastDifficultyAverage = ((PastDifficultyAverage * CountBlocks)+(arith_uint256().SetCompact(BlockReading->nBits))) / (CountBlocks+1);
     }
+    CountBlocks = PastBlocks;
 
     arith_uint256 bnNew(PastDifficultyAverage);
 
@@ -212,20 +275,22 @@ bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&
 
 bool CheckBlockProofOfWork(const CBlockHeader *pblock, const Consensus::Params& params)
 {
-    LogPrint("txdb", "CheckBlockProofOfWork(): block: %s\n", pblock->ToString());  // LEDTMP
+    // ToString() includes the scrypt hash, only pay for it when logging
+    if (LogAcceptCategory("txdb"))
+        LogPrint("txdb", "CheckBlockProofOfWork(): block: %s\n", pblock->ToString());
 
     if (pblock->auxpow && (pblock->auxpow.get() != NULL))
     {
         if (!pblock->auxpow->Check(pblock->GetHash(), pblock->GetChainID(), params))
             return error("CheckBlockProofOfWork() : AUX POW is not valid");
         // Check proof of work matches claimed amount
-        if (!CheckProofOfWork(pblock->auxpow->GetParentBlockHash(), pblock->nBits, params))
+        if (!CheckProofOfWork(powhashcache.GetPoWHash(pblock->auxpow->parentBlockHeader), pblock->nBits, params))
             return error("CheckBlockProofOfWork() : AUX proof of work failed");
     }
     else
     {
         // Check proof of work matches claimed amount
-            if (!CheckProofOfWork(pblock->GetPoWHash(), pblock->nBits, params))
+        if (!CheckProofOfWork(powhashcache.GetPoWHash(*pblock), pblock->nBits, params))
             return error("CheckBlockProofOfWork() : proof of work failed");
     }
     return true;
@@ -7,14 +7,60 @@
 #define BITCOIN_POW_H
 
 #include "consensus/params.h"
+#include "sync.h"
+#include "uint256.h"
 
 #include <stdint.h>
+#include <utility>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
-class uint256;
+
+/** Default number of entries in the proof-of-work hash cache */
+static const unsigned int DEFAULT_POWHASH_CACHE_ENTRIES = 8192;
+
+/**
+ * Direct-mapped cache of scrypt proof-of-work hashes, keyed by block hash.
+ * A header is hashed when it is first seen, again when the full block
+ * arrives and when it is shown over RPC; the cache lets one scrypt
+ * evaluation cover all of them. The block hash commits to exactly the bytes
+ * scrypt hashes, so an entry can never go stale.
+ */
+class CPoWHashCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<std::pair<uint256, uint256> > vEntries;
+    //! Salt for the slot index, so peers can't aim headers at one slot.
+    //! Drawn on first use, as the cache is constructed before the RNG is set up.
+    uint64_t k0, k1;
+    bool fSalted;
+    size_t nCount;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    size_t Slot(const uint256& hash);
+
+public:
+    CPoWHashCache(unsigned int nEntries = DEFAULT_POWHASH_CACHE_ENTRIES);
+
+    bool Get(const uint256& hash, uint256& powhash);
+    void Insert(const uint256& hash, const uint256& powhash);
+    //! Return the proof-of-work hash of a header, computing it on a miss
+    uint256 GetPoWHash(const CBlockHeader& block);
+
+    size_t GetCount() const;
+    size_t DynamicMemoryUsage() const;
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+};
+
+extern CPoWHashCache powhashcache;
 
 unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params&);
+/** AntiGravityWave retargeting over the last 24 (version 1) or 72 (version 2) blocks */
+unsigned int AntiGravityWave(int64_t version, const CBlockIndex* pindexLast, const CBlockHeader *pblock, const Consensus::Params&);
 
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, const Consensus::Params&);
@@ -10,6 +10,8 @@
 #include <string.h>
 
 #include <iterator>
+#include <stdexcept>
+#include <type_traits>
 
 #pragma pack(push, 1)
 /** Implements a drop-in replacement for std::vector<T> which stores up to N
@@ -27,8 +29,9 @@
  *    - T* indirect: a pointer to an array of capacity elements of type T
  *      (only the first _size are initialized).
  *
- *  The data type T must be movable by memmove/realloc(). Once we switch to C++,
- *  move constructors can be used instead.
+ *  Trivial types are moved around with memmove/realloc(). Others, such as a
+ *  prevector, are copied into place element by element and destroyed where
+ *  they were.
  */
 template<unsigned int N, typename T, typename Size = uint32_t, typename Diff = int32_t>
 class prevector {
@@ -158,25 +161,62 @@ private:
     const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.indirect) + pos; }
     bool is_direct() const { return _size <= N; }
 
+    /** Whether T can be moved by memmove/realloc(). std::is_trivially_copyable is missing from older compilers. */
+    typedef std::integral_constant<bool, std::is_trivial<T>::value> relocate_by_memmove;
+
+    /** Move n elements from src to dst, which may overlap, leaving src uninitialized. */
+    static void relocate(T* dst, T* src, size_type n, std::true_type) {
+        memmove(dst, src, n * sizeof(T));
+    }
+
+    static void relocate(T* dst, T* src, size_type n, std::false_type) {
+        if (dst < src) {
+            for (size_type i = 0; i < n; i++) {
+                new(static_cast<void*>(dst + i)) T(src[i]);
+                src[i].~T();
+            }
+        } else if (dst > src) {
+            for (size_type i = n; i > 0; i--) {
+                new(static_cast<void*>(dst + i - 1)) T(src[i - 1]);
+                src[i - 1].~T();
+            }
+        }
+    }
+
+    static void relocate(T* dst, T* src, size_type n) {
+        relocate(dst, src, n, relocate_by_memmove());
+    }
+
+    char* reallocate_indirect(size_type new_capacity, std::true_type) {
+        return static_cast<char*>(realloc(_union.indirect, ((size_t)sizeof(T)) * new_capacity));
+    }
+
+    char* reallocate_indirect(size_type new_capacity, std::false_type) {
+        char* new_indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
+        relocate(reinterpret_cast<T*>(new_indirect), indirect_ptr(0), size());
+        free(_union.indirect);
+        return new_indirect;
+    }
+
     void change_capacity(size_type new_capacity) {
         if (new_capacity <= N) {
             if (!is_direct()) {
                 T* indirect = indirect_ptr(0);
                 T* src = indirect;
                 T* dst = direct_ptr(0);
-                memcpy(dst, src, size() * sizeof(T));
+                relocate(dst, src, size());
                 free(indirect);
                 _size -= N + 1;
             }
         } else {
             if (!is_direct()) {
-                _union.indirect = static_cast<char*>(realloc(_union.indirect, ((size_t)sizeof(T)) * new_capacity));
+                _union.indirect = reallocate_indirect(new_capacity, relocate_by_memmove());
                 _union.capacity = new_capacity;
             } else {
                 char* new_indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
                 T* src = direct_ptr(0);
                 T* dst = reinterpret_cast<T*>(new_indirect);
-                memcpy(dst, src, size() * sizeof(T));
+                relocate(dst, src, size());
                 _union.indirect = new_indirect;
                 _union.capacity = new_capacity;
                 _size += N + 1;
@@ -184,6 +224,30 @@ private:
         }
     }
 
+    /** Move the elements of other into this empty, direct prevector, leaving other empty. */
+    void take(prevector<N, T, Size, Diff>& other) {
+        if (other.is_direct()) {
+            relocate(direct_ptr(0), other.direct_ptr(0), other._size);
+        } else {
+            _union.indirect = other._union.indirect;
+            _union.capacity = other._union.capacity;
+        }
+        _size = other._size;
+        other._size = 0;
+    }
+
+    void swap(prevector<N, T, Size, Diff>& other, std::true_type) {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    void swap(prevector<N, T, Size, Diff>& other, std::false_type) {
+        prevector<N, T, Size, Diff> tmp;
+        tmp.take(other);
+        other.take(*this);
+        take(tmp);
+    }
+
     T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
     const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
 
@@ -297,6 +361,20 @@ public:
         return *item_ptr(pos);
     }
 
+    T& at(size_type pos) {
+        if (pos >= size()) {
+            throw std::out_of_range("prevector::at");
+        }
+        return *item_ptr(pos);
+    }
+
+    const T& at(size_type pos) const {
+        if (pos >= size()) {
+            throw std::out_of_range("prevector::at");
+        }
+        return *item_ptr(pos);
+    }
+
     void resize(size_type new_size) {
         if (size() > new_size) {
             erase(item_ptr(new_size), end());
@@ -330,7 +408,7 @@ public:
         if (capacity() < new_size) {
             change_capacity(new_size + (new_size >> 1));
         }
-        memmove(item_ptr(p + 1), item_ptr(p), (size() - p) * sizeof(T));
+        relocate(item_ptr(p + 1), item_ptr(p), size() - p);
         _size++;
         new(static_cast<void*>(item_ptr(p))) T(value);
         return iterator(item_ptr(p));
@@ -342,7 +420,7 @@ public:
         if (capacity() < new_size) {
             change_capacity(new_size + (new_size >> 1));
         }
-        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        relocate(item_ptr(p + count), item_ptr(p), size() - p);
         _size += count;
         for (size_type i = 0; i < count; i++) {
             new(static_cast<void*>(item_ptr(p + i))) T(value);
@@ -357,7 +435,7 @@ public:
         if (capacity() < new_size) {
             change_capacity(new_size + (new_size >> 1));
         }
-        memmove(item_ptr(p + count), item_ptr(p), (size() - p) * sizeof(T));
+        relocate(item_ptr(p + count), item_ptr(p), size() - p);
         _size += count;
         while (first != last) {
             new(static_cast<void*>(item_ptr(p))) T(*first);
@@ -372,13 +450,13 @@ public:
 
     iterator erase(iterator first, iterator last) {
         iterator p = first;
-        char* endp = (char*)&(*end());
+        T* endp = &(*end());
         while (p != last) {
             (*p).~T();
             _size--;
             ++p;
         }
-        memmove(&(*first), &(*last), endp - ((char*)(&(*last))));
+        relocate(&(*first), &(*last), endp - &(*last));
         return first;
     }
 
@@ -411,9 +489,16 @@ public:
         return *item_ptr(size() - 1);
     }
 
+    T* data() {
+        return item_ptr(0);
+    }
+
+    const T* data() const {
+        return item_ptr(0);
+    }
+
     void swap(prevector<N, T, Size, Diff>& other) {
-        std::swap(_union, other._union);
-        std::swap(_size, other._size);
+        swap(other, relocate_by_memmove());
     }
 
     ~prevector() {
@@ -40,15 +40,6 @@ public:
     // memory only
     mutable bool fChecked;
 
-    // TODO LED .. fix this. The MerkleTree functions in class CBlock
-    // TODO LED have been ported from 0.10 to 0.13, but 0.13 does things
-    // TODO LED differently now.. see the new MerkleTree handling and
-    // TODO LED associated classes for a hint on a proper fix. This code
-    // TODO LED as is probably won't work. vMerkleTree was replaced with
-    // TODO LED a bool fChecked. So grafting vMerkleTree back in just
-    // TODO LED to be used by the auxpow tree is most likely wrong. 
-    mutable std::vector<uint256> vMerkleTree;
-
     CBlock()
     {
         SetNull();
@@ -89,13 +80,6 @@ public:
         return block;
     }
 
-    // TODO LED these two Merkle functions are temporary.
-    // TODO LED BuildMerkleTree, GetMerkleBranch and CheckMerkleBranch
-    // TODO LED The callers of these functions (in auxpow.cpp) need
-    // TODO LED to be ported to the new style Merkle classes
-    uint256 BuildMerkleTree(bool* mutated = NULL) const;
-    std::vector<uint256> GetMerkleBranch(int nIndex) const;
-
     std::string ToString() const;
 };
 
@@ -137,4 +121,7 @@ struct CBlockLocator
 /** Compute the consensus-critical block weight (see BIP 141). */
 int64_t GetBlockWeight(const CBlock& tx);
 
+/** Compute GetPoWHash() for a run of headers, hashing several at once where the CPU allows it. */
+std::vector<uint256> GetPoWHashes(const std::vector<CBlockHeader>& headers);
+
 #endif // BITCOIN_PRIMITIVES_BLOCK_H
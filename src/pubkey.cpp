@@ -184,6 +184,33 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return secp256k1_ecdsa_verify(secp256k1_context_verify, &sig, hash.begin(), &pubkey);
 }
 
+void CPubKey::VerifyBatch(const std::vector<CPubKeySigCheck*>& vChecks) {
+    secp256k1_pubkey pubkey;
+    const CPubKeySigCheck* pprev = NULL;
+    bool fParsed = false;
+    for (size_t i = 0; i < vChecks.size(); i++) {
+        CPubKeySigCheck& check = *vChecks[i];
+        check.fValid = false;
+        const bool fSameKey = pprev && pprev->pubkey == check.pubkey;
+        if (fSameKey && pprev->hash == check.hash && pprev->vchSig == check.vchSig) {
+            check.fValid = pprev->fValid;
+            pprev = &check;
+            continue;
+        }
+        pprev = &check;
+        if (!fSameKey) {
+            fParsed = check.pubkey.IsValid() && secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, &check.pubkey[0], check.pubkey.size());
+        }
+        if (!fParsed || check.vchSig.empty())
+            continue;
+        secp256k1_ecdsa_signature sig;
+        if (!ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, &check.vchSig[0], check.vchSig.size()))
+            continue;
+        secp256k1_ecdsa_signature_normalize(secp256k1_context_verify, &sig, &sig);
+        check.fValid = secp256k1_ecdsa_verify(secp256k1_context_verify, &sig, check.hash.begin(), &pubkey);
+    }
+}
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
@@ -35,6 +35,8 @@ public:
 
 typedef uint256 ChainCode;
 
+struct CPubKeySigCheck;
+
 /** An encapsulated public key. */
 class CPubKey
 {
@@ -179,6 +181,13 @@ public:
      */
     bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 
+    /**
+     * Verify a number of DER signatures, setting fValid on each as Verify would.
+     * A check against the same key as the one before it reuses the parsed key,
+     * and an exact repeat of it reuses the result, so group checks by key.
+     */
+    static void VerifyBatch(const std::vector<CPubKeySigCheck*>& vChecks);
+
     /**
      * Check whether a signature is normalized (lower-S).
      */
@@ -194,6 +203,17 @@ public:
     bool Derive(CPubKey& pubkeyChild, ChainCode &ccChild, unsigned int nChild, const ChainCode& cc) const;
 };
 
+/** A signature to be checked by CPubKey::VerifyBatch. */
+struct CPubKeySigCheck
+{
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    bool fValid;
+
+    CPubKeySigCheck() : fValid(false) {}
+};
+
 struct CExtPubKey {
     unsigned char nDepth;
     unsigned char vchFingerprint[4];
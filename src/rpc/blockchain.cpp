@@ -11,10 +11,13 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "policy/policy.h"
+#include "pow.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -159,7 +162,7 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
     result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
     result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
-    result.push_back(Pair("PoW", block.GetPoWHash().GetHex()));
+    result.push_back(Pair("PoW", powhashcache.GetPoWHash(block).GetHex()));
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
@@ -665,44 +668,64 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 //! Calculate statistics about the unspent transaction output set
 static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
 {
-    boost::scoped_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
+    boost::scoped_ptr<CCoinsViewCursor> pcursor;
     {
+        // Flushes happen under cs_main, and the partial batches of one leave
+        // the database without a best block until it is complete.
         LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        pcursor.reset(view->Cursor());
+        stats.hashBlock = pcursor->GetBestBlock();
+        BlockMap::const_iterator it = mapBlockIndex.find(stats.hashBlock);
+        if (it == mapBlockIndex.end())
+            return error("%s: best block %s of the UTXO set is not known", __func__, stats.hashBlock.ToString());
+        stats.nHeight = it->second->nHeight;
     }
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    // Outputs are hashed per transaction, as they were when the database
+    // held one record per transaction.
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
+        COutPoint key;
+        Coin coin;
+        if (pcursor->GetKey(key) && pcursor->GetValue(coin)) {
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
             stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
         } else {
             return error("%s: unable to read value", __func__);
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, prevkey, outputs);
+    }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -771,7 +794,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -795,33 +817,36 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        // The mempool view still returns coins that mempool transactions spend,
+        // as AcceptToMemoryPool needs the inputs of a transaction replacing
+        // one of them; leave those out here.
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -1147,6 +1172,127 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcacheinfo\n"
+            "\nReturns details on the in-memory validation caches.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"auxpow\": {                (json object) Cache of auxpow data in front of the block index database\n"
+            "    \"size\": xxxxx,             (numeric) Number of cached entries\n"
+            "    \"usage\": xxxxx,            (numeric) Memory usage of the cache\n"
+            "    \"maxusage\": xxxxx,         (numeric) Maximum memory usage of the cache\n"
+            "    \"hits\": xxxxx,             (numeric) Lookups served from the cache\n"
+            "    \"misses\": xxxxx            (numeric) Lookups that went to the database\n"
+            "  },\n"
+            "  \"powhash\": {               (json object) Cache of scrypt proof-of-work hashes\n"
+            "    \"size\": xxxxx,             (numeric) Number of cached entries\n"
+            "    \"usage\": xxxxx,            (numeric) Memory usage of the cache\n"
+            "    \"hits\": xxxxx,             (numeric) Lookups served from the cache\n"
+            "    \"misses\": xxxxx            (numeric) Lookups that needed a scrypt evaluation\n"
+            "  },\n"
+            "  \"signature\": {             (json object) Cache of verified script signatures\n"
+            "    \"size\": xxxxx,             (numeric) Number of cached entries\n"
+            "    \"capacity\": xxxxx,         (numeric) Number of entries the cache can hold\n"
+            "    \"usage\": xxxxx,            (numeric) Memory usage of the cache\n"
+            "    \"hits\": xxxxx,             (numeric) Lookups served from the cache\n"
+            "    \"misses\": xxxxx            (numeric) Lookups that needed an ECDSA verification\n"
+            "  },\n"
+            "  \"script\": {                (json object) Cache of transactions whose scripts passed with given flags\n"
+            "    \"size\": xxxxx,             (numeric) Number of cached entries\n"
+            "    \"capacity\": xxxxx,         (numeric) Number of entries the cache can hold\n"
+            "    \"usage\": xxxxx,            (numeric) Memory usage of the cache\n"
+            "    \"hits\": xxxxx,             (numeric) Lookups served from the cache\n"
+            "    \"misses\": xxxxx            (numeric) Lookups that needed the scripts to be run\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcacheinfo", "")
+            + HelpExampleRpc("getcacheinfo", "")
+        );
+
+    LOCK(cs_main);
+
+    UniValue ret(UniValue::VOBJ);
+    const CAuxPowCache& auxpowcache = pblocktree->GetAuxPowCache();
+    UniValue auxpow(UniValue::VOBJ);
+    auxpow.push_back(Pair("size", (int64_t)auxpowcache.GetCount()));
+    auxpow.push_back(Pair("usage", (int64_t)auxpowcache.DynamicMemoryUsage()));
+    auxpow.push_back(Pair("maxusage", (int64_t)auxpowcache.GetMaxUsage()));
+    auxpow.push_back(Pair("hits", (int64_t)auxpowcache.GetHits()));
+    auxpow.push_back(Pair("misses", (int64_t)auxpowcache.GetMisses()));
+    ret.push_back(Pair("auxpow", auxpow));
+    UniValue powhash(UniValue::VOBJ);
+    powhash.push_back(Pair("size", (int64_t)powhashcache.GetCount()));
+    powhash.push_back(Pair("usage", (int64_t)powhashcache.DynamicMemoryUsage()));
+    powhash.push_back(Pair("hits", (int64_t)powhashcache.GetHits()));
+    powhash.push_back(Pair("misses", (int64_t)powhashcache.GetMisses()));
+    ret.push_back(Pair("powhash", powhash));
+    CHashCacheStats sigcachestats;
+    GetSignatureCacheStats(sigcachestats);
+    UniValue signature(UniValue::VOBJ);
+    signature.push_back(Pair("size", (int64_t)sigcachestats.nCount));
+    signature.push_back(Pair("capacity", (int64_t)sigcachestats.nCapacity));
+    signature.push_back(Pair("usage", (int64_t)sigcachestats.nUsage));
+    signature.push_back(Pair("hits", (int64_t)sigcachestats.nHits));
+    signature.push_back(Pair("misses", (int64_t)sigcachestats.nMisses));
+    ret.push_back(Pair("signature", signature));
+    CHashCacheStats scriptcachestats;
+    GetScriptExecutionCacheStats(scriptcachestats);
+    UniValue script(UniValue::VOBJ);
+    script.push_back(Pair("size", (int64_t)scriptcachestats.nCount));
+    script.push_back(Pair("capacity", (int64_t)scriptcachestats.nCapacity));
+    script.push_back(Pair("usage", (int64_t)scriptcachestats.nUsage));
+    script.push_back(Pair("hits", (int64_t)scriptcachestats.nHits));
+    script.push_back(Pair("misses", (int64_t)scriptcachestats.nMisses));
+    ret.push_back(Pair("script", script));
+
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns what LevelDB reports on the state of each open database.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                  (json object) The database, e.g. chainstate or blockindex\n"
+            "    \"levels\": [                (json array) The table files of each level\n"
+            "      {\n"
+            "        \"files\": xxxxx,        (numeric) Number of table files\n"
+            "        \"size\": xxxxx          (numeric) Total size of the table files in bytes\n"
+            "      }, ...\n"
+            "    ],\n"
+            "    \"stats\": \"...\"            (string) The leveldb.stats report, including compactions per level\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    UniValue ret(UniValue::VOBJ);
+    BOOST_FOREACH(const CDBStats& stats, GetAllDBStats()) {
+        UniValue db(UniValue::VOBJ);
+        UniValue levels(UniValue::VARR);
+        for (size_t i = 0; i < stats.vLevels.size(); i++) {
+            UniValue level(UniValue::VOBJ);
+            level.push_back(Pair("files", stats.vLevels[i].first));
+            level.push_back(Pair("size", (int64_t)stats.vLevels[i].second));
+            levels.push_back(level);
+        }
+        db.push_back(Pair("levels", levels));
+        db.push_back(Pair("stats", stats.strStats));
+        ret.push_back(Pair(stats.strName, db));
+    }
+
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1231,7 +1377,9 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblock",               &getblock,               true  },
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
+    { "blockchain",         "getcacheinfo",           &getcacheinfo,           true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getdbstats",             &getdbstats,             true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    true  },
     { "blockchain",         "getmempooldescendants",  &getmempooldescendants,  true  },
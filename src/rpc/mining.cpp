@@ -8,9 +8,11 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "consensus/consensus.h"
+#include "consensus/merkle.h"
 #include "consensus/params.h"
 #include "consensus/validation.h"
 #include "core_io.h"
+#include "core_memusage.h"
 #include "init.h"
 #include "main.h"
 #include "miner.h"
@@ -23,6 +25,9 @@
 #include "validationinterface.h"
 #include "timedata.h"
 
+#include <list>
+#include <map>
+#include <memory>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -791,6 +796,240 @@ UniValue submitblock(const UniValue& params, bool fHelp)
     return BIP22ValidationResult(state);
 }
 
+/**
+ * Block templates handed out to merge miners, waiting for an auxpow.
+ * One template is assembled per tip and mempool refresh; every payout
+ * script gets a copy with its own coinbase output. Templates are evicted
+ * oldest first once their memory usage exceeds -auxblockstoresize, and all
+ * of them are dropped when the tip changes. Must be used with cs_main held.
+ *
+ * A changed mempool rebuilds the shared template, at most every 20 seconds,
+ * rather than adding to it: only BlockAssembler selects ancestor packages
+ * within the weight and sigop limits, and transactions that left the
+ * mempool would have to be taken out again. Work handed out earlier stays
+ * valid for submission until the tip changes or it is evicted.
+ */
+class CAuxBlockStore
+{
+private:
+    struct Entry {
+        std::shared_ptr<const CBlock> block;
+        size_t nUsage;
+    };
+
+    std::map<uint256, Entry> mapBlocks;
+    std::list<uint256> listOrder;
+    std::map<CScript, uint256> mapCurrent;
+    /** Memory used by mapBlocks and listOrder, and by mapCurrent */
+    size_t nBlocksUsage;
+    size_t nCurrentUsage;
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    /** The template's coinbase branch, so each payout script only rehashes that path */
+    std::vector<uint256> vCoinbaseBranch;
+    size_t nTemplateUsage;
+    const CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nStart;
+    unsigned int nExtraNonce;
+
+    size_t DynamicMemoryUsage() const
+    {
+        return nBlocksUsage + nCurrentUsage + nTemplateUsage;
+    }
+
+    void Clear()
+    {
+        mapBlocks.clear();
+        listOrder.clear();
+        mapCurrent.clear();
+        nBlocksUsage = 0;
+        nCurrentUsage = 0;
+    }
+
+    void Add(const uint256& hash, const std::shared_ptr<const CBlock>& block)
+    {
+        Entry entry;
+        entry.block = block;
+        entry.nUsage = memusage::DynamicUsage(block) + RecursiveDynamicUsage(*block) +
+                       memusage::IncrementalDynamicUsage(mapBlocks) + memusage::IncrementalDynamicUsage(listOrder);
+        if (block->auxpow)
+            entry.nUsage += memusage::DynamicUsage(block->auxpow) + RecursiveDynamicUsage(*block->auxpow);
+        mapBlocks[hash] = entry;
+        listOrder.push_back(hash);
+        nBlocksUsage += entry.nUsage;
+        const size_t nMaxUsage = std::max<int64_t>(0, GetArg("-auxblockstoresize", DEFAULT_AUXBLOCK_STORE_SIZE)) * 1024;
+        while (DynamicMemoryUsage() > nMaxUsage && listOrder.size() > 1) {
+            std::map<uint256, Entry>::iterator it = mapBlocks.find(listOrder.front());
+            nBlocksUsage -= it->second.nUsage;
+            mapBlocks.erase(it);
+            listOrder.pop_front();
+        }
+    }
+
+public:
+    CAuxBlockStore() : nBlocksUsage(0), nCurrentUsage(0), nTemplateUsage(0), pindexPrev(NULL), nTransactionsUpdatedLast(0), nStart(0), nExtraNonce(0) { }
+
+    /** Return a template paying to scriptPubKey, building the shared template if it is out of date */
+    std::shared_ptr<const CBlock> Create(const CScript& scriptPubKey)
+    {
+        AssertLockHeld(cs_main);
+        if (pindexPrev != chainActive.Tip()) {
+            // Work on the old tip can't be submitted anymore
+            Clear();
+            pblocktemplate.reset();
+        }
+        if (!pblocktemplate || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 20)) {
+            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+            pindexPrev = chainActive.Tip();
+            nStart = GetTime();
+            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPubKey);
+            if (!pblocktemplate)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            vCoinbaseBranch = BlockMerkleBranch(pblocktemplate->block, 0);
+            nTemplateUsage = memusage::DynamicUsage(pblocktemplate) + RecursiveDynamicUsage(pblocktemplate->block) +
+                             memusage::DynamicUsage(pblocktemplate->vTxFees) + memusage::DynamicUsage(pblocktemplate->vTxSigOpsCost) +
+                             memusage::DynamicUsage(pblocktemplate->vchCoinbaseCommitment) + memusage::DynamicUsage(vCoinbaseBranch);
+            mapCurrent.clear();
+            nCurrentUsage = 0;
+        }
+
+        std::map<CScript, uint256>::iterator it = mapCurrent.find(scriptPubKey);
+        if (it != mapCurrent.end()) {
+            std::map<uint256, Entry>::const_iterator mi = mapBlocks.find(it->second);
+            if (mi != mapBlocks.end())
+                return mi->second.block;
+        } else {
+            it = mapCurrent.insert(std::make_pair(scriptPubKey, uint256())).first;
+            nCurrentUsage += memusage::IncrementalDynamicUsage(mapCurrent) + RecursiveDynamicUsage(scriptPubKey);
+        }
+
+        std::shared_ptr<CBlock> pblock(new CBlock(pblocktemplate->block));
+        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        txCoinbase.vout[0].scriptPubKey = scriptPubKey;
+        pblock->vtx[0] = txCoinbase;
+
+        // Update nTime
+        pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+        pblock->nNonce = 0;
+
+        // Update nExtraNonce, this also recomputes the merkle root
+        IncrementExtraNonce(pblock.get(), pindexPrev, nExtraNonce, vCoinbaseBranch);
+
+        // Sets the version
+        pblock->SetAuxPow(new CAuxPow());
+
+        const uint256 hash = pblock->GetHash();
+        it->second = hash;
+        Add(hash, pblock);
+        return pblock;
+    }
+
+    std::shared_ptr<const CBlock> Get(const uint256& hash) const
+    {
+        std::map<uint256, Entry>::const_iterator it = mapBlocks.find(hash);
+        if (it == mapBlocks.end())
+            return std::shared_ptr<const CBlock>();
+        return it->second.block;
+    }
+};
+
+static CAuxBlockStore auxblockstore;
+
+static void CheckAuxMiningAllowed()
+{
+    if (vNodes.empty())
+        throw JSONRPCError(-9, "Canada eCoin is not connected!");
+
+    if (IsInitialBlockDownload())
+        throw JSONRPCError(-10, "Canada eCoin is downloading blocks...");
+}
+
+static UniValue AuxBlockToJSON(const CBlock& block)
+{
+    bool fNegative, fOverflow;
+    arith_uint256 hashTarget = arith_uint256().SetCompact(block.nBits, &fNegative, &fOverflow);
+    if (hashTarget == 0 || fNegative || fOverflow)
+        throw runtime_error("block has invalid difficulty bits");
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("target", HexStr(BEGIN(hashTarget), END(hashTarget))));
+    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.push_back(Pair("chainid", block.GetChainID()));
+    return result;
+}
+
+static UniValue CreateAuxBlock(const CScript& scriptPubKey)
+{
+    if (chainActive.Tip()->nHeight < GetAuxPowStartBlock(Params().GetConsensus()) - 1)
+        throw JSONRPCError(-1, "Merged mining not enabled at current block height yet");
+
+    return AuxBlockToJSON(*auxblockstore.Create(scriptPubKey));
+}
+
+/** Decode a hex auxpow, throwing if it is malformed */
+static std::unique_ptr<CAuxPow> DecodeAuxPow(const std::string& strAuxPow)
+{
+    vector<unsigned char> vchAuxPow = ParseHex(strAuxPow);
+    CDataStream ss(vchAuxPow, SER_GETHASH, PROTOCOL_VERSION);
+    std::unique_ptr<CAuxPow> pow(new CAuxPow());
+    ss >> *pow;
+    return pow;
+}
+
+static UniValue SubmitAuxBlock(const uint256& hash, std::unique_ptr<CAuxPow> pow)
+{
+    std::shared_ptr<const CBlock> ptemplate = auxblockstore.Get(hash);
+    if (!ptemplate)
+        return "stale-work";
+
+    CBlock block(*ptemplate);
+    block.SetAuxPow(pow.release());
+
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end()) {
+        CBlockIndex *pindex = mi->second;
+        if (pindex->IsValid(BLOCK_VALID_SCRIPTS))
+            return "duplicate";
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return "duplicate-invalid";
+    }
+
+    CValidationState state;
+    submitblock_StateCatcher sc(block.GetHash());
+    RegisterValidationInterface(&sc);
+
+    bool fAccepted = ProcessNewBlock(state, Params(), NULL, &block, true, NULL, false);
+    UnregisterValidationInterface(&sc);
+    if (mi != mapBlockIndex.end())
+    {
+        if (fAccepted && !sc.found)
+            return "duplicate-inconclusive";
+        return "duplicate";
+    }
+    if (fAccepted)
+    {
+        if (!sc.found)
+            return "inconclusive";
+        state = sc.state;
+    }
+    UniValue result = BIP22ValidationResult(state);
+    return result.isNull() ? true : result;
+}
+
+static CKeyID GetAuxpowMiningKey(void)
+{
+    CKeyID result;
+    CBitcoinAddress auxminingaddr(GetArg("-auxminingaddr", ""));
+    if (!auxminingaddr.GetKeyID(result)) {
+        CReserveKey reservekey(pwalletMain);
+        CPubKey pubkey;
+        reservekey.GetReservedKey(pubkey);
+        result = pubkey.GetID();
+    }
+    return result;
+}
+
 UniValue getauxblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || (params.size() != 0 && params.size() != 2))
@@ -804,124 +1043,119 @@ UniValue getauxblock(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getauxblock", "\"myhash\" \"auxpow\"")
             );
 
-    if (vNodes.empty())
-        throw JSONRPCError(-9, "Canada eCoin is not connected!");
-
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(-10, "Canada eCoin is downloading blocks...");
-
-    static map<uint256, CBlock*> mapNewBlock;
-    static vector< std::unique_ptr<CBlockTemplate> > vNewBlockTemplate;
-    const Consensus::Params& consensusParams = Params().GetConsensus();
+    CheckAuxMiningAllowed();
 
     LOCK(cs_main);
 
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static uint64_t nStart;
-        static CBlock* pblock;
-        static std::unique_ptr<CBlockTemplate> pblocktemplate;
-
-        if (chainActive.Tip()->nHeight < GetAuxPowStartBlock(consensusParams) - 1)
-            throw JSONRPCError(-1, "Merged mining not enabled at current block height yet");
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 20))
-        {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                for (auto&& pblocktemplate : vNewBlockTemplate)
-                    pblocktemplate = nullptr;
-                vNewBlockTemplate.clear();
-            }
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            pindexPrev = chainActive.Tip();
-            nStart = GetTime();
-
-            // Create new block with nonce = 0 and extraNonce = 1
-            static const CKeyID keyID = GetAuxpowMiningKey();
-            CScript scriptCoinbase = GetScriptForDestination(keyID);
-            pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptCoinbase);
-            if (!pblocktemplate)
-                throw JSONRPCError(-7, "Out of memory");
+        static const CKeyID keyID = GetAuxpowMiningKey();
+        return CreateAuxBlock(GetScriptForDestination(keyID));
+    }
+    else
+    {
+        uint256 hash;
+        hash.SetHex(params[0].get_str());
+        return SubmitAuxBlock(hash, DecodeAuxPow(params[1].get_str()));
+    }
+}
 
-            pblock = &pblocktemplate->block;
-            // Update nTime
-            pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
-            pblock->nNonce = 0;
+UniValue createauxblocks(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "createauxblocks [\"address\",...]\n"
+            "\nCreate merge-mining work for several payout addresses at once.\n"
+            "Work for the same address is reused until the tip or the mempool changes.\n"
+            "\nArguments:\n"
+            "1. addresses      (array, required) The addresses the coinbase of each block pays to\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"xxxx\",   (string) The payout address\n"
+            "    \"hash\": \"xxxx\",      (string) Hash of the created block\n"
+            "    \"chainid\": n,        (numeric) Chain ID for this block\n"
+            "    \"target\": \"xxxx\"     (string) Target in reversed byte order\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("createauxblocks", "\"[\\\"myaddress\\\"]\"")
+            + HelpExampleRpc("createauxblocks", "[\"myaddress\"]")
+            );
 
-            // Update nExtraNonce
-            static unsigned int nExtraNonce = 0;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VARR));
+    CheckAuxMiningAllowed();
 
-            // Sets the version
-            pblock->SetAuxPow(new CAuxPow());
+    const UniValue& addresses = params[0].get_array();
+    std::vector<CScript> vScripts;
+    for (unsigned int i = 0; i < addresses.size(); i++) {
+        CBitcoinAddress address(addresses[i].get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + addresses[i].get_str());
+        vScripts.push_back(GetScriptForDestination(address.Get()));
+    }
 
-            // Save
-            mapNewBlock[pblock->GetHash()] = pblock;
+    LOCK(cs_main);
 
-            vNewBlockTemplate.push_back(std::move(pblocktemplate));
-        }
+    UniValue result(UniValue::VARR);
+    for (unsigned int i = 0; i < vScripts.size(); i++) {
+        UniValue entry = CreateAuxBlock(vScripts[i]);
+        entry.push_back(Pair("address", addresses[i].get_str()));
+        result.push_back(entry);
+    }
+    return result;
+}
 
-        bool fNegative, fOverflow;
-        arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits, &fNegative, &fOverflow);
-        if (hashTarget == 0 || fNegative || fOverflow)
-            throw runtime_error("block has invalid difficulty bits");
+UniValue submitauxblocks(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "submitauxblocks [{\"hash\":\"hash\",\"auxpow\":\"hex\"},...]\n"
+            "\nSubmit several merge-mining solutions at once.\n"
+            "\nArguments:\n"
+            "1. solutions      (array, required) Block hashes from createauxblocks or getauxblock\n"
+            "                  with the serialized auxpow solving each of them\n"
+            "\nResult:\n"
+            "[ result, ... ]   (array) Per solution, true if the block was accepted, or the reason\n"
+            "                  it was not, as for getauxblock, or \"decode-failed\" for a malformed auxpow\n"
+            "\nExamples:\n"
+            + HelpExampleCli("submitauxblocks", "\"[{\\\"hash\\\":\\\"myhash\\\",\\\"auxpow\\\":\\\"auxpow\\\"}]\"")
+            + HelpExampleRpc("submitauxblocks", "[{\"hash\":\"myhash\",\"auxpow\":\"auxpow\"}]")
+            );
 
-        UniValue result(UniValue::VOBJ);
-        result.push_back(Pair("target", HexStr(BEGIN(hashTarget), END(hashTarget))));
-        result.push_back(Pair("hash", pblock->GetHash().GetHex()));
-        result.push_back(Pair("chainid", pblock->GetChainID()));
-        return result;
-    }
-    else
-    {
-        uint256 hash;
-        hash.SetHex(params[0].get_str());
-        vector<unsigned char> vchAuxPow = ParseHex(params[1].get_str());
-        CDataStream ss(vchAuxPow, SER_GETHASH, PROTOCOL_VERSION);
-        CAuxPow* pow = new CAuxPow();
-        ss >> *pow;
-        if (!mapNewBlock.count(hash))
-            return "stale-work";
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VARR));
+    CheckAuxMiningAllowed();
 
-        CBlock* pblock = mapNewBlock[hash];
-        pblock->SetAuxPow(pow);
+    const UniValue& solutions = params[0].get_array();
 
-        BlockMap::iterator mi = mapBlockIndex.find(hash);
-        if (mi != mapBlockIndex.end()) {
-            CBlockIndex *pindex = mi->second;
-            if (pindex->IsValid(BLOCK_VALID_SCRIPTS))
-                return "duplicate";
-            if (pindex->nStatus & BLOCK_FAILED_MASK)
-                return "duplicate-invalid";
-        }
+    // Check the form of all solutions before submitting any, so that a bad
+    // one does not throw away the results of those before it.
+    std::vector<uint256> vHashes;
+    for (unsigned int i = 0; i < solutions.size(); i++) {
+        const UniValue& solution = solutions[i].get_obj();
+        RPCTypeCheckObj(solution,
+            {
+                {"hash", UniValueType(UniValue::VSTR)},
+                {"auxpow", UniValueType(UniValue::VSTR)},
+            });
+        vHashes.push_back(ParseHashO(solution, "hash"));
+    }
 
-        CValidationState state;
-        submitblock_StateCatcher sc(pblock->GetHash());
-        RegisterValidationInterface(&sc);
+    LOCK(cs_main);
 
-        bool fAccepted = ProcessNewBlock(state, Params(), NULL, pblock, true, NULL, false);
-        UnregisterValidationInterface(&sc);
-        if (mi != mapBlockIndex.end())
-        {
-            if (fAccepted && !sc.found)
-                return "duplicate-inconclusive";
-            return "duplicate";
-        }
-        if (fAccepted)
-        {
-            if (!sc.found)
-                return "inconclusive";
-            state = sc.state;
+    UniValue result(UniValue::VARR);
+    for (unsigned int i = 0; i < solutions.size(); i++) {
+        std::unique_ptr<CAuxPow> pow;
+        try {
+            pow = DecodeAuxPow(find_value(solutions[i], "auxpow").get_str());
+        } catch (const std::exception&) {
+            result.push_back("decode-failed");
+            continue;
         }
-        UniValue result = BIP22ValidationResult(state);
-        return result.isNull() ? true : result;
+        result.push_back(SubmitAuxBlock(vHashes[i], std::move(pow)));
     }
+    return result;
 }
 
 UniValue estimatefee(const UniValue& params, bool fHelp)
@@ -1065,6 +1299,8 @@ static const CRPCCommand commands[] =
     { "mining",             "getblocktemplate",       &getblocktemplate,       true  },
     { "mining",             "submitblock",            &submitblock,            true  },
     { "mining",             "getauxblock",            &getauxblock,            true  },
+    { "mining",             "createauxblocks",        &createauxblocks,        true  },
+    { "mining",             "submitauxblocks",        &submitauxblocks,        true  },
 
     { "generating",         "generate",               &generate,               true  },
     { "generating",         "generatetoaddress",      &generatetoaddress,      true  },
@@ -6,16 +6,18 @@
 #include "interpreter.h"
 
 #include "primitives/transaction.h"
+#include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
 
-typedef vector<unsigned char> valtype;
+typedef CScriptStackValue valtype;
 
 namespace {
 
@@ -56,7 +58,7 @@ bool CastToBool(const valtype& vch)
  */
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack(): stack empty");
@@ -107,7 +109,7 @@ bool static IsCompressedPubKey(const valtype &vchPubKey) {
  *
  * This function is consensus-critical since BIP66.
  */
-bool static IsValidSignatureEncoding(const std::vector<unsigned char> &sig) {
+bool static IsValidSignatureEncoding(const valtype &sig) {
     // Format: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S] [sighash]
     // * total-length: 1-byte length descriptor of everything that follows,
     //   excluding the sighash byte.
@@ -194,7 +196,7 @@ bool static IsDefinedHashtypeSignature(const valtype &vchSig) {
     return true;
 }
 
-bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror) {
+bool static CheckSignatureEncoding(const valtype &vchSig, unsigned int flags, ScriptError* serror) {
     // Empty signature. Not strictly DER encoded, but allowed to provide a
     // compact way to provide an invalid signature for use with CHECK(MULTI)SIG
     if (vchSig.size() == 0) {
@@ -211,6 +213,10 @@ bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int fl
     return true;
 }
 
+bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror) {
+    return CheckSignatureEncoding(valtype(vchSig.begin(), vchSig.end()), flags, serror);
+}
+
 bool static CheckPubKeyEncoding(const valtype &vchPubKey, unsigned int flags, const SigVersion &sigversion, ScriptError* serror) {
     if ((flags & SCRIPT_VERIFY_STRICTENC) != 0 && !IsCompressedOrUncompressedPubKey(vchPubKey)) {
         return set_error(serror, SCRIPT_ERR_PUBKEYTYPE);
@@ -245,15 +251,20 @@ bool static CheckMinimalPush(const valtype& data, opcodetype opcode) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+static inline void pushnum(CScriptStack& stack, const CScriptNum& bn)
+{
+    stack.push_back(valtype());
+    bn.getvch(stack.back());
+}
+
+bool EvalScript(CScriptStack& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
 {
     static const CScriptNum bnZero(0);
     static const CScriptNum bnOne(1);
     static const CScriptNum bnFalse(0);
     static const CScriptNum bnTrue(1);
-    static const valtype vchFalse(0);
-    static const valtype vchZero(0);
-    static const valtype vchTrue(1, 1);
+    static const valtype vchFalse;
+    static const valtype vchTrue(1, (unsigned char)1);
 
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
@@ -261,7 +272,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     set_error(serror, SCRIPT_ERR_UNKNOWN_ERROR);
     if (script.size() > MAX_SCRIPT_SIZE)
         return set_error(serror, SCRIPT_ERR_SCRIPT_SIZE);
@@ -334,7 +345,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // ( -- value)
                     CScriptNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                     // The result of these opcodes should always be the minimal way to push the data
                     // they push, so no need for a CheckMinimalPush here.
                 }
@@ -583,8 +594,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     // (x1 x2 x3 x4 -- x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
-                    swap(stacktop(-4), stacktop(-2));
-                    swap(stacktop(-3), stacktop(-1));
+                    stacktop(-4).swap(stacktop(-2));
+                    stacktop(-3).swap(stacktop(-1));
                 }
                 break;
 
@@ -603,7 +614,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // -- stacksize
                     CScriptNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -670,8 +681,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     //  x2 x3 x1  after second swap
                     if (stack.size() < 3)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
-                    swap(stacktop(-3), stacktop(-2));
-                    swap(stacktop(-2), stacktop(-1));
+                    stacktop(-3).swap(stacktop(-2));
+                    stacktop(-2).swap(stacktop(-1));
                 }
                 break;
 
@@ -680,7 +691,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     // (x1 x2 -- x2 x1)
                     if (stack.size() < 2)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
-                    swap(stacktop(-2), stacktop(-1));
+                    stacktop(-2).swap(stacktop(-1));
                 }
                 break;
 
@@ -701,7 +712,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     CScriptNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -763,7 +774,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
                 }
                 break;
 
@@ -812,7 +823,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    pushnum(stack, bn);
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -854,17 +865,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    valtype vchHash;
+                    vchHash.resize((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
-                        CRIPEMD160().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CRIPEMD160().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_SHA1)
-                        CSHA1().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CSHA1().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_SHA256)
-                        CSHA256().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CSHA256().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_HASH160)
-                        CHash160().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CHash160().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_HASH256)
-                        CHash256().Write(begin_ptr(vch), vch.size()).Finalize(begin_ptr(vchHash));
+                        CHash256().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     popstack(stack);
                     stack.push_back(vchHash);
                 }
@@ -892,7 +904,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
                     // Drop the signature in pre-segwit scripts but not segwit scripts
                     if (sigversion == SIGVERSION_BASE) {
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        scriptCode.FindAndDelete(CScript(ToByteVector(vchSig)));
                     }
 
                     if (!CheckSignatureEncoding(vchSig, flags, serror) || !CheckPubKeyEncoding(vchPubKey, flags, sigversion, serror)) {
@@ -956,7 +968,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     {
                         valtype& vchSig = stacktop(-isig-k);
                         if (sigversion == SIGVERSION_BASE) {
-                            scriptCode.FindAndDelete(CScript(vchSig));
+                            scriptCode.FindAndDelete(CScript(ToByteVector(vchSig)));
                         }
                     }
 
@@ -974,8 +986,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                             return false;
                         }
 
-                        // Check signature
-                        bool fOk = checker.CheckSig(vchSig, vchPubKey, scriptCode, sigversion);
+                        // Check signature. While keys outnumber signatures, a
+                        // failed check only moves on to the next key.
+                        bool fOk = nKeysCount > nSigsCount ? checker.CheckSigNow(vchSig, vchPubKey, scriptCode, sigversion)
+                                                           : checker.CheckSig(vchSig, vchPubKey, scriptCode, sigversion);
 
                         if (fOk) {
                             isig++;
@@ -1045,6 +1059,18 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
     return set_success(serror);
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+{
+    CScriptStack stackEval;
+    for (size_t i = 0; i < stack.size(); i++)
+        stackEval.push_back(valtype(stack[i].begin(), stack[i].end()));
+    bool fRet = EvalScript(stackEval, script, flags, checker, sigversion, serror);
+    stack.clear();
+    for (CScriptStack::const_iterator it = stackEval.begin(); it != stackEval.end(); ++it)
+        stack.push_back(vector<unsigned char>(it->begin(), it->end()));
+    return fRet;
+}
+
 namespace {
 
 /**
@@ -1142,6 +1168,65 @@ public:
     }
 };
 
+/** Stream that hashes what is serialized into it */
+class CSHA256Writer
+{
+private:
+    CSHA256& sha;
+
+public:
+    CSHA256Writer(CSHA256& shaIn) : sha(shaIn) {}
+
+    CSHA256Writer& write(const char *pch, size_t size) {
+        sha.Write((const unsigned char*)pch, size);
+        return (*this);
+    }
+};
+
+/** Size of an input with an empty script: prevout, script length and nSequence */
+const size_t LEGACY_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+void PrecomputeLegacySignatureHash(const CTransaction& txTo, PrecomputedTransactionData& data) {
+    data.vchLegacyInputs.resize(txTo.vin.size() * LEGACY_INPUT_SIZE);
+    data.vLegacyInputStates.reserve(txTo.vin.size());
+    unsigned char* p = begin_ptr(data.vchLegacyInputs);
+    for (unsigned int n = 0; n < txTo.vin.size(); n++, p += LEGACY_INPUT_SIZE) {
+        memcpy(p, txTo.vin[n].prevout.hash.begin(), 32);
+        WriteLE32(p + 32, txTo.vin[n].prevout.n);
+        p[36] = 0;
+        WriteLE32(p + 37, txTo.vin[n].nSequence);
+    }
+
+    CSHA256 sha;
+    CSHA256Writer s(sha);
+    ::Serialize(s, txTo.nVersion, SER_GETHASH, 0);
+    ::WriteCompactSize(s, txTo.vin.size());
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        data.vLegacyInputStates.push_back(sha);
+        sha.Write(&data.vchLegacyInputs[n * LEGACY_INPUT_SIZE], LEGACY_INPUT_SIZE);
+    }
+
+    CDataStream ssTail(SER_GETHASH, 0);
+    ssTail << txTo.vout << txTo.nLockTime;
+    data.vchLegacyTail.assign(ssTail.begin(), ssTail.end());
+}
+
+/**
+ * Whether at least two inputs carry no witness, and so use the legacy
+ * signature hash. With fewer, resuming from a precomputed state saves
+ * nothing.
+ */
+bool HasSeveralLegacyInputs(const CTransaction& txTo) {
+    unsigned int nLegacy = 0;
+    for (unsigned int n = 0; n < txTo.vin.size(); n++) {
+        if (n >= txTo.wit.vtxinwit.size() || txTo.wit.vtxinwit[n].IsNull()) {
+            if (++nLegacy >= 2)
+                return true;
+        }
+    }
+    return false;
+}
+
 uint256 GetPrevoutHash(const CTransaction& txTo) {
     CHashWriter ss(SER_GETHASH, 0);
     for (unsigned int n = 0; n < txTo.vin.size(); n++) {
@@ -1173,6 +1258,8 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+    if (HasSeveralLegacyInputs(txTo))
+        PrecomputeLegacySignatureHash(txTo, *this);
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1239,6 +1326,25 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // With SIGHASH_ALL, all but the signed input's script can be taken from the cache.
+    if (cache && cache->vLegacyInputStates.size() == txTo.vin.size() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        const unsigned char* pInput = &cache->vchLegacyInputs[nIn * LEGACY_INPUT_SIZE];
+        const unsigned char* pEnd = begin_ptr(cache->vchLegacyInputs) + cache->vchLegacyInputs.size();
+        CSHA256 sha(cache->vLegacyInputStates[nIn]);
+        CSHA256Writer s(sha);
+        sha.Write(pInput, 36);
+        txTmp.SerializeScriptCode(s, SER_GETHASH, 0);
+        sha.Write(pInput + 37, 4);
+        sha.Write(pInput + LEGACY_INPUT_SIZE, pEnd - (pInput + LEGACY_INPUT_SIZE));
+        sha.Write(begin_ptr(cache->vchLegacyTail), cache->vchLegacyTail.size());
+        ::Serialize(s, nHashType, SER_GETHASH, 0);
+        uint256 hash;
+        sha.Finalize(hash.begin());
+        CSHA256().Write(hash.begin(), 32).Finalize(hash.begin());
+        return hash;
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1250,14 +1356,14 @@ bool TransactionSignatureChecker::VerifySignature(const std::vector<unsigned cha
     return pubkey.Verify(sighash, vchSig);
 }
 
-bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+bool TransactionSignatureChecker::CheckSig(const valtype& vchSigIn, const valtype& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
 {
-    CPubKey pubkey(vchPubKey);
+    CPubKey pubkey(vchPubKey.begin(), vchPubKey.end());
     if (!pubkey.IsValid())
         return false;
 
     // Hash type is one byte tacked on to the end of the signature
-    vector<unsigned char> vchSig(vchSigIn);
+    vector<unsigned char> vchSig(vchSigIn.begin(), vchSigIn.end());
     if (vchSig.empty())
         return false;
     int nHashType = vchSig.back();
@@ -1355,7 +1461,7 @@ bool TransactionSignatureChecker::CheckSequence(const CScriptNum& nSequence) con
 
 static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion, const std::vector<unsigned char>& program, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
 {
-    vector<vector<unsigned char> > stack;
+    CScriptStack stack;
     CScript scriptPubKey;
 
     if (witversion == 0) {
@@ -1365,7 +1471,8 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WITNESS_EMPTY);
             }
             scriptPubKey = CScript(witness.stack.back().begin(), witness.stack.back().end());
-            stack = std::vector<std::vector<unsigned char> >(witness.stack.begin(), witness.stack.end() - 1);
+            for (size_t i = 0; i + 1 < witness.stack.size(); i++)
+                stack.push_back(valtype(witness.stack[i].begin(), witness.stack[i].end()));
             uint256 hashScriptPubKey;
             CSHA256().Write(&scriptPubKey[0], scriptPubKey.size()).Finalize(hashScriptPubKey.begin());
             if (memcmp(hashScriptPubKey.begin(), &program[0], 32)) {
@@ -1377,7 +1484,8 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_MISMATCH); // 2 items in witness
             }
             scriptPubKey << OP_DUP << OP_HASH160 << program << OP_EQUALVERIFY << OP_CHECKSIG;
-            stack = witness.stack;
+            for (size_t i = 0; i < witness.stack.size(); i++)
+                stack.push_back(valtype(witness.stack[i].begin(), witness.stack[i].end()));
         } else {
             return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WRONG_LENGTH);
         }
@@ -1420,7 +1528,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return set_error(serror, SCRIPT_ERR_SIG_PUSHONLY);
     }
 
-    vector<vector<unsigned char> > stack, stackCopy;
+    CScriptStack stack, stackCopy;
     if (!EvalScript(stack, scriptSig, flags, checker, SIGVERSION_BASE, serror))
         // serror is set
         return false;
@@ -1461,7 +1569,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
             return set_error(serror, SCRIPT_ERR_SIG_PUSHONLY);
 
         // Restore stack.
-        swap(stack, stackCopy);
+        stack.swap(stackCopy);
 
         // stack cannot be empty here, because if it was the
         // P2SH  HASH <> EQUAL  scriptPubKey would be evaluated with
@@ -1469,7 +1577,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         assert(!stack.empty());
 
         const valtype& pubKeySerialized = stack.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        CScript pubKey2(pubKeySerialized.data(), pubKeySerialized.data() + pubKeySerialized.size());
         popstack(stack);
 
         if (!EvalScript(stack, pubKey2, flags, checker, SIGVERSION_BASE, serror))
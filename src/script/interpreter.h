@@ -6,6 +6,8 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "crypto/sha256.h"
+#include "prevector.h"
 #include "script_error.h"
 #include "script.h"
 #include "primitives/transaction.h"
@@ -111,10 +113,32 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+/**
+ * An element of the interpreter's stack. Elements of up to 76 bytes, which
+ * covers signatures, public keys and hashes, are stored inline, and so are
+ * the first 8 elements of a stack, so evaluating the common script templates
+ * does not touch the heap.
+ */
+typedef prevector<76, unsigned char> CScriptStackValue;
+typedef prevector<8, CScriptStackValue> CScriptStack;
+
 struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    /**
+     * For the legacy signature hash with SIGHASH_ALL, which serializes the
+     * whole transaction with only the signed input carrying a script: the
+     * inputs serialized with empty scripts, the hasher state at the start of
+     * each of them, and the serialized outputs and lock time. Signing input n
+     * then resumes from state n and only serializes the script of that input,
+     * instead of the whole transaction again. Left empty unless at least two
+     * inputs use the legacy signature hash.
+     */
+    std::vector<unsigned char> vchLegacyInputs;
+    std::vector<CSHA256> vLegacyInputStates;
+    std::vector<unsigned char> vchLegacyTail;
+
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -129,11 +153,21 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 class BaseSignatureChecker
 {
 public:
-    virtual bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    virtual bool CheckSig(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
     {
         return false;
     }
 
+    /**
+     * CheckSig for a signature the script may be trying against a key that
+     * is not its own, as CHECKMULTISIG does while it has more keys than
+     * signatures left. Checkers that defer verification answer it at once.
+     */
+    virtual bool CheckSigNow(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    {
+        return CheckSig(scriptSig, vchPubKey, scriptCode, sigversion);
+    }
+
     virtual bool CheckLockTime(const CScriptNum& nLockTime) const
     {
          return false;
@@ -161,7 +195,7 @@ protected:
 public:
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(NULL) {}
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, const PrecomputedTransactionData& txdataIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(&txdataIn) {}
-    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
+    bool CheckSig(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
 };
@@ -175,6 +209,8 @@ public:
     MutableTransactionSignatureChecker(const CMutableTransaction* txToIn, unsigned int nInIn, const CAmount& amount) : TransactionSignatureChecker(&txTo, nInIn, amount), txTo(*txToIn) {}
 };
 
+bool EvalScript(CScriptStack& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
+/** Evaluate with a stack of vectors, for callers that inspect the resulting stack */
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
 
@@ -214,7 +214,9 @@ public:
 
     static const size_t nDefaultMaxNumSize = 4;
 
-    explicit CScriptNum(const std::vector<unsigned char>& vch, bool fRequireMinimal,
+    /** Decode a number from any byte container, like a vector or a stack element */
+    template <typename V>
+    explicit CScriptNum(const V& vch, bool fRequireMinimal,
                         const size_t nMaxNumSize = nDefaultMaxNumSize)
     {
         if (vch.size() > nMaxNumSize) {
@@ -316,12 +318,26 @@ public:
         return serialize(m_value);
     }
 
+    template <typename V>
+    void getvch(V& result) const
+    {
+        serialize(m_value, result);
+    }
+
     static std::vector<unsigned char> serialize(const int64_t& value)
     {
+        std::vector<unsigned char> result;
+        serialize(value, result);
+        return result;
+    }
+
+    template <typename V>
+    static void serialize(const int64_t& value, V& result)
+    {
+        result.clear();
         if(value == 0)
-            return std::vector<unsigned char>();
+            return;
 
-        std::vector<unsigned char> result;
         const bool neg = value < 0;
         uint64_t absvalue = neg ? -value : value;
 
@@ -345,12 +361,11 @@ public:
             result.push_back(neg ? 0x80 : 0);
         else if (neg)
             result.back() |= 0x80;
-
-        return result;
     }
 
 private:
-    static int64_t set_vch(const std::vector<unsigned char>& vch)
+    template <typename V>
+    static int64_t set_vch(const V& vch)
     {
       if (vch.empty())
           return 0;
@@ -500,7 +515,20 @@ public:
         return GetOp2(pc, opcodeRet, NULL);
     }
 
+    /** Read the pushed data into another byte container, like a stack element */
+    template <typename V>
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, V& vchRet) const
+    {
+        return GetOp2(pc, opcodeRet, &vchRet);
+    }
+
     bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
+    {
+        return GetOp2<std::vector<unsigned char> >(pc, opcodeRet, pvchRet);
+    }
+
+    template <typename V>
+    bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, V* pvchRet) const
     {
         opcodeRet = OP_INVALIDOPCODE;
         if (pvchRet)
@@ -5,29 +5,16 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
+#include <algorithm>
+#include <atomic>
 
 namespace {
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- */
-class CSignatureCacheHasher
-{
-public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
-    }
-};
-
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
@@ -38,13 +25,12 @@ class CSignatureCache
 private:
      //! Entries are SHA256(nonce || signature hash || public key || signature):
     uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
-    map_type setValid;
-    boost::shared_mutex cs_sigcache;
-
+    CAtomicHashSet setValid;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
 
 public:
-    CSignatureCache()
+    CSignatureCache() : nHits(0), nMisses(0)
     {
         GetRandBytes(nonce.begin(), 32);
     }
@@ -56,58 +42,162 @@ public:
     }
 
     bool
-    Get(const uint256& entry)
+    Get(const uint256& entry, bool erase)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
+        return setValid.Contains(entry, erase);
     }
 
-    void Erase(const uint256& entry)
+    void Set(const uint256& entry)
     {
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
+        setValid.Insert(entry);
     }
 
-    void Set(const uint256& entry)
+    void Resize(size_t nBytes)
+    {
+        setValid.Resize(nBytes);
+    }
+
+    //! Count lookups; batched by the callers, as the counters are shared
+    void AddLookups(uint64_t nHitsIn, uint64_t nMissesIn)
+    {
+        if (nHitsIn)
+            nHits.fetch_add(nHitsIn, std::memory_order_relaxed);
+        if (nMissesIn)
+            nMisses.fetch_add(nMissesIn, std::memory_order_relaxed);
+    }
+
+    void GetStats(CHashCacheStats& stats) const
     {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
-        {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
-            }
-        }
-
-        setValid.insert(entry);
+        stats.nCount = setValid.GetCount();
+        stats.nCapacity = setValid.GetCapacity();
+        stats.nUsage = setValid.DynamicMemoryUsage();
+        stats.nHits = nHits.load(std::memory_order_relaxed);
+        stats.nMisses = nMisses.load(std::memory_order_relaxed);
     }
 };
 
+CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
 }
 
-bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+/** Look an entry up, dropping it if the caller won't need it again. */
+bool LookupSignature(const uint256& entry, bool store)
 {
-    static CSignatureCache signatureCache;
+    return GetSignatureCache().Get(entry, !store);
+}
 
+/** Order pending checks so that those with the same key are adjacent. */
+struct CompareSigCheck
+{
+    bool operator()(const CPubKeySigCheck* a, const CPubKeySigCheck* b) const
+    {
+        if (a->pubkey != b->pubkey)
+            return a->pubkey < b->pubkey;
+        if (a->hash != b->hash)
+            return a->hash < b->hash;
+        return a->vchSig < b->vchSig;
+    }
+};
+
+}
+
+bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+{
     uint256 entry;
-    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    GetSignatureCache().ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(entry)) {
-        if (!store) {
-            signatureCache.Erase(entry);
-        }
+    const bool fHit = LookupSignature(entry, store);
+    GetSignatureCache().AddLookups(fHit, !fHit);
+    if (fHit)
         return true;
-    }
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store) {
-        signatureCache.Set(entry);
+        GetSignatureCache().Set(entry);
     }
     return true;
 }
+
+bool DeferringTransactionSignatureChecker::CheckSigNow(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+{
+    fDefer = false;
+    const bool fOk = CheckSig(scriptSig, vchPubKey, scriptCode, sigversion);
+    fDefer = true;
+    return fOk;
+}
+
+bool DeferringTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+{
+    if (!fDefer)
+        return CachingTransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash);
+
+    uint256 entry;
+    GetSignatureCache().ComputeEntry(entry, sighash, vchSig, pubkey);
+
+    if (LookupSignature(entry, store))
+        batch.AddHit();
+    else
+        batch.Add(vchSig, pubkey, sighash, entry, store);
+    return true;
+}
+
+void CSignatureBatch::Add(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash, const uint256& entry, bool store)
+{
+    vChecks.push_back(CPubKeySigCheck());
+    CPubKeySigCheck& check = vChecks.back();
+    check.pubkey = pubkey;
+    check.hash = sighash;
+    check.vchSig = vchSig;
+    vEntries.push_back(entry);
+    vStore.push_back(store);
+    nLookupMisses++;
+}
+
+void CSignatureBatch::Truncate(size_t n)
+{
+    vChecks.resize(n);
+    vEntries.resize(n);
+    vStore.resize(n);
+}
+
+void CSignatureBatch::Verify()
+{
+    std::vector<CPubKeySigCheck*> vSorted(vChecks.size());
+    for (size_t i = 0; i < vChecks.size(); i++)
+        vSorted[i] = &vChecks[i];
+    std::sort(vSorted.begin(), vSorted.end(), CompareSigCheck());
+    CPubKey::VerifyBatch(vSorted);
+
+    GetSignatureCache().AddLookups(nLookupHits, nLookupMisses);
+    nLookupHits = nLookupMisses = 0;
+
+    for (size_t i = 0; i < vChecks.size(); i++) {
+        if (vChecks[i].fValid && vStore[i])
+            GetSignatureCache().Set(vEntries[i]);
+    }
+}
+
+bool CSignatureBatch::AllValid(size_t nBegin, size_t nEnd) const
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        if (!vChecks[i].fValid)
+            return false;
+    }
+    return true;
+}
+
+void InitSignatureCache()
+{
+    // The script execution cache gets the other half of -maxsigcachesize.
+    int64_t nMaxCacheSize = std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE));
+    GetSignatureCache().Resize((size_t)nMaxCacheSize << 19);
+}
+
+void GetSignatureCacheStats(CHashCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
@@ -6,19 +6,22 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "atomichashset.h"
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
+// DoS prevention: limit the signature and script execution caches to 40MB
+// together (about 1.9 million entries).
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
+struct CPubKeySigCheck;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
-private:
+protected:
     bool store;
 
 public:
@@ -27,4 +30,60 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/**
+ * Signature checks collected while a batch of scripts is evaluated, to be
+ * verified together once all of them have run. Checks are verified grouped
+ * by key, so a key used by several inputs is parsed once and a signature met
+ * twice is verified once. Valid signatures go into the signature cache if
+ * the check that recorded them asked for it.
+ */
+class CSignatureBatch
+{
+private:
+    std::vector<CPubKeySigCheck> vChecks;
+    std::vector<uint256> vEntries;
+    std::vector<bool> vStore;
+    //! Cache lookups made for the batch, reported to the cache once
+    uint64_t nLookupHits;
+    uint64_t nLookupMisses;
+
+public:
+    CSignatureBatch() : nLookupHits(0), nLookupMisses(0) {}
+
+    size_t Size() const { return vChecks.size(); }
+    void AddHit() { nLookupHits++; }
+    void Add(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash, const uint256& entry, bool store);
+    //! Forget the checks from position n on
+    void Truncate(size_t n);
+    //! Verify every check added so far
+    void Verify();
+    //! Whether checks [nBegin, nEnd) were all valid, once verified
+    bool AllValid(size_t nBegin, size_t nEnd) const;
+};
+
+/**
+ * A signature checker that leaves the ECDSA work to a CSignatureBatch.
+ * Signatures that are not in the cache are recorded and reported as valid,
+ * so a script evaluated with it has only really passed if the batch then
+ * finds every signature it recorded valid. Signatures checked through
+ * CheckSigNow, which CHECKMULTISIG may try against the wrong key, are
+ * verified right away instead.
+ */
+class DeferringTransactionSignatureChecker : public CachingTransactionSignatureChecker
+{
+private:
+    CSignatureBatch& batch;
+    mutable bool fDefer;
+
+public:
+    DeferringTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, PrecomputedTransactionData& txdataIn, CSignatureBatch& batchIn) : CachingTransactionSignatureChecker(txToIn, nInIn, amount, storeIn, txdataIn), batch(batchIn), fDefer(true) {}
+
+    bool CheckSigNow(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
+    bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
+};
+
+/** Allocate the signature cache as sized by -maxsigcachesize. */
+void InitSignatureCache();
+void GetSignatureCacheStats(CHashCacheStats& stats);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -263,7 +263,7 @@ static vector<valtype> CombineMultisig(const CScript& scriptPubKey, const BaseSi
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (checker.CheckSig(sig, pubkey, scriptPubKey, sigversion))
+            if (checker.CheckSig(CScriptStackValue(sig.begin(), sig.end()), CScriptStackValue(pubkey.begin(), pubkey.end()), scriptPubKey, sigversion))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -401,7 +401,7 @@ class DummySignatureChecker : public BaseSignatureChecker
 public:
     DummySignatureChecker() {}
 
-    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    bool CheckSig(const CScriptStackValue& scriptSig, const CScriptStackValue& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
     {
         return true;
     }
@@ -31,8 +31,11 @@
 /* optimal for 128-bit and 256-bit exponents. */
 #define WINDOW_A 5
 /** larger numbers may result in slightly better performance, at the cost of
-    exponentially larger precomputed tables. */
-#ifdef USE_ENDOMORPHISM
+    exponentially larger precomputed tables. A table for window size w takes
+    2^(w-2) points of 64 bytes, and two tables are used with endomorphism. */
+#if defined(ECMULT_WINDOW_SIZE)
+#define WINDOW_G ECMULT_WINDOW_SIZE
+#elif defined(USE_ENDOMORPHISM)
 /** Two tables for window size 15: 1.375 MiB. */
 #define WINDOW_G 15
 #else
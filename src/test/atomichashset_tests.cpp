@@ -0,0 +1,116 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "atomichashset.h"
+#include "random.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(atomichashset_tests, BasicTestingSetup)
+
+static std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> hashes(n);
+    for (size_t i = 0; i < n; i++)
+        hashes[i] = GetRandHash();
+    return hashes;
+}
+
+BOOST_AUTO_TEST_CASE(atomichashset_basics)
+{
+    CAtomicHashSet set;
+    std::vector<uint256> hashes = RandomHashes(1000);
+
+    // Without a table nothing is kept.
+    set.Insert(hashes[0]);
+    BOOST_CHECK(!set.Contains(hashes[0], false));
+    BOOST_CHECK_EQUAL(set.GetCapacity(), 0U);
+
+    set.Resize(1 << 20);
+    BOOST_CHECK_EQUAL(set.GetCapacity(), (1U << 20) / 64 * 3);
+    BOOST_CHECK_EQUAL(set.DynamicMemoryUsage(), 1U << 20);
+    for (size_t i = 0; i < hashes.size() / 2; i++)
+        set.Insert(hashes[i]);
+    BOOST_CHECK_EQUAL(set.GetCount(), hashes.size() / 2);
+    for (size_t i = 0; i < hashes.size(); i++)
+        BOOST_CHECK_EQUAL(set.Contains(hashes[i], false), i < hashes.size() / 2);
+
+    // Resizing starts over empty.
+    set.Resize(1 << 20);
+    BOOST_CHECK_EQUAL(set.GetCount(), 0U);
+    BOOST_CHECK(!set.Contains(hashes[0], false));
+}
+
+BOOST_AUTO_TEST_CASE(atomichashset_eviction)
+{
+    // A single bucket, so every hash competes for the same three ways.
+    CAtomicHashSet set;
+    set.Resize(64);
+    std::vector<uint256> hashes = RandomHashes(5);
+    for (int i = 0; i < 3; i++)
+        set.Insert(hashes[i]);
+    BOOST_CHECK_EQUAL(set.GetCount(), 3U);
+
+    // An erased entry is still found until its way is reused, which happens
+    // before any live entry goes.
+    BOOST_CHECK(set.Contains(hashes[1], true));
+    BOOST_CHECK(set.Contains(hashes[1], false));
+    BOOST_CHECK_EQUAL(set.GetCount(), 2U);
+    set.Insert(hashes[3]);
+    BOOST_CHECK(set.Contains(hashes[0], false));
+    BOOST_CHECK(!set.Contains(hashes[1], false));
+    BOOST_CHECK(set.Contains(hashes[2], false));
+    BOOST_CHECK(set.Contains(hashes[3], false));
+
+    // With no room left one of the live entries makes way.
+    set.Insert(hashes[4]);
+    BOOST_CHECK_EQUAL(set.GetCount(), 3U);
+    BOOST_CHECK(set.Contains(hashes[4], false));
+    BOOST_CHECK_EQUAL(set.Contains(hashes[0], false) + set.Contains(hashes[2], false) + set.Contains(hashes[3], false), 2);
+}
+
+static void InsertAndCheck(CAtomicHashSet& set, const std::vector<uint256>& hashes, size_t nBegin, size_t nEnd, const std::vector<uint256>& absent, bool& fFalsePositive)
+{
+    for (size_t i = nBegin; i < nEnd; i++) {
+        set.Insert(hashes[i]);
+        set.Contains(hashes[nBegin + (i - nBegin) / 2], false);
+        if (set.Contains(absent[i % absent.size()], false))
+            fFalsePositive = true;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(atomichashset_threads)
+{
+    CAtomicHashSet set;
+    set.Resize(1 << 20);
+    std::vector<uint256> hashes = RandomHashes(16000);
+    std::vector<uint256> absent = RandomHashes(1000);
+
+    const int nThreads = 4;
+    bool fFalsePositive[nThreads] = {};
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++) {
+        size_t nBegin = hashes.size() * i / nThreads, nEnd = hashes.size() * (i + 1) / nThreads;
+        threads.create_thread(boost::bind(InsertAndCheck, boost::ref(set), boost::cref(hashes), nBegin, nEnd, boost::cref(absent), boost::ref(fFalsePositive[i])));
+    }
+    threads.join_all();
+
+    for (int i = 0; i < nThreads; i++)
+        BOOST_CHECK(!fFalsePositive[i]);
+    // Inserts that raced another writer may have been dropped, and some
+    // entries evicted, but nearly all must be there.
+    size_t nFound = 0;
+    for (size_t i = 0; i < hashes.size(); i++)
+        nFound += set.Contains(hashes[i], false);
+    BOOST_CHECK(nFound > hashes.size() * 9 / 10);
+    BOOST_CHECK_EQUAL(set.GetCount(), nFound);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
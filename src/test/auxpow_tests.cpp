@@ -0,0 +1,145 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "auxpow/auxpow.h"
+#include "chain.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(auxpow_tests, BasicTestingSetup)
+
+static const unsigned char pchMergedMiningHeader[] = { 0xfa, 0xbe, 'm', 'm' };
+
+/** Build a block index entry with an auxpow in the shape merge miners produce */
+static void BuildAuxPowIndex(CDiskBlockIndex& index, bool fEmbedRoot)
+{
+    index.nHeight = 1000;
+    index.nTx = 3;
+    index.nVersion = 2 | AuxPow::BLOCK_VERSION_AUXPOW;
+    index.hashPrev = GetRandHash();
+    index.hashMerkleRoot = GetRandHash();
+    index.nTime = 1480000000;
+    index.nBits = 0x1e0ffff0;
+    index.nNonce = 0;
+    const uint256 hashAuxBlock = index.GetBlockHash();
+
+    std::vector<uint256> vChainMerkleBranch(2);
+    vChainMerkleBranch[0] = GetRandHash();
+    vChainMerkleBranch[1] = GetRandHash();
+    const unsigned int nChainIndex = 2;
+    const uint256 hashRoot = CAuxPow::CheckMerkleBranch(hashAuxBlock, vChainMerkleBranch, nChainIndex);
+    std::vector<unsigned char> vchRoot(hashRoot.begin(), hashRoot.end());
+    std::reverse(vchRoot.begin(), vchRoot.end());
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 420000 << std::vector<unsigned char>(pchMergedMiningHeader, pchMergedMiningHeader + sizeof(pchMergedMiningHeader));
+    if (fEmbedRoot)
+        coinbase.vin[0].scriptSig.insert(coinbase.vin[0].scriptSig.end(), vchRoot.begin(), vchRoot.end());
+    coinbase.vin[0].scriptSig << 4 << 0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 25 * COIN;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    std::shared_ptr<CAuxPow> auxpow(new CAuxPow(CTransaction(coinbase)));
+    auxpow->vMerkleBranch.push_back(GetRandHash());
+    auxpow->nIndex = 0;
+    auxpow->vChainMerkleBranch = vChainMerkleBranch;
+    auxpow->nChainIndex = nChainIndex;
+    auxpow->parentBlockHeader.nVersion = 2;
+    auxpow->parentBlockHeader.hashPrevBlock = GetRandHash();
+    auxpow->parentBlockHeader.hashMerkleRoot = CAuxPow::CheckMerkleBranch(auxpow->GetHash(), auxpow->vMerkleBranch, 0);
+    auxpow->parentBlockHeader.nTime = 1480000123;
+    auxpow->parentBlockHeader.nBits = 0x1b0404cb;
+    auxpow->parentBlockHeader.nNonce = insecure_rand();
+    auxpow->hashBlock = auxpow->parentBlockHeader.GetHash();
+    index.auxpow = auxpow;
+}
+
+static void CheckRoundTrip(CDiskBlockIndex& index)
+{
+    CDataStream ssFull(SER_DISK, CLIENT_VERSION);
+    ssFull << index;
+    CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+    ssCompact << CCompactDiskBlockIndex(index);
+    // At worst, an auxpow that cannot be compressed costs the flag byte.
+    BOOST_CHECK(ssCompact.size() <= ssFull.size() + (index.IsAuxPow() ? 1 : 0));
+
+    CDiskBlockIndex indexRead;
+    CCompactDiskBlockIndex compactRead(indexRead);
+    ssCompact >> compactRead;
+    BOOST_CHECK(ssCompact.empty());
+    BOOST_CHECK(indexRead.GetBlockHash() == index.GetBlockHash());
+    BOOST_CHECK_EQUAL(indexRead.nHeight, index.nHeight);
+    BOOST_CHECK_EQUAL(indexRead.nTx, index.nTx);
+
+    // The decoded record must be byte for byte what the legacy format held.
+    CDataStream ssRead(SER_DISK, CLIENT_VERSION);
+    ssRead << indexRead;
+    BOOST_CHECK(ssRead.str() == ssFull.str());
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_compact_roundtrip)
+{
+    CDiskBlockIndex index;
+    BuildAuxPowIndex(index, true);
+    CheckRoundTrip(index);
+
+    // Leaving out the parent header and chain merkle root saves 32 + 32 + 4 bytes,
+    // less the flag byte and the root position.
+    CDataStream ssFull(SER_DISK, CLIENT_VERSION);
+    ssFull << index;
+    CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+    ssCompact << CCompactDiskBlockIndex(index);
+    BOOST_CHECK(ssFull.size() - ssCompact.size() >= 60);
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_compact_fallback)
+{
+    // No chain merkle root in the coinbase.
+    CDiskBlockIndex index;
+    BuildAuxPowIndex(index, false);
+    CheckRoundTrip(index);
+
+    // A parent header that does not commit to the coinbase is stored in full.
+    BuildAuxPowIndex(index, true);
+    index.auxpow->parentBlockHeader.hashMerkleRoot = GetRandHash();
+    CheckRoundTrip(index);
+
+    // Plain blocks carry no auxpow at all.
+    CDiskBlockIndex plain;
+    plain.nVersion = 2;
+    plain.hashPrev = GetRandHash();
+    CheckRoundTrip(plain);
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_header_only)
+{
+    CDiskBlockIndex index;
+    BuildAuxPowIndex(index, true);
+
+    // Header-only reads work on both the compact and the legacy layout.
+    CDataStream ssFull(SER_DISK, CLIENT_VERSION);
+    ssFull << index;
+    CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+    ssCompact << CCompactDiskBlockIndex(index);
+
+    CDataStream* streams[] = { &ssFull, &ssCompact };
+    for (unsigned int i = 0; i < 2; i++) {
+        CDiskBlockIndex indexRead;
+        CCompactDiskBlockIndex headerRead(indexRead, true);
+        *streams[i] >> headerRead;
+        BOOST_CHECK(!indexRead.auxpow);
+        BOOST_CHECK(indexRead.GetBlockHash() == index.GetBlockHash());
+        BOOST_CHECK_EQUAL(indexRead.nHeight, index.nHeight);
+        BOOST_CHECK_EQUAL(indexRead.nTx, index.nTx);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
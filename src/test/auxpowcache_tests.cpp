@@ -0,0 +1,64 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "auxpow/auxpow.h"
+#include "random.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(auxpowcache_tests, BasicTestingSetup)
+
+static std::shared_ptr<CAuxPow> RandomAuxPow()
+{
+    std::shared_ptr<CAuxPow> auxpow(new CAuxPow());
+    auxpow->vChainMerkleBranch.resize(1 + insecure_rand() % 8);
+    for (unsigned int i = 0; i < auxpow->vChainMerkleBranch.size(); i++)
+        auxpow->vChainMerkleBranch[i] = GetRandHash();
+    auxpow->nChainIndex = insecure_rand();
+    return auxpow;
+}
+
+BOOST_AUTO_TEST_CASE(auxpowcache_lookup)
+{
+    CAuxPowCache cache(1 << 20);
+    std::shared_ptr<CAuxPow> auxpow = RandomAuxPow();
+    uint256 hash = GetRandHash();
+    std::shared_ptr<CAuxPow> found;
+
+    BOOST_CHECK(!cache.Get(hash, found));
+    cache.Insert(hash, auxpow);
+    BOOST_CHECK(cache.Get(hash, found));
+    BOOST_CHECK(found == auxpow);
+
+    // Null auxpows are not cached.
+    cache.Insert(GetRandHash(), std::shared_ptr<CAuxPow>());
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetHits(), 1U);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(auxpowcache_eviction)
+{
+    const size_t nMaxUsage = 64 * 1024;
+    CAuxPowCache cache(nMaxUsage);
+    std::vector<uint256> vHashes;
+    std::shared_ptr<CAuxPow> found;
+
+    for (int i = 0; i < 1000; i++) {
+        vHashes.push_back(GetRandHash());
+        cache.Insert(vHashes.back(), RandomAuxPow());
+        BOOST_CHECK(cache.DynamicMemoryUsage() <= nMaxUsage);
+        // Keep the first entry hot, so it is never the least recently used.
+        BOOST_CHECK(cache.Get(vHashes[0], found));
+    }
+    BOOST_CHECK(cache.GetCount() < vHashes.size());
+
+    // The most recent entries survive, the oldest cold ones were evicted.
+    BOOST_CHECK(cache.Get(vHashes.back(), found));
+    BOOST_CHECK(!cache.Get(vHashes[1], found));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
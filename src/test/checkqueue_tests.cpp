@@ -0,0 +1,83 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+struct CountingCheck
+{
+    std::atomic<int>* pnRuns;
+    bool fOk;
+
+    CountingCheck() : pnRuns(NULL), fOk(true) {}
+    CountingCheck(std::atomic<int>* pnRunsIn, bool fOkIn) : pnRuns(pnRunsIn), fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        (*pnRuns)++;
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(pnRuns, check.pnRuns);
+        std::swap(fOk, check.fOk);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(checkqueue_rounds)
+{
+    CCheckQueue<CountingCheck> queue(16, 4);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    for (int nRound = 0; nRound < 50; nRound++) {
+        std::atomic<int> nRuns(0);
+        const int nChecks = nRound * 37;
+        {
+            CCheckQueueControl<CountingCheck> control(&queue);
+            for (int i = 0; i < nChecks; ) {
+                std::vector<CountingCheck> vChecks;
+                for (int j = 0; j < 1 + nRound % 7 && i < nChecks; j++, i++)
+                    vChecks.push_back(CountingCheck(&nRuns, true));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK(control.Wait());
+        }
+        BOOST_CHECK_EQUAL(nRuns, nChecks);
+        const CCheckQueueStats& stats = queue.GetStats();
+        BOOST_CHECK_EQUAL(stats.nChecks, (unsigned int)nChecks);
+        BOOST_CHECK(stats.nThreads <= 4);
+        BOOST_CHECK(stats.nMinChecks <= stats.nMaxChecks);
+        BOOST_CHECK(stats.nTailMicros <= stats.nWaitMicros);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    // A failure is reported once, and the queue is clean for the next round.
+    for (int nRound = 0; nRound < 2; nRound++) {
+        std::atomic<int> nRuns(0);
+        CCheckQueueControl<CountingCheck> control(&queue);
+        std::vector<CountingCheck> vChecks;
+        for (int i = 0; i < 1000; i++)
+            vChecks.push_back(CountingCheck(&nRuns, nRound == 1 || i != 500));
+        control.Add(vChecks);
+        BOOST_CHECK_EQUAL(control.Wait(), nRound == 1);
+        BOOST_CHECK(nRuns <= 1000);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -322,6 +322,72 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
-
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    std::string strError;
+    std::vector<std::string> vNames;
+    vNames.push_back("chainstate");
+    vNames.push_back("blockindex");
+    std::vector<std::string> vArgs;
+    vArgs.push_back("chainstate:bloombits=0,writebuffer=1");
+    BOOST_CHECK(SetDBProfiles(vArgs, vNames, strError));
+    CDBProfile profile = GetDBProfile("chainstate");
+    BOOST_CHECK_EQUAL(profile.nBloomBits, 0);
+    BOOST_CHECK_EQUAL(profile.nWriteBuffer, 1U << 20);
+    BOOST_CHECK_EQUAL(profile.nBlockCache, 0U);
+    BOOST_CHECK_EQUAL(GetDBProfile("blockindex").nBloomBits, 10);
+
+    {
+        path ph = temp_directory_path() / unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, false, "chainstate");
+        for (int i = 0; i < 1000; i++)
+            BOOST_CHECK(dbw.Write(i, GetRandHash()));
+        uint256 res;
+        BOOST_CHECK(dbw.Read(500, res));
+
+        std::vector<CDBStats> vStats = GetAllDBStats();
+        bool fFound = false;
+        BOOST_FOREACH(const CDBStats& stats, vStats) {
+            if (stats.strName != "chainstate")
+                continue;
+            fFound = true;
+            BOOST_CHECK_EQUAL(stats.vLevels.size(), 7U);
+            BOOST_CHECK(stats.strStats.find("Compactions") != std::string::npos);
+        }
+        BOOST_CHECK(fFound);
+    }
+    BOOST_FOREACH(const CDBStats& stats, GetAllDBStats())
+        BOOST_CHECK(stats.strName != "chainstate");
+
+    vArgs.push_back("blockindex:bloombits");
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = "blockindex:filesize=2";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = "bloombits=2";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = "profiled:bloombits=2";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = strprintf("blockindex:bloombits=%d", MAX_DB_PROFILE_BLOOM_BITS + 1);
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = strprintf("blockindex:blockcache=%d", MAX_DB_PROFILE_SIZE + 1);
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = "blockindex:writebuffer=9223372036854775807";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    // The bundled LevelDB 1.18 has neither Snappy nor a table file size option.
+    vArgs.back() = "blockindex:compression=1";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    vArgs.back() = "blockindex:maxfilesize=2";
+    BOOST_CHECK(!SetDBProfiles(vArgs, vNames, strError));
+    // A failed parse leaves the profiles alone.
+    BOOST_CHECK_EQUAL(GetDBProfile("chainstate").nBloomBits, 0);
+
+    vArgs.back() = strprintf("blockindex:bloombits=%d,blockcache=1024", MAX_DB_PROFILE_BLOOM_BITS);
+    BOOST_CHECK(SetDBProfiles(vArgs, vNames, strError));
+    BOOST_CHECK_EQUAL(GetDBProfile("blockindex").nBloomBits, MAX_DB_PROFILE_BLOOM_BITS);
+    BOOST_CHECK_EQUAL(GetDBProfile("blockindex").nBlockCache, 1U << 30);
+
+    BOOST_CHECK(SetDBProfiles(std::vector<std::string>(), vNames, strError));
+    BOOST_CHECK_EQUAL(GetDBProfile("chainstate").nBloomBits, 10);
+}
 
 BOOST_AUTO_TEST_SUITE_END()
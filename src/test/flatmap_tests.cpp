@@ -0,0 +1,150 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flatmap.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+// A poor hash, so that probing sequences get long.
+struct ModHasher
+{
+    size_t operator()(unsigned int n) const { return n % 1000; }
+};
+
+typedef CFlatHashMap<unsigned int, std::string, ModHasher> TestMap;
+
+void CheckEqual(const TestMap& map, const std::map<unsigned int, std::string>& expected)
+{
+    BOOST_CHECK_EQUAL(map.size(), expected.size());
+    size_t nSeen = 0;
+    for (TestMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+        std::map<unsigned int, std::string>::const_iterator itExpected = expected.find(it->first);
+        BOOST_CHECK(itExpected != expected.end() && itExpected->second == it->second);
+        nSeen++;
+    }
+    BOOST_CHECK_EQUAL(nSeen, expected.size());
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(flatmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(flatmap_simulation)
+{
+    TestMap map;
+    std::map<unsigned int, std::string> expected;
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(0) == map.end());
+
+    for (int i = 0; i < 100000; i++) {
+        unsigned int nKey = insecure_rand() % 5000;
+        switch (insecure_rand() % 4) {
+        case 0:
+        case 1: {
+            std::string value(insecure_rand() % 40, 'a' + i % 26);
+            std::pair<TestMap::iterator, bool> ret = map.insert(std::make_pair(nKey, value));
+            BOOST_CHECK_EQUAL(ret.second, expected.insert(std::make_pair(nKey, value)).second);
+            BOOST_CHECK_EQUAL(ret.first->first, nKey);
+            BOOST_CHECK(ret.first->second == expected[nKey]);
+            break;
+        }
+        case 2:
+            BOOST_CHECK_EQUAL(map.erase(nKey), expected.erase(nKey));
+            break;
+        case 3:
+            BOOST_CHECK_EQUAL(map.count(nKey), expected.count(nKey));
+            map[nKey] += "x";
+            expected[nKey] += "x";
+            break;
+        }
+        if (i % 10000 == 0)
+            CheckEqual(map, expected);
+    }
+    CheckEqual(map, expected);
+
+    // Erase every other element while iterating, as the caches do.
+    for (TestMap::iterator it = map.begin(); it != map.end(); ) {
+        if (it->first % 2) {
+            expected.erase(it->first);
+            map.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    CheckEqual(map, expected);
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_stable_references)
+{
+    TestMap map;
+    std::string* pFirst = &map[1];
+    *pFirst = "first";
+    // Growing the table many times over leaves the element where it was.
+    for (unsigned int i = 2; i < 10000; i++)
+        map[i] = "other";
+    BOOST_CHECK_EQUAL(&map[1], pFirst);
+    BOOST_CHECK_EQUAL(*pFirst, "first");
+
+    // Freed nodes are reused.
+    map.erase(1);
+    BOOST_CHECK_EQUAL(&map[10000], pFirst);
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_swap)
+{
+    TestMap map, other;
+    std::string* pFirst = &map[1];
+    *pFirst = "first";
+    for (unsigned int i = 2; i < 100; i++)
+        map[i] = "other";
+    size_t nUsage = memusage::DynamicUsage(map);
+
+    // The elements and their memory go over without moving.
+    map.swap(other);
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+    BOOST_CHECK_EQUAL(other.size(), 99U);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(other), nUsage);
+    BOOST_CHECK_EQUAL(&other[1], pFirst);
+    BOOST_CHECK(other.find(50) != other.end());
+    map[1] = "new";
+    BOOST_CHECK_EQUAL(*pFirst, "first");
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_memory_usage)
+{
+    CFlatHashMap<unsigned int, uint64_t, ModHasher> map;
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+
+    for (unsigned int i = 0; i < 1000; i++)
+        map[i] = i;
+    size_t nUsage = memusage::DynamicUsage(map);
+    BOOST_CHECK(nUsage >= 1000 * (sizeof(std::pair<const unsigned int, uint64_t>) + 2 * sizeof(void*)));
+
+    // Erasing keeps the memory for reuse...
+    for (unsigned int i = 0; i < 1000; i++)
+        map.erase(i);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), nUsage);
+    for (unsigned int i = 0; i < 1000; i++)
+        map[i] = i;
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), nUsage);
+
+    // ...while clear returns all of it, and the map can be used again.
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(1) == map.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(map), 0U);
+    map[1] = 1;
+    BOOST_CHECK_EQUAL(map.size(), 1U);
+    BOOST_CHECK(memusage::DynamicUsage(map) < nUsage);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -115,6 +115,17 @@ BOOST_AUTO_TEST_CASE(merkle_test)
             BOOST_CHECK((newRoot == uint256()) == (ntx == 0));
             BOOST_CHECK(oldMutated == newMutated);
             BOOST_CHECK(newMutated == !!mutate);
+            // The whole tree agrees, and holds the same levels as the old one.
+            CMerkleTree tree(block);
+            BOOST_CHECK(tree.Root() == newRoot);
+            BOOST_CHECK(tree.Mutated() == newMutated);
+            size_t node = 0;
+            for (int h = 0; h <= tree.Height(); h++) {
+                for (uint32_t pos = 0; pos < tree.Width(h); pos++) {
+                    BOOST_CHECK(tree.Node(h, pos) == merkleTree[node++]);
+                }
+            }
+            BOOST_CHECK_EQUAL(node, merkleTree.size());
             // If no mutation was done (once for every ntx value), try up to 16 branches.
             if (mutate == 0) {
                 for (int loop = 0; loop < std::min(ntx, 16); loop++) {
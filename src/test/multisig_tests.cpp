@@ -9,6 +9,7 @@
 #include "script/script_error.h"
 #include "script/interpreter.h"
 #include "script/sign.h"
+#include "script/sigcache.h"
 #include "script/ismine.h"
 #include "uint256.h"
 #include "test/test_bitcoin.h"
@@ -140,6 +141,44 @@ BOOST_AUTO_TEST_CASE(multisig_verify)
         }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_deferred)
+{
+    // Deferring the checks of a 2-of-3 spend must not record the pairs of a
+    // signature and a key that is not its own, or every valid spend whose
+    // signatures skip a key would have to be verified again.
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+
+    ScriptError err;
+    CKey key[4];
+    CAmount amount = 0;
+    for (int i = 0; i < 4; i++)
+        key[i].MakeNewKey(true);
+
+    CScript escrow;
+    escrow << OP_2 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << ToByteVector(key[2].GetPubKey()) << OP_3 << OP_CHECKMULTISIG;
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    const CTransaction tx(txTo);
+    PrecomputedTransactionData txdata(tx);
+
+    vector<CKey> keys;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+        {
+            keys.assign(1,key[i]);
+            keys.push_back(key[j]);
+            CScript s = sign_multisig(escrow, keys, tx, 0);
+            CSignatureBatch batch;
+            bool fOk = VerifyScript(s, escrow, NULL, flags, DeferringTransactionSignatureChecker(&tx, 0, amount, false, txdata, batch), &err);
+            batch.Verify();
+            fOk = fOk && batch.AllValid(0, batch.Size());
+            BOOST_CHECK_MESSAGE(fOk == (i < j && j < 3), strprintf("escrow deferred: %d %d", i, j));
+        }
+}
+
 BOOST_AUTO_TEST_CASE(multisig_IsStandard)
 {
     CKey key[4];
@@ -95,4 +95,126 @@ BOOST_AUTO_TEST_CASE(GetBlockProofEquivalentTime_test)
     }
 }
 
+/* Reference AntiGravityWave, walking the whole window one block at a time */
+static unsigned int AntiGravityWaveReference(int64_t version, const CBlockIndex* pindexLast, const Consensus::Params& params)
+{
+    const CBlockIndex *BlockReading = pindexLast;
+    int64_t nActualTimespan = 0;
+    int64_t LastBlockTime = 0;
+    int64_t PastBlocksMin = version == 2 ? 72 : 24;
+    int64_t PastBlocksMax = PastBlocksMin;
+    int64_t CountBlocks = 0;
+    arith_uint256 PastDifficultyAverage;
+    arith_uint256 PastDifficultyAveragePrev;
+
+    if (pindexLast == NULL || pindexLast->nHeight == 0 || pindexLast->nHeight < PastBlocksMin)
+        return UintToArith256(params.powLimit).GetCompact();
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
+        CountBlocks++;
+        if (CountBlocks <= PastBlocksMin) {
+            if (CountBlocks == 1)
+                PastDifficultyAverage.SetCompact(BlockReading->nBits);
+            else
+                PastDifficultyAverage = ((PastDifficultyAveragePrev * CountBlocks)+(arith_uint256().SetCompact(BlockReading->nBits))) / (CountBlocks+1);
+            PastDifficultyAveragePrev = PastDifficultyAverage;
+        }
+        if (LastBlockTime > 0)
+            nActualTimespan += LastBlockTime - BlockReading->GetBlockTime();
+        LastBlockTime = BlockReading->GetBlockTime();
+        BlockReading = BlockReading->pprev;
+    }
+
+    arith_uint256 bnNew(PastDifficultyAverage);
+    if (version == 2)
+        --CountBlocks;
+    int64_t nTargetTimespan = CountBlocks * params.nPowTargetSpacing;
+    int64_t div = version == 2 ? 2 : 3;
+    if (nActualTimespan < nTargetTimespan/div)
+        nActualTimespan = nTargetTimespan/div;
+    if (nActualTimespan > nTargetTimespan*div)
+        nActualTimespan = nTargetTimespan*div;
+    bnNew *= nActualTimespan;
+    bnNew /= nTargetTimespan;
+    if (bnNew > UintToArith256(params.powLimit))
+        bnNew = UintToArith256(params.powLimit);
+    return bnNew.GetCompact();
+}
+
+/* Build a chain with erratic block times and targets */
+static void BuildRandomChain(std::vector<CBlockIndex>& blocks, const Consensus::Params& params)
+{
+    const arith_uint256 bnPowLimit = UintToArith256(params.powLimit);
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        blocks[i].pprev = i ? &blocks[i - 1] : NULL;
+        blocks[i].nHeight = i;
+        blocks[i].nTime = i ? blocks[i - 1].nTime + GetRand(params.nPowTargetSpacing * 4) : 1269211443;
+        blocks[i].nBits = arith_uint256(bnPowLimit >> GetRand(24)).GetCompact();
+        blocks[i].BuildSkip();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(antigravitywave_reference)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+
+    std::vector<CBlockIndex> blocks(500);
+    BuildRandomChain(blocks, params);
+
+    for (int64_t version = 1; version <= 2; version++) {
+        BOOST_CHECK_EQUAL(AntiGravityWave(version, NULL, NULL, params), AntiGravityWaveReference(version, NULL, params));
+        for (unsigned int i = 0; i < blocks.size(); i++)
+            BOOST_CHECK_EQUAL(AntiGravityWave(version, &blocks[i], NULL, params), AntiGravityWaveReference(version, &blocks[i], params));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(get_next_work_reference)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    const Consensus::Params& params = Params().GetConsensus();
+    const int64_t nInterval = params.DifficultyAdjustmentInterval();
+
+    std::vector<CBlockIndex> blocks(nInterval * 3 + 1);
+    BuildRandomChain(blocks, params);
+
+    CBlockHeader header;
+    for (int64_t nHeight = nInterval - 1; nHeight < (int64_t)blocks.size(); nHeight += nInterval) {
+        const CBlockIndex* pindexLast = &blocks[nHeight];
+        // Walk back over the retarget window one block at a time.
+        int blockstogoback = nHeight + 1 == nInterval ? nInterval - 1 : nInterval;
+        const CBlockIndex* pindexFirst = pindexLast;
+        for (int i = 0; pindexFirst && i < blockstogoback; i++)
+            pindexFirst = pindexFirst->pprev;
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(pindexLast, &header, params), CalculateNextWorkRequired(pindexLast, pindexFirst->GetBlockTime(), params));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(powhash_cache)
+{
+    CPoWHashCache cache(16);
+    CBlockHeader header;
+    header.nVersion = 2;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1480000000;
+    header.nBits = 0x1e0ffff0;
+
+    uint256 powhash;
+    BOOST_CHECK(!cache.Get(header.GetHash(), powhash));
+    BOOST_CHECK(cache.GetPoWHash(header) == header.GetPoWHash());
+    BOOST_CHECK(cache.Get(header.GetHash(), powhash));
+    BOOST_CHECK(powhash == header.GetPoWHash());
+    BOOST_CHECK(cache.GetPoWHash(header) == header.GetPoWHash());
+    BOOST_CHECK_EQUAL(cache.GetCount(), 1U);
+
+    // Colliding headers replace each other and never return a wrong hash.
+    for (int i = 0; i < 100; i++) {
+        header.nNonce = i;
+        BOOST_CHECK(cache.GetPoWHash(header) == header.GetPoWHash());
+    }
+    BOOST_CHECK(cache.GetCount() <= 16U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
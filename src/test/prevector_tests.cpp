@@ -225,4 +225,53 @@ BOOST_AUTO_TEST_CASE(PrevectorTestInt)
     }
 }
 
+BOOST_AUTO_TEST_CASE(PrevectorTestNonTrivial)
+{
+    // Elements that own memory, like the script stack's values, must be moved
+    // by copy and destroy when they are shifted or the storage changes.
+    typedef prevector<4, unsigned char> inner;
+    for (int j = 0; j < 64; j++) {
+        std::vector<inner> real_vector, real_vector_alt;
+        prevector<3, inner> pre_vector, pre_vector_alt;
+        for (int i = 0; i < 256; i++) {
+            int r = insecure_rand();
+            inner value((inner::size_type)(insecure_rand() % 40), (unsigned char)insecure_rand());
+            if ((r % 4) == 0) {
+                int pos = insecure_rand() % (real_vector.size() + 1);
+                real_vector.insert(real_vector.begin() + pos, value);
+                pre_vector.insert(pre_vector.begin() + pos, value);
+            }
+            if (real_vector.size() > 0 && ((r >> 2) % 4) == 1) {
+                int pos = insecure_rand() % real_vector.size();
+                real_vector.erase(real_vector.begin() + pos);
+                pre_vector.erase(pre_vector.begin() + pos);
+            }
+            if (((r >> 4) % 8) == 2) {
+                int new_size = insecure_rand() % 8;
+                real_vector.resize(new_size);
+                pre_vector.resize(new_size);
+            }
+            if (((r >> 7) % 8) == 3) {
+                real_vector.push_back(value);
+                pre_vector.push_back(value);
+            }
+            if (((r >> 10) % 16) == 4) {
+                real_vector.swap(real_vector_alt);
+                pre_vector.swap(pre_vector_alt);
+            }
+            if (((r >> 14) % 16) == 5) {
+                pre_vector.shrink_to_fit();
+            }
+            BOOST_CHECK_EQUAL(real_vector.size(), pre_vector.size());
+            for (size_t s = 0; s < real_vector.size(); s++) {
+                BOOST_CHECK(real_vector[s] == pre_vector[s]);
+            }
+        }
+        BOOST_CHECK_EQUAL(real_vector_alt.size(), pre_vector_alt.size());
+        for (size_t s = 0; s < real_vector_alt.size(); s++) {
+            BOOST_CHECK(real_vector_alt[s] == pre_vector_alt[s]);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
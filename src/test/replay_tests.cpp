@@ -0,0 +1,204 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(replay_tests, TestChain100Setup)
+
+typedef std::map<COutPoint, Coin> CoinSet;
+
+/** A coin database that can be left the way an interrupted BatchWrite leaves it */
+class CCoinsViewDBInterrupted : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBInterrupted() : CCoinsViewDB(1 << 20, true, true) {}
+
+    /** Write the first nWritten entries of the transition from the current tip to newTip, and no more. */
+    void WritePartial(const std::vector<std::pair<COutPoint, Coin> >& vChanges, size_t nWritten, const uint256& newTip)
+    {
+        const uint256 oldTip = GetBestBlock();
+        CCoinsMap mapCoins;
+        for (size_t i = 0; i < nWritten; i++) {
+            CCoinsCacheEntry& entry = mapCoins[vChanges[i].first];
+            entry.coin = vChanges[i].second;
+            entry.flags = CCoinsCacheEntry::DIRTY;
+        }
+        // Without a block hash, only the entries are written.
+        BOOST_CHECK(BatchWrite(mapCoins, uint256()));
+        std::vector<uint256> vhashHeadBlocks;
+        vhashHeadBlocks.push_back(newTip);
+        vhashHeadBlocks.push_back(oldTip);
+        CDBBatch batch(db);
+        batch.Erase('B');
+        batch.Write('H', vhashHeadBlocks);
+        BOOST_CHECK(db.WriteBatch(batch));
+    }
+};
+
+static CoinSet ReadCoins(const CCoinsView& view)
+{
+    CoinSet coins;
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint key;
+        Coin coin;
+        BOOST_CHECK(pcursor->GetKey(key) && pcursor->GetValue(coin));
+        coins[key] = coin;
+    }
+    return coins;
+}
+
+/** The UTXO set of the active chain, written the normal way to db */
+static CoinSet ReadTipCoins(const CCoinsView& db)
+{
+    LOCK(cs_main);
+    BOOST_CHECK(pcoinsTip->Flush());
+    BOOST_CHECK(db.GetBestBlock() == chainActive.Tip()->GetBlockHash());
+    return ReadCoins(db);
+}
+
+static bool SameCoin(const Coin& a, const Coin& b)
+{
+    return a.out == b.out && a.nHeight == b.nHeight && a.fCoinBase == b.fCoinBase;
+}
+
+static bool SameCoins(const CoinSet& a, const CoinSet& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (CoinSet::const_iterator ita = a.begin(), itb = b.begin(); ita != a.end(); ++ita, ++itb) {
+        if (ita->first != itb->first || !SameCoin(ita->second, itb->second))
+            return false;
+    }
+    return true;
+}
+
+/** The entries a flush from one UTXO set to the other writes, spent coins being erased */
+static std::vector<std::pair<COutPoint, Coin> > Changes(const CoinSet& from, const CoinSet& to)
+{
+    std::vector<std::pair<COutPoint, Coin> > vChanges;
+    for (CoinSet::const_iterator it = from.begin(); it != from.end(); ++it) {
+        if (!to.count(it->first))
+            vChanges.push_back(std::make_pair(it->first, Coin()));
+    }
+    for (CoinSet::const_iterator it = to.begin(); it != to.end(); ++it) {
+        CoinSet::const_iterator itFrom = from.find(it->first);
+        if (itFrom == from.end() || !SameCoin(itFrom->second, it->second))
+            vChanges.push_back(std::make_pair(it->first, it->second));
+    }
+    return vChanges;
+}
+
+/** Replay every way of interrupting the write from one state to the other, and compare to the clean result. */
+static void CheckReplay(const CoinSet& from, const uint256& hashFrom, const CoinSet& to, const uint256& hashTo)
+{
+    std::vector<std::pair<COutPoint, Coin> > vChanges = Changes(from, to);
+    BOOST_CHECK(!vChanges.empty());
+    const size_t vWritten[] = {0, vChanges.size() / 3, vChanges.size() / 2, vChanges.size()};
+    for (unsigned int i = 0; i < sizeof(vWritten) / sizeof(vWritten[0]); i++) {
+        CCoinsViewDBInterrupted db;
+        if (!hashFrom.IsNull()) {
+            CCoinsMap mapCoins;
+            for (CoinSet::const_iterator it = from.begin(); it != from.end(); ++it) {
+                CCoinsCacheEntry& entry = mapCoins[it->first];
+                entry.coin = it->second;
+                entry.flags = CCoinsCacheEntry::DIRTY;
+            }
+            BOOST_CHECK(db.BatchWrite(mapCoins, hashFrom));
+        }
+        db.WritePartial(vChanges, vWritten[i], hashTo);
+        BOOST_CHECK(db.GetBestBlock().IsNull());
+        BOOST_CHECK_EQUAL(db.GetHeadBlocks().size(), 2U);
+
+        BOOST_CHECK(ReplayBlocks(Params(), &db));
+        BOOST_CHECK(db.GetHeadBlocks().empty());
+        BOOST_CHECK(db.GetBestBlock() == hashTo);
+        BOOST_CHECK(SameCoins(ReadCoins(db), to));
+    }
+}
+
+static CMutableTransaction Spend(const CKey& key, const CTransaction& txPrev, CAmount nValue)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[1].nValue = CENT;
+    tx.vout[1].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(txPrev.vout[0].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(replay_interrupted_writes)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const uint256 hashFork = chainActive.Tip()->GetBlockHash();
+    const CoinSet coinsFork = ReadTipCoins(*pcoinsdbview);
+
+    // Branch A spends a coinbase and then its output.
+    CMutableTransaction txA1 = Spend(coinbaseKey, coinbaseTxns[0], 10 * COIN);
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(1, txA1), scriptPubKey);
+    CMutableTransaction txA2 = Spend(coinbaseKey, txA1, 9 * COIN);
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(1, txA2), scriptPubKey);
+    CBlockIndex* pindexA1 = chainActive[chainActive.Height() - 1];
+    const uint256 hashA = chainActive.Tip()->GetBlockHash();
+    const CoinSet coinsA = ReadTipCoins(*pcoinsdbview);
+
+    // Branch B, from the same fork point, spends that coinbase differently
+    // and becomes the active chain.
+    {
+        CValidationState state;
+        {
+            LOCK(cs_main);
+            BOOST_CHECK(InvalidateBlock(state, Params(), pindexA1));
+        }
+        BOOST_CHECK(ActivateBestChain(state, Params()));
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashFork);
+        // Branch A's transactions went back to the mempool, and their fees
+        // would go into coinbases of blocks that don't include them.
+        mempool.clear();
+    }
+    CMutableTransaction txB1 = Spend(coinbaseKey, coinbaseTxns[0], 20 * COIN);
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(1, txB1), scriptPubKey);
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+    CMutableTransaction txB3 = Spend(coinbaseKey, txB1, 19 * COIN);
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(1, txB3), scriptPubKey);
+    const uint256 hashB = chainActive.Tip()->GetBlockHash();
+    BOOST_CHECK_EQUAL(chainActive.Height(), pindexA1->nHeight + 2);
+    const CoinSet coinsB = ReadTipCoins(*pcoinsdbview);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(ResetBlockFailureFlags(pindexA1));
+    }
+
+    // The first write of the chainstate, from nothing to the tip of A.
+    CheckReplay(CoinSet(), uint256(), coinsA, hashA);
+    // A new tip on the same branch.
+    CheckReplay(coinsFork, hashFork, coinsA, hashA);
+    // A reorganization from A to B across their fork, and back.
+    CheckReplay(coinsA, hashA, coinsB, hashB);
+    CheckReplay(coinsB, hashB, coinsA, hashA);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
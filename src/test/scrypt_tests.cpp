@@ -32,4 +32,36 @@ BOOST_AUTO_TEST_CASE(scrypt_hashtest)
     }
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_multi_hashtest)
+{
+    // Batches of every size up to and past the widest kernel must match the one-at-a-time hash
+#if defined(USE_SSE2)
+    (void) scrypt_detect_sse2();
+#endif
+    const int nMaxCount = 2 * 8 + 3;
+    std::vector<char> input(nMaxCount * 80);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = (char)(i * 7 + 3);
+
+    std::vector<uint256> expected(nMaxCount);
+    for (int i = 0; i < nMaxCount; i++)
+        scrypt_1024_1_1_256(&input[i * 80], BEGIN(expected[i]));
+
+    for (int nCount = 1; nCount <= nMaxCount; nCount += (nCount < 9 ? 1 : 5)) {
+        std::vector<uint256> hashes(nCount);
+        scrypt_1024_1_1_256_multi(&input[0], BEGIN(hashes[0]), nCount);
+        for (int i = 0; i < nCount; i++)
+            BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i].ToString());
+    }
+
+#if defined(USE_SSE2)
+    // Exercise the 4-way kernel directly, whatever scrypt_multi_ways() picked
+    std::vector<char> scratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE(4));
+    std::vector<uint256> hashes(4);
+    scrypt_1024_1_1_256_sp_sse2_4way(&input[80], BEGIN(hashes[0]), &scratchpad[0]);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK_EQUAL(hashes[i].ToString(), expected[i + 1].ToString());
+#endif
+}
+
 BOOST_AUTO_TEST_SUITE_END()
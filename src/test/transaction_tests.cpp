@@ -308,14 +308,14 @@ SetupDummyInputs(CBasicKeyStore& keystoreRet, CCoinsViewCache& coinsRet)
     dummyTransactions[0].vout[0].scriptPubKey << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
     dummyTransactions[0].vout[1].nValue = 50*CENT;
     dummyTransactions[0].vout[1].scriptPubKey << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
-    coinsRet.ModifyCoins(dummyTransactions[0].GetHash())->FromTx(dummyTransactions[0], 0);
+    AddCoins(coinsRet, dummyTransactions[0], 0);
 
     dummyTransactions[1].vout.resize(2);
     dummyTransactions[1].vout[0].nValue = 21*CENT;
     dummyTransactions[1].vout[0].scriptPubKey = GetScriptForDestination(key[2].GetPubKey().GetID());
     dummyTransactions[1].vout[1].nValue = 22*CENT;
     dummyTransactions[1].vout[1].scriptPubKey = GetScriptForDestination(key[3].GetPubKey().GetID());
-    coinsRet.ModifyCoins(dummyTransactions[1].GetHash())->FromTx(dummyTransactions[1], 0);
+    AddCoins(coinsRet, dummyTransactions[1], 0);
 
     return dummyTransactions;
 }
@@ -474,25 +474,15 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction) {
     // check all inputs concurrently, with the cache
     PrecomputedTransactionData txdata(tx);
     boost::thread_group threadGroup;
-    CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+    CCheckQueue<CScriptCheck> scriptcheckqueue(128, 20);
     CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
 
     for (int i=0; i<20; i++)
         threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, boost::ref(scriptcheckqueue)));
 
-    CCoins coins;
-    coins.nVersion = 1;
-    coins.fCoinBase = false;
-    for(uint32_t i = 0; i < mtx.vin.size(); i++) {
-        CTxOut txout;
-        txout.nValue = 1000;
-        txout.scriptPubKey = scriptPubKey;
-        coins.vout.push_back(txout);
-    }
-
     for(uint32_t i = 0; i < mtx.vin.size(); i++) {
         std::vector<CScriptCheck> vChecks;
-        CScriptCheck check(coins, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS, false, &txdata);
+        CScriptCheck check(scriptPubKey, 1000, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_WITNESS, false, &txdata);
         vChecks.push_back(CScriptCheck());
         check.swap(vChecks.back());
         control.Add(vChecks);
@@ -505,6 +495,65 @@ BOOST_AUTO_TEST_CASE(test_big_witness_transaction) {
     threadGroup.join_all();
 }
 
+BOOST_AUTO_TEST_CASE(test_deferred_signature_checks)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptCheckSig = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CScript scriptCheckSigNot = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG << OP_NOT;
+
+    std::vector<CTxOut> vPrevOuts;
+    CMutableTransaction mtx;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000;
+    mtx.vout[0].scriptPubKey = CScript() << OP_1;
+    for (uint32_t i = 0; i < 4; i++) {
+        mtx.vin.push_back(CTxIn(COutPoint(uint256S("0100"), i)));
+        vPrevOuts.push_back(CTxOut(1000, (i & 1) ? scriptCheckSigNot : scriptCheckSig));
+    }
+
+    // The even inputs carry real signatures. The odd ones carry signatures over
+    // the wrong hash, which is what their OP_NOT outputs ask for.
+    std::vector<std::vector<unsigned char> > vSigs;
+    for (uint32_t i = 0; i < mtx.vin.size(); i++) {
+        uint256 hash = SignatureHash(vPrevOuts[i].scriptPubKey, mtx, i, SIGHASH_ALL, 1000, SIGVERSION_BASE);
+        if (i & 1)
+            hash = Hash(hash.begin(), hash.end());
+        std::vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        vSigs.push_back(vchSig);
+        mtx.vin[i].scriptSig = CScript() << vchSig;
+    }
+
+    {
+        CTransaction tx(mtx);
+        PrecomputedTransactionData txdata(tx);
+        std::vector<CScriptCheck> vChecks;
+        for (uint32_t i = 0; i < tx.vin.size(); i++)
+            vChecks.push_back(CScriptCheck(vPrevOuts[i].scriptPubKey, vPrevOuts[i].nValue, tx, i, SCRIPT_VERIFY_P2SH, false, &txdata));
+        BOOST_CHECK(CCheckQueueBatch<CScriptCheck>::Run(vChecks));
+    }
+
+    // With the first two signatures swapped, the first input fails, batched or
+    // not. The second one still passes: its new signature is no more valid
+    // for it than the old one was.
+    mtx.vin[0].scriptSig = CScript() << vSigs[1];
+    mtx.vin[1].scriptSig = CScript() << vSigs[0];
+    {
+        CTransaction tx(mtx);
+        PrecomputedTransactionData txdata(tx);
+        std::vector<CScriptCheck> vChecks;
+        for (uint32_t i = 0; i < tx.vin.size(); i++) {
+            vChecks.push_back(CScriptCheck(vPrevOuts[i].scriptPubKey, vPrevOuts[i].nValue, tx, i, SCRIPT_VERIFY_P2SH, false, &txdata));
+            BOOST_CHECK_EQUAL(CScriptCheck(vPrevOuts[i].scriptPubKey, vPrevOuts[i].nValue, tx, i, SCRIPT_VERIFY_P2SH, false, &txdata)(), i != 0);
+        }
+        BOOST_CHECK(!CCheckQueueBatch<CScriptCheck>::Run(vChecks));
+        std::reverse(vChecks.begin(), vChecks.end());
+        BOOST_CHECK(!CCheckQueueBatch<CScriptCheck>::Run(vChecks));
+    }
+}
+
 BOOST_AUTO_TEST_CASE(test_witness)
 {
     CBasicKeyStore keystore, keystore2;
@@ -9,6 +9,7 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
@@ -83,4 +84,140 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_cache, TestChain100Setup)
+{
+    // Transactions whose scripts passed are remembered per set of flags, so
+    // checking them again hands out no script checks.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    std::vector<CMutableTransaction> spends(2);
+    for (int i = 0; i < 2; i++) {
+        spends[i].vin.resize(1);
+        spends[i].vin[0].prevout.hash = coinbaseTxns[i].GetHash();
+        spends[i].vin[0].prevout.n = 0;
+        spends[i].vout.resize(1);
+        spends[i].vout[0].nValue = 11*CENT;
+        spends[i].vout[0].scriptPubKey = scriptPubKey;
+
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spends[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spends[i].vin[0].scriptSig << vchSig;
+    }
+    // The second spend carries a signature that doesn't verify.
+    spends[1].vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 1);
+
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+
+        const CTransaction tx(spends[0]);
+        PrecomputedTransactionData txdata(tx);
+        std::vector<CScriptCheck> vChecks;
+        BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, flags, true, false, txdata, &vChecks));
+        BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+        // Run inline and stored, after which the same flags hit...
+        BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, flags, true, true, txdata, NULL));
+        vChecks.clear();
+        BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, flags, true, false, txdata, &vChecks));
+        BOOST_CHECK(vChecks.empty());
+
+        // ...while other flags still run the scripts.
+        vChecks.clear();
+        BOOST_CHECK(CheckInputs(tx, state, *pcoinsTip, true, flags | SCRIPT_VERIFY_LOW_S, true, false, txdata, &vChecks));
+        BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+
+        // A failing transaction is never stored.
+        const CTransaction txBad(spends[1]);
+        PrecomputedTransactionData txdataBad(txBad);
+        BOOST_CHECK(!CheckInputs(txBad, state, *pcoinsTip, true, flags, true, true, txdataBad, NULL));
+        vChecks.clear();
+        BOOST_CHECK(CheckInputs(txBad, state, *pcoinsTip, true, flags, true, false, txdataBad, &vChecks));
+        BOOST_CHECK_EQUAL(vChecks.size(), 1U);
+    }
+
+    // A transaction accepted to the mempool is stored with the flags of the
+    // next block, so mining it skips its scripts.
+    CHashCacheStats before, after;
+    GetScriptExecutionCacheStats(before);
+    spends[1] = spends[0];
+    spends[1].vout[0].nValue = 12*CENT;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spends[1], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spends[1].vin[0].scriptSig = CScript() << vchSig;
+    BOOST_CHECK(ToMemPool(spends[1]));
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(1, spends[1]), scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(block.vtx.size(), 2U);
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK(after.nHits > before.nHits);
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_parallel_script_check, TestChain100Setup)
+{
+    // Transactions with many inputs have their scripts checked on the
+    // verification threads when they enter the mempool; a failure there is
+    // looked up again one input at a time to report the reason.
+    BOOST_CHECK(nScriptCheckThreads > 0);
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const unsigned int nInputs = MIN_PARALLEL_SCRIPT_CHECK_INPUTS + 4;
+
+    // Split a mature coinbase into enough outputs and mine them.
+    CMutableTransaction split;
+    split.vin.resize(1);
+    split.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    split.vin[0].prevout.n = 0;
+    split.vout.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        split.vout[i].nValue = 1 * COIN;
+        split.vout[i].scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, split, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    split.vin[0].scriptSig << vchSig;
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(1, split), scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    CMutableTransaction spend;
+    spend.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        spend.vin[i].prevout.hash = split.GetHash();
+        spend.vin[i].prevout.n = i;
+    }
+    spend.vout.resize(1);
+    spend.vout[0].nValue = nInputs * COIN - CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    for (unsigned int i = 0; i < nInputs; i++) {
+        hash = SignatureHash(scriptPubKey, spend, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        vchSig.clear();
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[i].scriptSig = CScript() << vchSig;
+    }
+
+    // One bad signature fails the parallel check, and the serial pass
+    // still names the failure.
+    CMutableTransaction spendBad(spend);
+    spendBad.vin[nInputs / 2].scriptSig = CScript() << std::vector<unsigned char>(72, 1);
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(!AcceptToMemoryPool(mempool, state, spendBad, false, NULL, true, 0));
+        BOOST_CHECK_EQUAL(state.GetRejectCode(), REJECT_INVALID);
+        BOOST_CHECK_EQUAL(state.GetRejectReason().substr(0, 35), "mandatory-script-verify-flag-failed");
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // With every signature valid it is accepted.
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK(mempool.exists(spend.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,136 @@
+// Copyright (c) 2016 The Canada eCoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(writebehind_tests, TestingSetup)
+
+static Coin RandomCoin()
+{
+    Coin coin;
+    coin.out.nValue = insecure_rand();
+    coin.out.scriptPubKey.assign(insecure_rand() % 60, 0x51);
+    coin.nHeight = 1 + insecure_rand() % 1000;
+    coin.fCoinBase = false;
+    return coin;
+}
+
+BOOST_AUTO_TEST_CASE(writebehind_roundtrip)
+{
+    // Force many partial batches.
+    mapArgs["-dbbatchsize"] = "1000";
+    CCoinsViewDB db(1 << 20, true, true);
+    std::vector<COutPoint> vOutPoints;
+    std::vector<Coin> vCoins;
+    {
+        CCoinsViewWriteBehind writer(&db);
+        CCoinsViewCache cache(&writer);
+        for (int i = 0; i < 1000; i++) {
+            vOutPoints.push_back(COutPoint(GetRandHash(), insecure_rand() % 4));
+            vCoins.push_back(RandomCoin());
+            cache.AddCoin(vOutPoints.back(), Coin(vCoins.back()), false);
+        }
+        uint256 hashFirst = GetRandHash();
+        cache.SetBestBlock(hashFirst);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(writer.GetBestBlock() == hashFirst);
+
+        // Carry on on top of the snapshot, whether or not it was written yet.
+        for (size_t i = 0; i < vOutPoints.size(); i += 2) {
+            Coin coin;
+            BOOST_CHECK(cache.SpendCoin(vOutPoints[i], &coin));
+            BOOST_CHECK(coin.out == vCoins[i].out);
+        }
+        uint256 hashSecond = GetRandHash();
+        cache.SetBestBlock(hashSecond);
+        BOOST_CHECK(cache.Flush());
+
+        BOOST_CHECK(writer.Sync());
+        BOOST_CHECK(db.GetBestBlock() == hashSecond);
+        BOOST_CHECK(db.GetHeadBlocks().empty());
+    }
+
+    // Everything made it to disk once the writer is gone.
+    for (size_t i = 0; i < vOutPoints.size(); i++) {
+        Coin coin;
+        BOOST_CHECK_EQUAL(db.GetCoin(vOutPoints[i], coin), i % 2 == 1);
+        if (i % 2)
+            BOOST_CHECK(coin.out == vCoins[i].out && coin.nHeight == vCoins[i].nHeight);
+    }
+    mapArgs.erase("-dbbatchsize");
+}
+
+BOOST_AUTO_TEST_CASE(writebehind_pending_lookups)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    CCoinsViewWriteBehind writer(&db);
+    COutPoint outpoint(GetRandHash(), 0);
+    Coin coinIn = RandomCoin();
+
+    {
+        CCoinsViewCache cache(&writer);
+        cache.AddCoin(outpoint, Coin(coinIn), false);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    // Whether pending or written, the coin is there.
+    Coin coin;
+    BOOST_CHECK(writer.HaveCoin(outpoint));
+    BOOST_CHECK(writer.GetCoin(outpoint, coin));
+    BOOST_CHECK(coin.out == coinIn.out);
+
+    {
+        CCoinsViewCache cache(&writer);
+        BOOST_CHECK(cache.SpendCoin(outpoint));
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!writer.HaveCoin(outpoint));
+    BOOST_CHECK(!writer.GetCoin(outpoint, coin));
+    BOOST_CHECK(writer.Sync());
+    BOOST_CHECK(!db.HaveCoin(outpoint));
+}
+
+/** A coin database whose writes fail */
+class CCoinsViewDBFailing : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBFailing() : CCoinsViewDB(1 << 20, true, true) {}
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
+};
+
+BOOST_AUTO_TEST_CASE(writebehind_failure)
+{
+    CCoinsViewDBFailing db;
+    CCoinsViewWriteBehind writer(&db);
+    COutPoint outpoint(GetRandHash(), 0);
+
+    CCoinsViewCache cache(&writer);
+    cache.AddCoin(outpoint, RandomCoin(), false);
+    cache.SetBestBlock(GetRandHash());
+    // Handing the snapshot over succeeds; writing it does not.
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!writer.Sync());
+
+    // The database lacks the snapshot, so nothing may be answered from it.
+    Coin coin;
+    BOOST_CHECK_THROW(writer.GetCoin(outpoint, coin), std::runtime_error);
+    BOOST_CHECK_THROW(writer.HaveCoin(outpoint), std::runtime_error);
+    BOOST_CHECK_THROW(writer.GetBestBlock(), std::runtime_error);
+    BOOST_CHECK_THROW(delete writer.Cursor(), std::runtime_error);
+
+    // And nothing more is taken.
+    cache.AddCoin(COutPoint(GetRandHash(), 0), RandomCoin(), false);
+    BOOST_CHECK(!cache.Flush());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
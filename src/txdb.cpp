@@ -6,39 +6,136 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "core_memusage.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
 #include "auxpow/auxpow.h"
 #include "uint256.h"
+#include "ui_interface.h"
+#include "util.h"
 
+#include <atomic>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 static const char DB_BLOCK_INDEX_AUXPOW = 'a';
+static const char DB_BLOCK_INDEX_AUXPOW_COMPACT = 'A';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true)
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Per-transaction coins record of the chainstate format before per-output
+ * records, only decoded to upgrade such databases.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 0: IsCoinBase()
+ * - bit 1: vout[0] is not spent
+ * - bit 2: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 1 and bit 2 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull()
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, CHAINSTATE_DB_NAME)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -48,30 +145,313 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks))
+        return std::vector<uint256>();
+    return vhashHeadBlocks;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t batch_size = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+
+    uint256 old_tip = GetBestBlock();
+    if (old_tip.IsNull()) {
+        // We may be in the middle of replaying.
+        std::vector<uint256> old_heads = GetHeadBlocks();
+        if (old_heads.size() == 2) {
+            assert(old_heads[0] == hashBlock);
+            old_tip = old_heads[1];
+        }
+    }
+
+    // In the first batch, mark the database as being in the middle of a
+    // transition from old_tip to hashBlock. Until the last batch is written,
+    // the entries on disk are a mix of both, which ReplayBlocks sorts out
+    // after a crash.
+    if (!hashBlock.IsNull()) {
+        batch.Erase(DB_BEST_BLOCK);
+        std::vector<uint256> vhashHeadBlocks;
+        vhashHeadBlocks.push_back(hashBlock);
+        vhashHeadBlocks.push_back(old_tip);
+        batch.Write(DB_HEAD_BLOCKS, vhashHeadBlocks);
+    }
+
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (batch.SizeEstimate() > batch_size) {
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            db.WriteBatch(batch);
+            batch.Clear();
+        }
     }
-    if (!hashBlock.IsNull())
+
+    // In the last batch, mark the database as consistent with hashBlock again.
+    if (!hashBlock.IsNull()) {
+        batch.Erase(DB_HEAD_BLOCKS);
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
+
+    LogPrint("coindb", "Writing final batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    bool ret = db.WriteBatch(batch);
+    LogPrint("coindb", "Committed %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    return ret;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    std::pair<char, uint256> key;
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_COINS)
+        return true;
+
+    int64_t nTransactions = 0, nOutputs = 0;
+    uiInterface.ShowProgress(_("Upgrading UTXO database..."), 0);
+    LogPrintf("Upgrading UTXO database to per-output records...\n");
+    CDBBatch batch(db);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: cannot parse coins record", __func__);
+        COutPoint outpoint(key.second, 0);
+        for (size_t i = 0; i < coins.vout.size(); i++) {
+            if (!coins.vout[i].IsNull() && !coins.vout[i].scriptPubKey.IsUnspendable()) {
+                outpoint.n = i;
+                batch.Write(CoinEntry(&outpoint), Coin(std::move(coins.vout[i]), coins.nHeight, coins.fCoinBase));
+                nOutputs++;
+            }
+        }
+        // Both formats change in the same batch, so an interrupted upgrade
+        // resumes from the remaining per-transaction records.
+        batch.Erase(key);
+        if (++nTransactions % 10000 == 0) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            uiInterface.ShowProgress(_("Upgrading UTXO database..."), (int)((unsigned char)key.second.begin()[0] * 100 / 256));
+        }
+        pcursor->Next();
+    }
+    db.WriteBatch(batch);
+    uiInterface.ShowProgress("", 100);
+    if (ShutdownRequested())
+        return false;
+    LogPrintf("Upgraded %d transactions to %d per-output UTXO records\n", nTransactions, nOutputs);
+    return true;
+}
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB* dbIn) : CCoinsViewBacked(dbIn), fPending(false), fFailed(false), fStop(false)
+{
+    thread = boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "coinswrite",
+        boost::function<void()>(boost::bind(&CCoinsViewWriteBehind::ThreadWrite, this))));
+}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+        cond.notify_all();
+    }
+    thread.join();
+}
+
+void CCoinsViewWriteBehind::ThreadWrite()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (!fPending && !fStop)
+            cond.wait(lock);
+        // A snapshot handed over before shutdown is still written.
+        if (!fPending)
+            return;
+
+        // Nothing modifies the snapshot while it is pending, and lookups only
+        // read it, so it can be written without holding the lock.
+        lock.unlock();
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapPending, hashPending);
+        } catch (const std::runtime_error& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint("coindb", "Wrote chainstate for %s in the background in %.2fms\n", hashPending.ToString(), 0.001 * (GetTimeMicros() - nStart));
+
+        CCoinsMap mapWritten;
+        lock.lock();
+        fPending = false;
+        if (fOk) {
+            mapPending.swap(mapWritten);
+        } else {
+            // The database may lack any part of the snapshot, so keep it
+            // and refuse lookups from now on.
+            LogPrintf("Failed to write to coin database in the background\n");
+            fFailed = true;
+        }
+        cond.notify_all();
+
+        // Release the memory of the snapshot without holding up lookups.
+        lock.unlock();
+        mapWritten.clear();
+        lock.lock();
+    }
+}
+
+bool CCoinsViewWriteBehind::WaitForWrite(boost::unique_lock<boost::mutex>& lock) const
+{
+    while (fPending)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+void CCoinsViewWriteBehind::CheckFailed() const
+{
+    if (fFailed)
+        throw std::runtime_error("writing to the coin database in the background failed");
+}
+
+bool CCoinsViewWriteBehind::GetCoin(const COutPoint &outpoint, Coin &coin) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CheckFailed();
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end()) {
+            coin = it->second.coin;
+            return !coin.IsSpent();
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewWriteBehind::HaveCoin(const COutPoint &outpoint) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CheckFailed();
+        CCoinsMap::const_iterator it = mapPending.find(outpoint);
+        if (it != mapPending.end())
+            return !it->second.coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    // The database does not know its best block while it is being written.
+    boost::unique_lock<boost::mutex> lock(cs);
+    CheckFailed();
+    if (fPending && !hashPending.IsNull())
+        return hashPending;
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!WaitForWrite(lock))
+        return false;
+    mapPending.swap(mapCoins);
+    hashPending = hashBlock;
+    fPending = true;
+    cond.notify_all();
+    return true;
+}
+
+CCoinsViewCursor *CCoinsViewWriteBehind::Cursor() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitForWrite(lock);
+    CheckFailed();
+    return base->Cursor();
+}
+
+bool CCoinsViewWriteBehind::Sync()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return WaitForWrite(lock);
+}
+
+CAuxPowCache::CAuxPowCache(size_t nMaxUsageIn) : nMaxUsage(nMaxUsageIn), nEntriesUsage(0), nHits(0), nMisses(0) {
+}
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+size_t CAuxPowCache::EntryUsage(const std::shared_ptr<CAuxPow>& auxpow) {
+    // list node holding the entry, plus the auxpow object it points to
+    return memusage::MallocUsage(sizeof(EntryList::value_type) + 2 * sizeof(void*)) +
+           memusage::DynamicUsage(auxpow) + RecursiveDynamicUsage(*auxpow);
+}
+
+size_t CAuxPowCache::DynamicMemoryUsageLocked() const {
+    return nEntriesUsage + memusage::DynamicUsage(map);
+}
+
+bool CAuxPowCache::Get(const uint256& hash, std::shared_ptr<CAuxPow>& auxpow) {
+    LOCK(cs);
+    EntryMap::iterator it = map.find(hash);
+    if (it == map.end()) {
+        nMisses++;
+        return false;
+    }
+    nHits++;
+    lru.splice(lru.begin(), lru, it->second);
+    auxpow = it->second->second;
+    return true;
+}
+
+void CAuxPowCache::Insert(const uint256& hash, const std::shared_ptr<CAuxPow>& auxpow) {
+    if (!auxpow)
+        return;
+    LOCK(cs);
+    if (map.count(hash))
+        return;
+    lru.push_front(std::make_pair(hash, auxpow));
+    map.insert(std::make_pair(hash, lru.begin()));
+    nEntriesUsage += EntryUsage(auxpow);
+    while (!lru.empty() && DynamicMemoryUsageLocked() > nMaxUsage) {
+        nEntriesUsage -= EntryUsage(lru.back().second);
+        map.erase(lru.back().first);
+        lru.pop_back();
+    }
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+size_t CAuxPowCache::GetCount() const {
+    LOCK(cs);
+    return map.size();
+}
+
+size_t CAuxPowCache::DynamicMemoryUsage() const {
+    LOCK(cs);
+    return DynamicMemoryUsageLocked();
+}
+
+uint64_t CAuxPowCache::GetHits() const {
+    LOCK(cs);
+    return nHits;
+}
+
+uint64_t CAuxPowCache::GetMisses() const {
+    LOCK(cs);
+    return nMisses;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nAuxPowCacheSize) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, BLOCKINDEX_DB_NAME), auxpowcache(nAuxPowCacheSize) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -100,25 +480,31 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -128,14 +514,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 /*
@@ -162,19 +552,46 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
         const std::map<uint256, std::shared_ptr<CAuxPow> >::const_iterator auxIt = auxpows.find((*it)->GetBlockHash());
         if (auxIt != auxpows.end()) {
 //                LogPrint("txdb", "CBlockTreeDB::WriteBatchSync(): writing an auxpow block (%s)) \n", (*it)->GetBlockHash().ToString()); // LEDTMP
-            batch.Write(make_pair(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), DB_BLOCK_INDEX_AUXPOW), CDiskBlockIndex(*it, auxIt->second));
+            CDiskBlockIndex diskindex(*it, auxIt->second);
+            batch.Write(make_pair(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), DB_BLOCK_INDEX_AUXPOW_COMPACT), CCompactDiskBlockIndex(diskindex));
+            // Never leave a record in both formats behind.
+            batch.Erase(make_pair(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), DB_BLOCK_INDEX_AUXPOW));
         }
 //                LogPrint("txdb", "CBlockTreeDB::WriteBatchSync(): writing a normal block (%s)) \n", (*it)->GetBlockHash().ToString()); // LEDTMP
         batch.Write(make_pair(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), DB_BLOCK_INDEX), **it);
     }
-    return WriteBatch(batch, true);
+    if (!WriteBatch(batch, true))
+        return false;
+    // The written auxpows are about to leave mapDirtyAuxPow; keep the most
+    // recent ones around, as peers are likely to ask for these headers next.
+    for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
+        const std::map<uint256, std::shared_ptr<CAuxPow> >::const_iterator auxIt = auxpows.find((*it)->GetBlockHash());
+        if (auxIt != auxpows.end())
+            auxpowcache.Insert(auxIt->first, auxIt->second);
+    }
+    return true;
 }
 
 bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &diskblockindex)
 {
+    CCompactDiskBlockIndex compactindex(diskblockindex);
+    if (Read(make_pair(make_pair(DB_BLOCK_INDEX, blkid), DB_BLOCK_INDEX_AUXPOW_COMPACT), compactindex))
+        return true;
     return Read(make_pair(make_pair(DB_BLOCK_INDEX, blkid), DB_BLOCK_INDEX_AUXPOW), diskblockindex);
 }
 
+bool CBlockTreeDB::ReadAuxPow(const uint256 &blkid, std::shared_ptr<CAuxPow>& auxpow)
+{
+    if (auxpowcache.Get(blkid, auxpow))
+        return true;
+    CDiskBlockIndex diskblockindex;
+    if (!ReadDiskBlockIndex(blkid, diskblockindex))
+        return false;
+    auxpow = diskblockindex.auxpow;
+    auxpowcache.Insert(blkid, auxpow);
+    return true;
+}
+
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
@@ -199,64 +616,140 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+/**
+ * Decode the block index records whose hash starts with a byte in
+ * [nBegin, nEnd). Only the header is read, auxpows are read on demand
+ * through ReadAuxPow(). Both record formats share the header prefix.
+ */
+static bool LoadBlockIndexRange(CBlockTreeDB& db, unsigned int nBegin, unsigned int nEnd,
+                                std::vector<std::pair<uint256, CDiskBlockIndex> >& vIndex, std::atomic<unsigned int>& nLoaded)
 {
-    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
 
-    auto ssKeySet(std::make_pair(std::make_pair(DB_BLOCK_INDEX, uint256()), DB_BLOCK_INDEX_AUXPOW));
-    pcursor->Seek(ssKeySet);
-   printf("txdb", "ssKeySet: '%x%s%x'\n", ssKeySet.first.first, ssKeySet.first.second.ToString(), ssKeySet.second); // LEDTMP
+    uint256 hashBegin;
+    *hashBegin.begin() = nBegin;
+    pcursor->Seek(make_pair(make_pair(DB_BLOCK_INDEX, hashBegin), DB_BLOCK_INDEX_AUXPOW_COMPACT));
 
-    // Load mapBlockIndex
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
         std::pair < std::pair < char, uint256 > , char > key;
-        if (pcursor->GetKey(key) && key.first.first == DB_BLOCK_INDEX) {
-           printf("DB_BLOCK_INDEX: '%d'", DB_BLOCK_INDEX); // LEDTMP
-           printf("--"); // LEDTMP
-           printf("key: '%x'\n", key.second); // LEDTMP
-// sleep(5000);
-            assert(key.second == DB_BLOCK_INDEX_AUXPOW);
+        if (!pcursor->GetKey(key) || key.first.first != DB_BLOCK_INDEX || *key.first.second.begin() >= nEnd)
+            break;
+        assert(key.second == DB_BLOCK_INDEX_AUXPOW_COMPACT || key.second == DB_BLOCK_INDEX_AUXPOW);
 
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-
-                // Construct immutable parts of block index object
-                uint256 hash = key.first.second;
-                CBlockIndex* pindexNew = insertBlockIndex(hash);
-//                LogPrint("txdb", "                    hash: '%s'\n", hash.ToString()); // LEDTMP
-//                LogPrint("txdb", "diskindex.GetBlockHash(): '%s'\n", diskindex.GetBlockHash().ToString()); // LEDTMP
-                assert(diskindex.GetBlockHash() == *pindexNew->phashBlock); // paranoia check
-
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nTx            = diskindex.nTx;
-
-                pcursor->Next(); // now we should be on the 'b' subkey
-                assert(pcursor->Valid());
-
-                pcursor->GetKey(key);
-                assert(key.first.second == hash);     // next key's hash must be the same
-                assert(key.second == DB_BLOCK_INDEX); // next key must be a 'b' subkey of the same b block
-
-//            LogPrint("txdb", "    key2: '%x%s%x'\n", key.first.first, key.first.second.ToString(), key.second); // LEDTMP
-
-                // read all mutable data
-                pcursor->GetValue(*pindexNew);
-
-                pcursor->Next();
-            } else {
-                return error("LoadBlockIndex() : failed to read value");
+        const uint256 hash = key.first.second;
+        vIndex.push_back(std::make_pair(hash, CDiskBlockIndex()));
+        CDiskBlockIndex& diskindex = vIndex.back().second;
+        CCompactDiskBlockIndex headerindex(diskindex, true);
+        if (!pcursor->GetValue(headerindex))
+            return error("LoadBlockIndex() : failed to read value");
+        assert(diskindex.GetBlockHash() == hash); // paranoia check
+
+        pcursor->Next(); // now we should be on the 'b' subkey
+        assert(pcursor->Valid());
+
+        pcursor->GetKey(key);
+        assert(key.first.second == hash);     // next key's hash must be the same
+        assert(key.second == DB_BLOCK_INDEX); // next key must be a 'b' subkey of the same b block
+
+        // read all mutable data
+        if (!pcursor->GetValue(static_cast<CBlockIndex&>(diskindex)))
+            return error("LoadBlockIndex() : failed to read value");
+
+        pcursor->Next();
+        ++nLoaded;
+    }
+    return true;
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, int nThreads)
+{
+    const int64_t nStart = GetTimeMillis();
+    std::atomic<unsigned int> nLoaded(0);
+
+    // Decode the records in parallel, each thread covering a slice of the key range.
+    nThreads = std::max(1, std::min(nThreads, 256));
+    std::vector<std::vector<std::pair<uint256, CDiskBlockIndex> > > vRanges(nThreads);
+    boost::scoped_array<bool> pfOk(new bool[nThreads]);
+    boost::thread_group threads;
+    for (int i = 1; i < nThreads; i++) {
+        pfOk[i] = false;
+        threads.create_thread([this, i, nThreads, &vRanges, &pfOk, &nLoaded]() {
+            pfOk[i] = LoadBlockIndexRange(*this, 256 * i / nThreads, 256 * (i + 1) / nThreads, vRanges[i], nLoaded);
+        });
+    }
+    boost::thread progress([&nLoaded, nStart]() {
+        try {
+            while (true) {
+                boost::this_thread::sleep_for(boost::chrono::seconds(10));
+                LogPrintf("LoadBlockIndexGuts: loaded %u block index entries (%.2fs)\n", (unsigned int)nLoaded, (GetTimeMillis() - nStart) * 0.001);
             }
-        } else {
-            break;
+        } catch (const boost::thread_interrupted&) {}
+    });
+    pfOk[0] = LoadBlockIndexRange(*this, 0, 256 / nThreads, vRanges[0], nLoaded);
+    threads.join_all();
+    progress.interrupt();
+    progress.join();
+    for (int i = 0; i < nThreads; i++) {
+        if (!pfOk[i])
+            return false;
+    }
+    boost::this_thread::interruption_point();
+
+    // Construct the block index objects and link them to their parents.
+    for (int i = 0; i < nThreads; i++) {
+        for (const auto& item : vRanges[i]) {
+            const CDiskBlockIndex& diskindex = item.second;
+            CBlockIndex* pindexNew = insertBlockIndex(item.first);
+            const uint256* phashBlock = pindexNew->phashBlock;
+            *pindexNew = diskindex;
+            pindexNew->phashBlock = phashBlock;
+            pindexNew->pprev = insertBlockIndex(diskindex.hashPrev);
         }
+        std::vector<std::pair<uint256, CDiskBlockIndex> >().swap(vRanges[i]);
     }
 
+    LogPrintf("%s: loaded %u block index entries in %dms using %d threads\n", __func__, (unsigned int)nLoaded, GetTimeMillis() - nStart, nThreads);
     return true;
 }
+
+bool CBlockTreeDB::Upgrade()
+{
+    bool fCompact = false;
+    if (ReadFlag("compactauxpow", fCompact) && fCompact)
+        return true;
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+
+    int64_t nUpgraded = 0;
+    uiInterface.ShowProgress(_("Upgrading block index database..."), 0);
+    LogPrintf("Upgrading block index database; older versions will need -reindex to read it...\n");
+    CDBBatch batch(*this);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        std::pair<std::pair<char, uint256>, char> key;
+        if (!pcursor->GetKey(key) || key.first.first != DB_BLOCK_INDEX)
+            break;
+        if (key.second == DB_BLOCK_INDEX_AUXPOW) {
+            CDiskBlockIndex diskindex;
+            if (!pcursor->GetValue(diskindex))
+                return error("%s: cannot parse block index record", __func__);
+            batch.Write(make_pair(key.first, DB_BLOCK_INDEX_AUXPOW_COMPACT), CCompactDiskBlockIndex(diskindex));
+            batch.Erase(key);
+            if (++nUpgraded % 10000 == 0) {
+                WriteBatch(batch);
+                batch.Clear();
+                uiInterface.ShowProgress(_("Upgrading block index database..."), (int)((unsigned char)key.first.second.begin()[0] * 100 / 256));
+            }
+        }
+        pcursor->Next();
+    }
+    WriteBatch(batch);
+    uiInterface.ShowProgress("", 100);
+    if (ShutdownRequested())
+        return false;
+    LogPrintf("Upgraded %d block index records to the compact auxpow format\n", nUpgraded);
+    return WriteFlag("compactauxpow", true);
+}
@@ -9,13 +9,17 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "sync.h"
 
+#include <list>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -23,6 +27,8 @@ class uint256;
 
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 300;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
 //! max. -dbcache (MiB)
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache (MiB)
@@ -35,6 +41,13 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Max memory allocated to the in-memory auxpow cache (MiB)
+static const int64_t nMaxAuxPowCache = 64;
+//! -backgroundflush default
+static const bool DEFAULT_BACKGROUND_FLUSH = false;
+//! Names of the coin and block index databases, as used by -dbprofile
+static const char* const CHAINSTATE_DB_NAME = "chainstate";
+static const char* const BLOCKINDEX_DB_NAME = "blockindex";
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -69,11 +82,68 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
+    std::vector<uint256> GetHeadBlocks() const;
+    //! Write the dirty entries in batches of -dbbatchsize, leaving mapCoins untouched
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Convert per-transaction coin records to the per-output format
+    bool Upgrade();
+};
+
+/**
+ * Writes the chainstate to the coin database from a background thread.
+ * BatchWrite takes over the entries it is handed and returns at once, so
+ * that flushing the coins cache under cs_main costs no more than a swap.
+ * Until they are written, lookups are answered from those entries, on top
+ * of which validation simply carries on. Only one snapshot is written at a
+ * time: handing over the next one first waits for the previous write.
+ *
+ * The snapshot can use as much memory as the cache it came from, so that
+ * up to twice -dbcache may be in use while a write is in progress.
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+private:
+    mutable CWaitableCriticalSection cs;
+    //! Signalled when a snapshot was handed over or written, or on shutdown
+    mutable CConditionVariable cond;
+    //! Entries being written, for the block in hashPending
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    bool fPending;
+    //! Set when a write failed. The snapshot stays in mapPending, later
+    //! writes are refused and lookups throw.
+    bool fFailed;
+    bool fStop;
+    boost::thread thread;
+
+    void ThreadWrite();
+    bool WaitForWrite(boost::unique_lock<boost::mutex>& lock) const;
+    //! Throw if a write failed, as the database may then lack what was handed over
+    void CheckFailed() const;
+
+    CCoinsViewWriteBehind(const CCoinsViewWriteBehind&);
+    CCoinsViewWriteBehind& operator=(const CCoinsViewWriteBehind&);
+
+public:
+    //! The database must leave the entries it writes in place, as CCoinsViewDB does
+    CCoinsViewWriteBehind(CCoinsViewDB* dbIn);
+    //! Finish the pending write, if any, and stop the thread
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Wait for the pending write, so that the cursor sees the whole state
+    CCoinsViewCursor *Cursor() const;
+
+    //! Wait until everything handed over has been written. False if writing failed.
+    bool Sync();
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -82,8 +152,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -93,22 +163,66 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
 
+/**
+ * Bounded LRU cache of deserialized auxpow data, keyed by block hash. It sits
+ * in front of the block tree database so that serving merge-mined headers
+ * does not need a database read per header. The memory limit covers the
+ * cached objects as well as the cache's own bookkeeping.
+ */
+class CAuxPowCache
+{
+private:
+    typedef std::list<std::pair<uint256, std::shared_ptr<CAuxPow> > > EntryList;
+    typedef boost::unordered_map<uint256, EntryList::iterator, SaltedTxidHasher> EntryMap;
+
+    mutable CCriticalSection cs;
+    //! Entries ordered from most to least recently used
+    EntryList lru;
+    EntryMap map;
+    size_t nMaxUsage;
+    //! Memory used by the entries in lru (the index is accounted separately)
+    size_t nEntriesUsage;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    static size_t EntryUsage(const std::shared_ptr<CAuxPow>& auxpow);
+    size_t DynamicMemoryUsageLocked() const;
+
+public:
+    CAuxPowCache(size_t nMaxUsageIn);
+
+    //! Look up the auxpow of a block, marking it as recently used
+    bool Get(const uint256& hash, std::shared_ptr<CAuxPow>& auxpow);
+    //! Add the auxpow of a block, evicting least recently used entries to stay within the limit
+    void Insert(const uint256& hash, const std::shared_ptr<CAuxPow>& auxpow);
+
+    size_t GetCount() const;
+    size_t DynamicMemoryUsage() const;
+    size_t GetMaxUsage() const { return nMaxUsage; }
+    uint64_t GetHits() const;
+    uint64_t GetMisses() const;
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, size_t nAuxPowCacheSize = nMaxAuxPowCache << 20);
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+    CAuxPowCache auxpowcache;
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, const std::map<uint256, std::shared_ptr<CAuxPow> >& auxpows = mapDirtyAuxPow);
     bool ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex& diskblockindex);
+    //! Read the auxpow of a block, going through the in-memory auxpow cache
+    bool ReadAuxPow(const uint256 &blkid, std::shared_ptr<CAuxPow>& auxpow);
+    const CAuxPowCache& GetAuxPowCache() const { return auxpowcache; }
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -117,7 +231,10 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! Load the block index, decoding the records on nThreads threads
+    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, int nThreads = 1);
+    //! Convert block index records from the full to the compact auxpow format
+    bool Upgrade();
 };
 
 #endif // BITCOIN_TXDB_H
@@ -211,6 +211,9 @@ int GetNumCores();
 
 void RenameThread(const char* name);
 
+/** Restrict the calling thread to one core. Returns false where unsupported. */
+bool SetThreadAffinity(int nCore);
+
 /**
  * .. and a wrapper that just calls func once
  */